@@ -0,0 +1,129 @@
+/**
+ * @file arena.c
+ *
+ * Per-thread bump allocator implementation.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+struct arena_chunk
+{
+  arena_chunk_t *next; // chunks past the current one are kept for reuse
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+typedef struct arena
+{
+  arena_chunk_t *first;
+  arena_chunk_t *current;
+  long chunk_allocs;
+} arena_t;
+
+static __thread arena_t arena;
+static pthread_key_t arena_key; // holds each thread's first chunk, so its chunks are freed when it exits
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+// FUSE retires idle worker threads, their chunks are freed on the way out
+static void arena_thread_exit(void *first)
+{
+  for (arena_chunk_t *chunk = first; chunk != 0;)
+  {
+    arena_chunk_t *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  arena.first = 0;
+  arena.current = 0;
+}
+
+static void arena_key_create()
+{
+  int rv = pthread_key_create(&arena_key, arena_thread_exit);
+  assert(rv == 0);
+}
+
+static arena_chunk_t *chunk_new(size_t size, arena_chunk_t *next)
+{
+  arena_chunk_t *chunk = malloc(sizeof(arena_chunk_t) + size);
+  assert(chunk != 0);
+  chunk->next = next;
+  chunk->size = size;
+  chunk->used = 0;
+  arena.chunk_allocs++;
+  return chunk;
+}
+
+void *arena_alloc(size_t size)
+{
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (arena.current == 0)
+  {
+    arena.first = chunk_new(size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE, 0);
+    arena.current = arena.first;
+    pthread_once(&arena_key_once, arena_key_create);
+    pthread_setspecific(arena_key, arena.first);
+  }
+
+  arena_chunk_t *chunk = arena.current;
+  while (chunk->size - chunk->used < size)
+  { // move on to a spare chunk, or add one big enough after the current one
+    if (chunk->next != 0 && chunk->next->size >= size)
+    {
+      chunk = chunk->next;
+      chunk->used = 0;
+    }
+    else
+    {
+      chunk->next = chunk_new(size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE, chunk->next);
+      chunk = chunk->next;
+    }
+  }
+  arena.current = chunk;
+
+  void *out = chunk->data + chunk->used;
+  chunk->used += size;
+  return out;
+}
+
+char *arena_strdup(const char *text)
+{
+  size_t len = strlen(text) + 1;
+  char *copy = arena_alloc(len);
+  memcpy(copy, text, len);
+  return copy;
+}
+
+arena_mark_t arena_mark()
+{
+  arena_mark_t mark = {arena.current, arena.current ? arena.current->used : 0};
+  return mark;
+}
+
+void arena_release(arena_mark_t *mark)
+{
+  if (mark->chunk == 0)
+  { // nothing had been allocated yet when the mark was taken
+    arena.current = arena.first;
+    if (arena.current != 0)
+    {
+      arena.current->used = 0;
+    }
+    return;
+  }
+  arena.current = mark->chunk;
+  arena.current->used = mark->used;
+}
+
+long arena_chunk_allocs()
+{
+  return arena.chunk_allocs;
+}
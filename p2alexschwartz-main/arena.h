@@ -0,0 +1,65 @@
+/**
+ * @file arena.h
+ *
+ * A per-thread bump allocator for scratch memory that only has to live
+ * for the duration of one FUSE request.
+ *
+ * Memory is never freed individually. A callback takes a mark on entry and
+ * releases back to it when it returns, so nested callbacks (mkdir calling
+ * mknod, readdir calling getattr) each give back only what they used.
+ * Chunks are kept per thread and reused, so a warmed up thread serves
+ * requests without calling malloc at all, and freed when the thread exits.
+ */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+typedef struct arena_chunk arena_chunk_t;
+
+typedef struct arena_mark
+{
+  arena_chunk_t *chunk; // the chunk that was current when the mark was taken
+  size_t used;          // how much of it was in use
+} arena_mark_t;
+
+/**
+ * Allocate scratch memory from the calling thread's arena.
+ *
+ * @param size Number of bytes needed.
+ *
+ * @return Pointer to the memory, valid until the enclosing mark is released.
+ */
+void *arena_alloc(size_t size);
+
+/**
+ * Copy a string into the calling thread's arena.
+ *
+ * @param text String to copy.
+ *
+ * @return The copy, valid until the enclosing mark is released.
+ */
+char *arena_strdup(const char *text);
+
+/**
+ * Remember the current top of the calling thread's arena.
+ *
+ * @return A mark to pass to arena_release.
+ */
+arena_mark_t arena_mark();
+
+/**
+ * Give back everything allocated since the given mark was taken.
+ *
+ * Takes a pointer so it can be used as a cleanup attribute handler.
+ *
+ * @param mark A mark taken on this thread.
+ */
+void arena_release(arena_mark_t *mark);
+
+/**
+ * Number of chunks the calling thread has had to malloc so far.
+ */
+long arena_chunk_allocs();
+
+#endif
@@ -0,0 +1,90 @@
+/**
+ * @file backend.h
+ *
+ * How blocks get from the image file into memory and back.
+ *
+ * blocks.c asks the backend for a pointer to a block and says whether it
+ * is going to change it. The pointer stays valid until the end of the
+ * request (see backend_t.request_done), which is when the storage lock is
+ * last let go.
+ *
+ * - mmap maps the whole image, the kernel does all the I/O.
+ * - pread keeps a CLOCK cache of blocks read with pread, written back
+ *   with pwrite when a request is done with them.
+ * - direct is pread with O_DIRECT, so the cache is the only copy in memory.
+ * - uring and uring-direct are pread and direct with the I/O done through
+ *   io_uring, in batches.
+ * - memory and memfd map scratch memory instead of the image file, for
+ *   mounts thrown away at unmount. Nothing is ever written to disk.
+ *
+ * The metadata region (block 0 and the live inode table) is always
+ * resident.
+ */
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include "blocks.h"
+
+#define META_BLOCKS (INODE_TABLE_START + INODE_TABLE_BLOCKS)
+#define DEFAULT_CACHE_BLOCKS 64
+#define DEFAULT_QUEUE_DEPTH 64
+
+// where a backend keeps the image
+#define IMAGE_FILE 0      // the file at the path given to blocks_init
+#define IMAGE_MEMFD 1     // a memfd named after the path
+#define IMAGE_ANONYMOUS 2 // anonymous memory, attach gets fd -1
+
+typedef struct backend
+{
+  const char *name;
+  int image;                                          // IMAGE_FILE, IMAGE_MEMFD or IMAGE_ANONYMOUS
+  int open_flags;                                     // added to the flags the image is opened with
+  void (*attach)(int fd, const map_policy_t *policy); // start serving the opened image
+  void *(*block)(int bnum, int write);                // write says the caller may change the block
+  void (*prefetch)(const int *bnums, int count);      // these blocks are about to be used
+  void (*advise)(int bnum, int count, int advice);    // MADV_ hint for a run of blocks
+  void (*request_done)();                             // blocks handed out so far may go
+  int (*flush)();                                     // everything on disk, 0 or -1
+  void (*detach)();
+} backend_t;
+
+typedef struct backend_stats
+{
+  long hits;       // blocks found in the cache
+  long misses;     // blocks read from the image
+  long writebacks; // blocks written to the image
+  long overflows;  // frames added past the budget because everything was in use
+  long read_errors; // blocks that couldn't be read, served as zeros that are never cached
+  long frames;      // frames held now, the budget plus overflows not given back yet
+} backend_stats_t;
+
+extern const backend_t mmap_backend;
+extern const backend_t pread_backend;
+extern const backend_t direct_backend;
+extern const backend_t uring_backend;
+extern const backend_t uring_direct_backend;
+extern const backend_t memory_backend;
+extern const backend_t memfd_backend;
+
+/**
+ * Set how many blocks the pread and direct backends may cache, used from
+ * the next attach on.
+ *
+ * @param blocks Number of blocks, at least 1.
+ */
+void backend_set_cache(int blocks);
+
+/**
+ * Set how many operations the uring backends keep in flight at most, used
+ * from the next attach on.
+ *
+ * @param depth The io_uring submission queue size, rounded up to a power of two.
+ */
+void backend_set_queue_depth(int depth);
+
+/**
+ * Counters of the cache since it was attached.
+ */
+backend_stats_t *backend_get_stats();
+
+#endif
@@ -0,0 +1,590 @@
+/**
+ * @file backend_file.c
+ *
+ * The pread, direct and uring backends: the metadata region plus a CLOCK
+ * cache of data blocks, read and written with pread/pwrite or io_uring.
+ *
+ * Blocks handed out in the current request are pinned, CLOCK passes over
+ * them. If every frame is pinned the cache goes over its budget instead of
+ * handing out a pointer that is still in use, and gives the extra frames
+ * back when the request is done. A prefetch only fills frames that are
+ * free, it never goes over. When a request is done the blocks it changed
+ * are written back, so the image file is as up to date as with the mmap
+ * backend.
+ *
+ * With io_uring the write back is one batch per request, and the blocks a
+ * read is about to need (blocks_prefetch) or readahead asks for are read
+ * in one batch that is only waited for when a block is actually used, so
+ * reads stay in flight across requests. The first frames are one
+ * registered buffer and the image is a registered file. A flush queues the
+ * fsync behind the write back with IOSQE_IO_DRAIN, so both go in one
+ * submission. The writes aren't linked (IOSQE_IO_LINK): a link chain runs
+ * one operation after another, which would serialize the batch, and
+ * nothing here needs one block on disk before another.
+ *
+ * A block that can't be read is never cached: its frame is emptied, so the
+ * caller gets zeros that are good until the end of the request, are never
+ * written back, and the next use of the block reads it again. The failure
+ * is counted in read_errors for the caller to turn into -EIO.
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "uring.h"
+
+typedef struct frame
+{
+  int bnum;            // -1 for a frame that holds nothing
+  uint8_t referenced;  // CLOCK's second chance
+  uint8_t dirty;
+  uint8_t loading;     // a read into it is in flight, or REREAD if it has to be submitted again
+  unsigned int pinned; // the request epoch it was last handed out in
+  void *data;
+} frame_t;
+
+// what an io_uring completion was for, in the low bits of its user_data
+enum
+{
+  IO_READ,
+  IO_WRITE,
+  IO_FSYNC,
+};
+#define IO_KINDS 4
+#define REREAD 2 // frame_t.loading of a read the kernel gave up on for now (-ECANCELED, -EAGAIN)
+
+static int image_fd = -1;
+static int budget = DEFAULT_CACHE_BLOCKS;
+static int queue_depth = DEFAULT_QUEUE_DEPTH;
+static void *meta = 0;       // the metadata region, always resident
+static void *meta_saved = 0; // what it looked like on disk after the last request
+static void *pool = 0;       // the first pool_frames frames, registered with io_uring
+static int pool_frames = 0;  // the budget when the image was attached
+static frame_t *frames = 0;
+static int frame_count = 0;
+static int *frame_of = 0; // BLOCK_COUNT entries, -1 if the block isn't cached
+static int hand = 0;
+static unsigned int epoch = 1;
+static backend_stats_t stats;
+
+static int use_uring = 0;
+static uring_t ring;
+static int fixed = 0;       // the image and the pool are registered
+static int writes_left = 0; // writes (and the fsync) of the current batch not completed yet
+static int io_errors = 0;
+static int rereads = 0; // frames with loading == REREAD
+
+// Page aligned, as O_DIRECT wants.
+static void *alloc_aligned(size_t size)
+{
+  void *memory = 0;
+  int rv = posix_memalign(&memory, 4096, size);
+  assert(rv == 0);
+  memset(memory, 0, size);
+  return memory;
+}
+
+// 0, or -1 with the data zeroed if the block couldn't be read whole
+static int read_block(int bnum, void *data)
+{
+  if (pread(image_fd, data, BLOCK_SIZE, (off_t)bnum * BLOCK_SIZE) != BLOCK_SIZE)
+  {
+    perror("pread");
+    memset(data, 0, BLOCK_SIZE);
+    return -1;
+  }
+  return 0;
+}
+
+// The frame's read failed: it holds zeros and no block, so it is never written back
+static void frame_failed(int index)
+{
+  frame_t *frame = &frames[index];
+  memset(frame->data, 0, BLOCK_SIZE);
+  if (frame->bnum != -1 && frame_of[frame->bnum] == index)
+  {
+    frame_of[frame->bnum] = -1;
+  }
+  frame->bnum = -1;
+  frame->dirty = 0;
+  stats.read_errors++;
+}
+
+static void write_block(int bnum, const void *data)
+{
+  if (pwrite(image_fd, data, BLOCK_SIZE, (off_t)bnum * BLOCK_SIZE) != BLOCK_SIZE)
+  {
+    perror("pwrite");
+    io_errors++;
+  }
+  stats.writebacks++;
+}
+
+static void io_done(uint64_t user_data, int result)
+{
+  int kind = user_data % IO_KINDS;
+  int index = user_data / IO_KINDS;
+  if (kind == IO_READ)
+  {
+    if (result == -ECANCELED || result == -EAGAIN || result == -EINTR)
+    { // e.g. a retry cut short by a signal, queued again once the completions are handed out
+      frames[index].loading = REREAD;
+      rereads++;
+      return;
+    }
+    frames[index].loading = 0;
+    if (result != BLOCK_SIZE)
+    {
+      fprintf(stderr, "io_uring read of block %d -> %d\n", frames[index].bnum, result);
+      frame_failed(index);
+    }
+    return;
+  }
+  if (kind == IO_WRITE || kind == IO_FSYNC)
+  {
+    writes_left--;
+  }
+  if (result < 0 || (kind == IO_WRITE && result != BLOCK_SIZE))
+  {
+    fprintf(stderr, "io_uring %s -> %d\n", kind == IO_WRITE ? "write" : "fsync", result);
+    io_errors++;
+  }
+}
+
+// A cleared sqe for the image, submitting what is queued first if the ring is full
+static struct io_uring_sqe *image_sqe(int opcode, void *data, off_t offset, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe;
+  while ((sqe = uring_sqe(&ring)) == 0)
+  {
+    uring_submit(&ring, 1);
+    uring_reap(&ring, io_done);
+  }
+  int in_pool = fixed && data >= pool && data < pool + pool_frames * BLOCK_SIZE;
+  if (opcode == IORING_OP_READ && in_pool)
+  {
+    opcode = IORING_OP_READ_FIXED;
+  }
+  else if (opcode == IORING_OP_WRITE && in_pool)
+  {
+    opcode = IORING_OP_WRITE_FIXED;
+  }
+  sqe->opcode = opcode;
+  sqe->fd = fixed ? 0 : image_fd;
+  sqe->flags = fixed ? IOSQE_FIXED_FILE : 0;
+  sqe->addr = (uint64_t)data;
+  sqe->len = opcode == IORING_OP_FSYNC ? 0 : BLOCK_SIZE;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+  return sqe;
+}
+
+static void queue_read(int index)
+{
+  frames[index].loading = 1;
+  image_sqe(IORING_OP_READ, frames[index].data, (off_t)frames[index].bnum * BLOCK_SIZE,
+            (uint64_t)index * IO_KINDS + IO_READ);
+}
+
+// Queue the reads io_done put off again, outside of uring_reap
+static void queue_rereads()
+{
+  for (int i = 0; rereads > 0 && i < frame_count; i++)
+  {
+    if (frames[i].loading == REREAD)
+    {
+      rereads--;
+      queue_read(i);
+    }
+  }
+}
+
+static void queue_write(int bnum, void *data)
+{
+  writes_left++;
+  stats.writebacks++;
+  image_sqe(IORING_OP_WRITE, data, (off_t)bnum * BLOCK_SIZE, IO_WRITE);
+}
+
+// Submit what is queued and wait for a completion, then hand out every completion there is.
+// A wait cut short by a signal is tried again. Returns 0, or the -errno the ring failed with
+static int ring_wait()
+{
+  int rv;
+  do
+  {
+    rv = uring_submit(&ring, 1);
+    uring_reap(&ring, io_done);
+    queue_rereads();
+  } while (rv == -EINTR || rv == -EAGAIN || rv == -EBUSY);
+  if (rv != 0)
+  {
+    fprintf(stderr, "io_uring_enter: %s\n", strerror(-rv));
+  }
+  return rv;
+}
+
+// Wait for every write queued so far, those the ring lost are counted as errors
+static void finish_writes()
+{
+  while (writes_left > 0)
+  {
+    if (ring_wait() != 0)
+    {
+      io_errors += writes_left;
+      writes_left = 0;
+    }
+  }
+}
+
+// 0 once the read into frame is done, -1 if the ring failed and it may still be in flight
+static int wait_loaded(frame_t *frame)
+{
+  while (frame->loading)
+  {
+    if (ring_wait() != 0)
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void file_attach(int fd, const map_policy_t *policy)
+{
+  image_fd = fd;
+  meta = alloc_aligned(META_BLOCKS * BLOCK_SIZE);
+  meta_saved = malloc(META_BLOCKS * BLOCK_SIZE);
+  for (int i = 0; i < META_BLOCKS; i++)
+  { // a metadata block served as zeros would get the image formatted over
+    int rv = read_block(i, meta + i * BLOCK_SIZE);
+    assert(rv == 0);
+  }
+  memcpy(meta_saved, meta, META_BLOCKS * BLOCK_SIZE);
+  pool_frames = budget;
+  pool = alloc_aligned(pool_frames * BLOCK_SIZE);
+  frame_of = malloc(BLOCK_COUNT * sizeof(int));
+  for (int i = 0; i < BLOCK_COUNT; i++)
+  {
+    frame_of[i] = -1;
+  }
+  memset(&stats, 0, sizeof(stats));
+  use_uring = 0;
+  io_errors = 0;
+  rereads = 0;
+}
+
+static void uring_attach(int fd, const map_policy_t *policy)
+{
+  file_attach(fd, policy);
+  int rv = uring_init(&ring, queue_depth);
+  if (rv != 0)
+  {
+    fprintf(stderr, "io_uring_setup: %s, using pread\n", strerror(-rv));
+    return;
+  }
+  use_uring = 1;
+  fixed = uring_register_file(&ring, fd) == 0 &&
+          uring_register_buffer(&ring, pool, pool_frames * BLOCK_SIZE) == 0;
+  if (!fixed)
+  { // e.g. RLIMIT_MEMLOCK too low for the buffer, plain reads and writes still work
+    fprintf(stderr, "io_uring registration failed, not using fixed buffers\n");
+  }
+}
+
+static int new_frame()
+{
+  frames = realloc(frames, (frame_count + 1) * sizeof(frame_t));
+  assert(frames != 0);
+  frame_t *frame = &frames[frame_count];
+  frame->data = frame_count < pool_frames ? pool + frame_count * BLOCK_SIZE : alloc_aligned(BLOCK_SIZE);
+  frame->bnum = -1;
+  frame->dirty = 0;
+  frame->loading = 0;
+  return frame_count++;
+}
+
+// A frame to load a block into, evicting the first unpinned one CLOCK finds, -1 if all are in use
+static int free_frame()
+{
+  if (frame_count < pool_frames)
+  {
+    return new_frame();
+  }
+  for (int n = 0; n < 2 * frame_count; n++)
+  {
+    frame_t *frame = &frames[hand];
+    int index = hand;
+    hand = (hand + 1) % frame_count;
+    if (frame->pinned == epoch || frame->loading)
+    {
+      continue;
+    }
+    if (frame->referenced)
+    {
+      frame->referenced = 0;
+      continue;
+    }
+    if (frame->dirty)
+    { // only blocks changed outside of a request get here
+      write_block(frame->bnum, frame->data);
+      frame->dirty = 0;
+    }
+    if (frame->bnum != -1)
+    {
+      frame_of[frame->bnum] = -1;
+    }
+    return index;
+  }
+  return -1;
+}
+
+// A frame to load a block into, going over the budget if every frame is in use
+static int take_frame()
+{
+  int index = free_frame();
+  if (index == -1)
+  {
+    stats.overflows++;
+    index = new_frame();
+  }
+  return index;
+}
+
+// Give back the frames added past the budget, nothing is pinned once a request is done.
+// One still loading is named by its completion, so it and the frames before it wait for a later request
+static void release_overflow()
+{
+  while (frame_count > pool_frames && !frames[frame_count - 1].loading)
+  {
+    frame_t *frame = &frames[--frame_count];
+    if (frame->bnum != -1)
+    {
+      frame_of[frame->bnum] = -1;
+    }
+    free(frame->data);
+  }
+  if (hand >= frame_count)
+  {
+    hand = 0;
+  }
+}
+
+static void *file_block(int bnum, int write)
+{
+  if (bnum < META_BLOCKS)
+  {
+    return meta + bnum * BLOCK_SIZE;
+  }
+  int index = frame_of[bnum];
+  if (index == -1)
+  {
+    stats.misses++;
+    index = take_frame();
+    frames[index].bnum = bnum;
+    frame_of[bnum] = index;
+    if (read_block(bnum, frames[index].data) == -1)
+    {
+      frame_failed(index);
+    }
+  }
+  else
+  {
+    stats.hits++;
+  }
+  frame_t *frame = &frames[index];
+  if (frame->loading && wait_loaded(frame) == -1)
+  { // the kernel may still write the frame, it stays loading so nothing uses it again
+    frame_of[bnum] = -1;
+    frame->bnum = -1;
+    index = take_frame();
+    frame = &frames[index];
+    frame->bnum = bnum;
+    frame_failed(index);
+  }
+  frame->referenced = 1;
+  frame->pinned = epoch;
+  frame->dirty |= write && frame->bnum != -1; // a failed read's zeros are never written
+  return frame->data;
+}
+
+// Blocks read one at a time when they are used, nothing to do ahead of time
+static void file_prefetch(const int *bnums, int count) {}
+
+// Start reading the blocks that aren't cached yet, in one batch
+static void uring_prefetch(const int *bnums, int count)
+{
+  if (!use_uring)
+  {
+    return;
+  }
+  int queued = 0;
+  for (int i = 0; i < count; i++)
+  {
+    int bnum = bnums[i];
+    if (bnum < META_BLOCKS || bnum >= BLOCK_COUNT || frame_of[bnum] != -1)
+    {
+      continue;
+    }
+    int index = free_frame();
+    if (index == -1)
+    { // only a hint, not worth growing the cache for
+      break;
+    }
+    frames[index].bnum = bnum;
+    frames[index].referenced = 1;
+    frame_of[bnum] = index;
+    queue_read(index);
+    queued++;
+  }
+  if (queued > 0)
+  {
+    uring_submit(&ring, 0);
+  }
+}
+
+static void pread_advise(int bnum, int count, int advice)
+{
+  int fadvice = advice == MADV_WILLNEED     ? POSIX_FADV_WILLNEED
+                : advice == MADV_RANDOM     ? POSIX_FADV_RANDOM
+                : advice == MADV_SEQUENTIAL ? POSIX_FADV_SEQUENTIAL
+                                            : POSIX_FADV_NORMAL;
+  posix_fadvise(image_fd, (off_t)bnum * BLOCK_SIZE, (off_t)count * BLOCK_SIZE, fadvice);
+}
+
+// O_DIRECT reads skip the page cache, there is nothing to hint
+static void direct_advise(int bnum, int count, int advice) {}
+
+// Readahead reads straight into the cache
+static void uring_advise(int bnum, int count, int advice)
+{
+  if (advice != MADV_WILLNEED)
+  {
+    return;
+  }
+  int bnums[count];
+  for (int i = 0; i < count; i++)
+  {
+    bnums[i] = bnum + i;
+  }
+  uring_prefetch(bnums, count);
+}
+
+// Write back what the request changed, queued with io_uring
+static void write_back()
+{
+  for (int i = 0; i < frame_count; i++)
+  {
+    if (frames[i].dirty)
+    {
+      if (use_uring)
+        queue_write(frames[i].bnum, frames[i].data);
+      else
+        write_block(frames[i].bnum, frames[i].data);
+      frames[i].dirty = 0;
+    }
+  }
+  for (int i = 0; i < META_BLOCKS; i++)
+  { //almost every request looks at block 0, few change it
+    if (memcmp(meta + i * BLOCK_SIZE, meta_saved + i * BLOCK_SIZE, BLOCK_SIZE) != 0)
+    {
+      if (use_uring)
+        queue_write(i, meta + i * BLOCK_SIZE);
+      else
+        write_block(i, meta + i * BLOCK_SIZE);
+      memcpy(meta_saved + i * BLOCK_SIZE, meta + i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+  }
+}
+
+// Write back what the request changed, then let its blocks go
+static void file_request_done()
+{
+  write_back();
+  if (use_uring)
+  {
+    finish_writes();
+  }
+  epoch++;
+  release_overflow();
+}
+
+static int file_flush()
+{
+  if (!use_uring)
+  {
+    file_request_done();
+    return fsync(image_fd) == 0 && io_errors == 0 ? 0 : -1;
+  }
+  write_back();
+  // drained, it starts once everything submitted before it is done
+  image_sqe(IORING_OP_FSYNC, 0, 0, IO_FSYNC)->flags |= IOSQE_IO_DRAIN;
+  writes_left++;
+  finish_writes();
+  epoch++;
+  release_overflow();
+  return io_errors == 0 ? 0 : -1;
+}
+
+static void file_detach()
+{
+  file_flush();
+  if (use_uring)
+  {
+    uring_exit(&ring, io_done);
+    use_uring = 0;
+    fixed = 0;
+  }
+  for (int i = pool_frames; i < frame_count; i++)
+  {
+    free(frames[i].data);
+  }
+  free(pool);
+  free(frames);
+  free(frame_of);
+  free(meta);
+  free(meta_saved);
+  pool = 0;
+  frames = 0;
+  frame_count = 0;
+  frame_of = 0;
+  meta = 0;
+  meta_saved = 0;
+  hand = 0;
+  image_fd = -1;
+}
+
+void backend_set_cache(int blocks)
+{
+  budget = blocks < 1 ? 1 : blocks;
+}
+
+void backend_set_queue_depth(int depth)
+{
+  queue_depth = depth < 1 ? 1 : depth;
+}
+
+backend_stats_t *backend_get_stats()
+{
+  stats.frames = frame_count;
+  return &stats;
+}
+
+const backend_t pread_backend = {"pread", IMAGE_FILE, 0, file_attach, file_block, file_prefetch,
+                                 pread_advise, file_request_done, file_flush, file_detach};
+
+const backend_t direct_backend = {"direct", IMAGE_FILE, O_DIRECT, file_attach, file_block,
+                                  file_prefetch, direct_advise, file_request_done, file_flush, file_detach};
+
+const backend_t uring_backend = {"uring", IMAGE_FILE, 0, uring_attach, file_block, uring_prefetch,
+                                 uring_advise, file_request_done, file_flush, file_detach};
+
+const backend_t uring_direct_backend = {"uring-direct", IMAGE_FILE, O_DIRECT, uring_attach,
+                                        file_block, uring_prefetch, uring_advise, file_request_done, file_flush, file_detach};
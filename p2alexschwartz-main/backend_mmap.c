@@ -0,0 +1,83 @@
+/**
+ * @file backend_mmap.c
+ *
+ * The image mapped into memory whole, with the mount's map_policy_t.
+ *
+ * memory and memfd map scratch memory the same way. They never write
+ * anything back, so flushing them is free.
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "backend.h"
+
+static void *base = 0;
+
+// Apply the mapping policy to a freshly mapped image. Only hints, so
+// failures are reported and otherwise ignored.
+static void apply_policy(const map_policy_t *policy)
+{
+  const int meta_size = META_BLOCKS * BLOCK_SIZE;
+  if (policy->hugepages && madvise(base, NUFS_SIZE, MADV_HUGEPAGE) != 0)
+  {
+    perror("madvise(MADV_HUGEPAGE)");
+  }
+  if (policy->meta_advice != MADV_NORMAL)
+  {
+    madvise(base, meta_size, policy->meta_advice);
+  }
+  if (policy->data_advice != MADV_NORMAL)
+  {
+    madvise(base + meta_size, NUFS_SIZE - meta_size, policy->data_advice);
+  }
+  if (policy->lock_meta && mlock(base, meta_size) != 0)
+  {
+    perror("mlock of the metadata blocks");
+  }
+}
+
+static void mmap_attach(int fd, const map_policy_t *policy)
+{
+  int flags = fd == -1 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED;
+  int prot = policy->readonly ? PROT_READ : PROT_READ | PROT_WRITE;
+  base = mmap(0, NUFS_SIZE, prot, flags | (policy->populate ? MAP_POPULATE : 0), fd, 0);
+  assert(base != MAP_FAILED);
+  apply_policy(policy);
+}
+
+static void *mmap_block(int bnum, int write) { return base + BLOCK_SIZE * bnum; }
+
+// The kernel brings pages in as they are touched.
+static void mmap_prefetch(const int *bnums, int count) {}
+
+// Blocks are page aligned in the map.
+static void mmap_advise(int bnum, int count, int advice)
+{
+  madvise(base + BLOCK_SIZE * bnum, count * BLOCK_SIZE, advice);
+}
+
+static void mmap_request_done() {}
+
+static int mmap_flush() { return msync(base, NUFS_SIZE, MS_SYNC); }
+
+// Scratch memory has no disk to be durable on.
+static int memory_flush() { return 0; }
+
+static void mmap_detach()
+{
+  int rv = munmap(base, NUFS_SIZE);
+  assert(rv == 0);
+  base = 0;
+}
+
+const backend_t mmap_backend = {"mmap", IMAGE_FILE, 0, mmap_attach, mmap_block, mmap_prefetch,
+                                mmap_advise, mmap_request_done, mmap_flush, mmap_detach};
+
+const backend_t memory_backend = {"memory", IMAGE_ANONYMOUS, 0, mmap_attach, mmap_block, mmap_prefetch,
+                                  mmap_advise, mmap_request_done, memory_flush, mmap_detach};
+
+const backend_t memfd_backend = {"memfd", IMAGE_MEMFD, 0, mmap_attach, mmap_block, mmap_prefetch,
+                                 mmap_advise, mmap_request_done, memory_flush, mmap_detach};
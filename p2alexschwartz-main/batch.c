@@ -0,0 +1,102 @@
+#include "batch.h"
+#include "directory.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+//The directory of the current burst, guarded by the storage lock
+static int dir = -1;
+static char dir_path[BATCH_PATH];
+static int room = 0;   //blocks before this one are full
+static uint64_t stale; //blocks (of the first 64) whose filter still has removed names
+static batch_stats_t stats;
+
+int batch_parent(const char *path, char *name)
+{
+    size_t length = strlen(path);
+    char parent[length + 1];
+    copy_folder(path, parent, length);
+    copy_file(path, name, length);
+    if (dir != -1 && strcmp(parent, dir_path) == 0)
+    {
+        stats.hits++;
+        return dir;
+    }
+    stats.misses++;
+    batch_end();
+    dirent_t *entry = directory_path_lookup(parent);
+    if (entry == 0 || !S_ISDIR(entry->mode))
+    {
+        return -1;
+    }
+    if (strlen(parent) < BATCH_PATH)
+    {
+        strcpy(dir_path, parent);
+        dir = entry->inum;
+        room = 0;
+        stale = 0;
+    }
+    return entry->inum;
+}
+
+int batch_put(int inum_dir, const char *name, int inum, mode_t mode)
+{
+    if (inum_dir != dir)
+    {
+        return directory_put(get_inode(inum_dir), name, inum, mode);
+    }
+    return directory_put_from(get_inode(dir), name, inum, mode, &room);
+}
+
+int batch_delete(int inum_dir, const char *name)
+{
+    int block;
+    int inum = directory_remove(get_inode(inum_dir), name, &block);
+    if (inum == -1)
+    {
+        return -1;
+    }
+    if (inum_dir == dir && block < 64)
+    {
+        stale |= 1ull << block;
+        room = block < room ? block : room;
+    }
+    else
+    {
+        directory_refilter(get_inode(inum_dir), block);
+    }
+    return inum;
+}
+
+void batch_end()
+{
+    if (dir == -1)
+    {
+        return;
+    }
+    inode_t *node = get_inode(dir);
+    while (stale != 0)
+    {
+        int block = __builtin_ctzll(stale);
+        stale &= stale - 1;
+        if (block < node->size / BLOCK_SIZE)
+        {
+            directory_refilter(node, block);
+            stats.refilters++;
+        }
+    }
+    dir = -1;
+}
+
+void batch_forget()
+{
+    dir = -1;
+    stale = 0;
+}
+
+batch_stats_t *batch_get_stats()
+{
+    return &stats;
+}
@@ -0,0 +1,48 @@
+// Bursts of creates and unlinks in one directory.
+//
+// Extracting an archive makes thousands of files in a row in the same
+// directory, and rm -r removes them the same way. Each one used to look
+// its directory up from the root, scan the directory's headers from the
+// first block for room, and rebuild the bloom filter of the block it
+// removed a name from. The batch remembers the directory of the last
+// create or unlink. The next one in the same directory skips the lookup
+// and starts looking for room in the first block that may have some.
+// Unlinks leave the old filters in place, which still let every name that
+// is there through, and the filters of the blocks they touched are
+// rebuilt once, when the burst moves to another directory or ends.
+//
+// Renames and rmdirs end the burst, since they can change which directory
+// a path names. Called with the storage lock held.
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <sys/types.h>
+
+#define BATCH_PATH 256 // longer directory paths are looked up every time
+
+typedef struct batch_stats
+{
+    long hits;      // creates and unlinks that found their directory in the batch
+    long misses;    // ones that looked it up
+    long refilters; // bloom filters rebuilt at the end of a burst
+} batch_stats_t;
+
+// The inum of the directory path is in, setting name to its last component.
+// Returns -1 if the directory doesn't exist
+int batch_parent(const char *path, char *name);
+
+// Put an entry in a directory from batch_parent, like directory_put
+int batch_put(int dir, const char *name, int inum, mode_t mode);
+
+// Remove an entry from a directory from batch_parent. Returns the inum it named, or -1
+int batch_delete(int dir, const char *name);
+
+// End the burst, rebuilding the filters it left behind
+void batch_end();
+
+// Drop the burst without touching the image, which has been replaced
+void batch_forget();
+
+batch_stats_t *batch_get_stats();
+
+#endif
@@ -11,26 +11,49 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "backend.h"
 #include "bitmap.h"
 #include "blocks.h"
+#include "extent.h"
+#include "group.h"
+#include "upgrade.h"
 
-const int BLOCK_COUNT = 256;                    // we split the "disk" into blocks (default = 256)
-const int BLOCK_SIZE = 4096;                    // default = 4K
+#ifdef NUFS_RUNTIME_GEOMETRY
+const int BLOCK_COUNT = GEOMETRY_BLOCK_COUNT;   // we split the "disk" into blocks (default = 256)
+const int BLOCK_SIZE = GEOMETRY_BLOCK_SIZE;     // default = 4K
 const int NUFS_SIZE = BLOCK_SIZE * BLOCK_COUNT; // default = 1MB
 
 const int BLOCK_BITMAP_SIZE = BLOCK_COUNT / 8;
 // Note: assumes block count is divisible by 8 // default = 256 / 8 = 32
+#endif
 
-static int blocks_fd = -1;
-static void *blocks_base = 0;
+#define SUPERBLOCK_OFFSET 512  // after the bitmaps and root entry
+#define BLOCK_INFO_OFFSET 2048 // one block_info_t for every block
+
+_Static_assert(GEOMETRY_BLOCK_COUNT % 8 == 0, "the bitmaps are whole bytes");
+_Static_assert(GEOMETRY_BLOCK_COUNT / 8 + GEOMETRY_BLOCK_COUNT + 64 <= SUPERBLOCK_OFFSET,
+               "the bitmaps and root entry run into the superblock");
+_Static_assert(SUPERBLOCK_OFFSET + sizeof(superblock_t) <= BLOCK_INFO_OFFSET,
+               "the superblock runs into block_info");
+_Static_assert(BLOCK_INFO_OFFSET + GEOMETRY_BLOCK_COUNT * sizeof(block_info_t) <= GEOMETRY_BLOCK_SIZE,
+               "block_info runs past block 0");
+
+static int blocks_fd = -1; // -1 for anonymous memory
+static int attached = 0;
+static const backend_t *backend = &mmap_backend; // serving the image now
+static const backend_t *chosen = &mmap_backend;  // for the next blocks_init
+static map_policy_t policy = {0, 0, 0, MADV_NORMAL, MADV_NORMAL};
+static uint16_t snapshot_gen = 0; // newest generation held by a snapshot, 0 if there are none
+static uint8_t reserved[GEOMETRY_BLOCK_COUNT / 8]; // BLOCK_COUNT bits, blocks alloc_block leaves alone
 
 // Get the number of blocks needed to store the given number of bytes.
-int bytes_to_blocks(int bytes)
+int bytes_to_blocks(int64_t bytes)
 {
   int quo = bytes / BLOCK_SIZE;
   int rem = bytes % BLOCK_SIZE;
@@ -44,39 +67,182 @@ int bytes_to_blocks(int bytes)
   }
 }
 
-// Load and initialize the given disk image.
-void blocks_init(const char *image_path)
+int map_profile(const char *name, map_policy_t *policy)
 {
-  blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
-  assert(blocks_fd != -1);
+  struct
+  {
+    const char *name;
+    int meta, data;
+  } profiles[] = {
+      {"normal", MADV_NORMAL, MADV_NORMAL},
+      {"willneed", MADV_WILLNEED, MADV_WILLNEED},
+      {"sequential", MADV_WILLNEED, MADV_SEQUENTIAL},
+      {"random", MADV_WILLNEED, MADV_RANDOM},
+  };
+  for (int i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+  {
+    if (strcmp(name, profiles[i].name) == 0)
+    {
+      policy->meta_advice = profiles[i].meta;
+      policy->data_advice = profiles[i].data;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+void blocks_set_policy(const map_policy_t *new_policy) { policy = *new_policy; }
+
+const map_policy_t *blocks_policy() { return &policy; }
 
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
-  assert(rv == 0);
+int blocks_set_backend(const char *name, int cache_blocks)
+{
+  const backend_t *backends[] = {&mmap_backend, &pread_backend, &direct_backend,
+                                 &uring_backend, &uring_direct_backend, &memory_backend,
+                                 &memfd_backend};
+  for (int i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+  {
+    if (strcmp(name, backends[i]->name) == 0)
+    {
+      chosen = backends[i];
+      backend_set_cache(cache_blocks);
+      return 0;
+    }
+  }
+  return -1;
+}
 
-  // map the image to memory
-  blocks_base =
-      mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
-  assert(blocks_base != MAP_FAILED);
+const char *blocks_backend() { return backend->name; }
 
+// Mark the metadata blocks in use, and set up the superblock if the image doesn't have one
+static void format_meta()
+{
   // block 0 stores the block bitmap and the inode bitmap
   void *bbm = get_blocks_bitmap();
+  superblock_t *sb = get_superblock();
+  if (sb->magic != NUFS_MAGIC)
+  { // new, or formatted before block 0 had a superblock (with version 1 inodes), nothing is shared yet
+    int formatted = bitmap_get(bbm, 0);
+    memset(sb, 0, sizeof(superblock_t));
+    memset(get_block_info(0), 0, BLOCK_COUNT * sizeof(block_info_t));
+    sb->magic = NUFS_MAGIC;
+    sb->version = formatted ? 1 : NUFS_VERSION;
+    sb->gen = 1;
+  }
   bitmap_put(bbm, 0, 1);
 
-  // block 1-2 store all the inodes
-  bitmap_put(bbm, 1, 1);
-  bitmap_put(bbm, 2, 1);
+  // blocks 1-4 store all the inodes, only 1-2 before version 2
+  int table_blocks = sb->version < 2 ? 2 : INODE_TABLE_BLOCKS;
+  for (int i = 0; i < table_blocks; i++)
+  {
+    bitmap_put(bbm, INODE_TABLE_START + i, 1);
+  }
+}
+
+// Load and initialize the given disk image.
+void blocks_init(const char *image_path)
+{
+  if (attached)
+  { // opening another image closes the one before it
+    blocks_free();
+  }
+  backend = chosen;
+  if (backend->image == IMAGE_ANONYMOUS)
+  { // starts out zeroed, like a new image file
+    blocks_fd = -1;
+  }
+  else if (backend->image == IMAGE_MEMFD)
+  { // the path only names it, it can be copied out of /proc/PID/fd
+    blocks_fd = memfd_create(basename(image_path), MFD_CLOEXEC);
+    assert(blocks_fd != -1);
+  }
+  else if (policy.readonly)
+  { // never made here, nothing would format it
+    blocks_fd = open(image_path, O_RDONLY | backend->open_flags);
+    assert(blocks_fd != -1);
+  }
+  else
+  {
+    blocks_fd = open(image_path, O_CREAT | O_RDWR | backend->open_flags, 0644);
+    if (blocks_fd == -1 && backend->open_flags != 0)
+    { // e.g. tmpfs has no O_DIRECT
+      perror("opening the image for the direct backend, using pread");
+      backend = &pread_backend;
+      blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
+    }
+    assert(blocks_fd != -1);
+  }
+
+  // make sure the disk image is exactly 1MB (NUFS_SIZE), a new one starts out empty
+  if (blocks_fd != -1 && !policy.readonly)
+  {
+    struct stat st;
+    int rv = fstat(blocks_fd, &st);
+    assert(rv == 0);
+    if (st.st_size != 0 && st.st_size != NUFS_SIZE)
+    { // made by a build with another geometry, resizing it would lose or garble it
+      fprintf(stderr, "%s is %ld bytes, this build's images are %d (see geometry.h)\n", image_path,
+              (long)st.st_size, NUFS_SIZE);
+    }
+    assert(st.st_size == 0 || st.st_size == NUFS_SIZE);
+    rv = ftruncate(blocks_fd, NUFS_SIZE);
+    assert(rv == 0);
+  }
+
+  // bring the image into memory
+  backend->attach(blocks_fd, &policy);
+  attached = 1;
+  memset(reserved, 0, sizeof(reserved));
+
+  if (!policy.readonly)
+  { // a read only image is served as it is
+    format_meta();
+  }
+  if (!policy.readonly && get_superblock()->version < NUFS_VERSION)
+  { // nothing past here knows the old layout
+    int rv = upgrade_image();
+    if (rv != 0)
+    {
+      fprintf(stderr, "can't upgrade %s to version %d: %s\n", image_path, NUFS_VERSION, strerror(-rv));
+    }
+    assert(rv == 0);
+  }
+  blocks_snapshots_changed();
+  groups_init();
+  extents_init();
 }
 
 // Close the disk image.
 void blocks_free()
 {
-  int rv = munmap(blocks_base, NUFS_SIZE);
-  assert(rv == 0);
+  backend->detach();
+  if (blocks_fd != -1)
+  {
+    close(blocks_fd);
+  }
+  blocks_fd = -1;
+  attached = 0;
+}
+
+int blocks_flush() { return backend->flush(); }
+
+void blocks_prefetch(const int *bnums, int count) { backend->prefetch(bnums, count); }
+
+void blocks_request_done() { backend->request_done(); }
+
+// Hint how a run of blocks will be used.
+void blocks_advise(int bnum, int count, int advice)
+{
+  backend->advise(bnum, count, advice);
 }
 
 // Get the given block, returning a pointer to its start.
-void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
+void *blocks_get_block(int bnum) { return backend->block(bnum, 1); }
+
+// Get the given block to look at only.
+const void *blocks_read_block(int bnum) { return backend->block(bnum, 0); }
+
+long blocks_read_errors() { return backend_get_stats()->read_errors; }
 
 // Return a pointer to the beginning of the block bitmap.
 // The size is BLOCK_BITMAP_SIZE bytes.
@@ -99,28 +265,222 @@ void *get_root_entry()
   return (void *)(inodes + BLOCK_COUNT);
 }
 
-// Allocate a new block and return its index.
-int alloc_block()
+superblock_t *get_superblock()
 {
-  void *bbm = get_blocks_bitmap();
+  return (superblock_t *)((uint8_t *)blocks_get_block(0) + SUPERBLOCK_OFFSET);
+}
+
+block_info_t *get_block_info(int bnum)
+{
+  block_info_t *table = (block_info_t *)((uint8_t *)blocks_get_block(0) + BLOCK_INFO_OFFSET);
+  return table + bnum;
+}
 
-  for (int ii = 1; ii < BLOCK_COUNT; ++ii)
+void blocks_snapshots_changed()
+{
+  superblock_t *sb = get_superblock();
+  snapshot_gen = 0;
+  for (int i = 0; i < MAX_SNAPSHOTS; i++)
   {
+    if (sb->snapshots[i].name[0] != '\0' && sb->snapshots[i].gen > snapshot_gen)
+    {
+      snapshot_gen = sb->snapshots[i].gen;
+    }
+  }
+}
+
+// A block still referenced by the live tree belongs to every snapshot taken since it was born
+int block_in_snapshot(int bnum)
+{
+  return snapshot_gen != 0 && get_block_info(bnum)->birth <= snapshot_gen;
+}
+
+int block_shared(int bnum)
+{
+  return get_block_info(bnum)->extra_refs > 0 || block_in_snapshot(bnum);
+}
+
+void block_ref(int bnum)
+{
+  group_lock(group_of(bnum));
+  block_info_t *info = get_block_info(bnum);
+  assert(info->extra_refs < UINT8_MAX);
+  info->extra_refs++;
+  group_unlock(group_of(bnum));
+}
+
+// Mark a free block as allocated, with its group locked.
+static int claim_block(int bnum, int home)
+{
+  bitmap_put(get_blocks_bitmap(), bnum, 1);
+  bitmap_put(reserved, bnum, 0);
+  block_info_t *info = get_block_info(bnum);
+  info->extra_refs = 0;
+  info->birth = get_superblock()->gen;
+  extent_take(bnum);
+  group_count_blocks(group_of(bnum), -1, home);
+  printf("+ alloc_block() -> %d\n", bnum);
+  return bnum;
+}
+
+// The first free block of the group, passing over reserved ones unless steal is set.
+static int alloc_in_group(int group, int steal, int home)
+{
+  if (group_free_blocks(group) == 0)
+  { // not worth the lock
+    return -1;
+  }
+  void *bbm = get_blocks_bitmap();
+  group_lock(group);
+  int bnum = extent_first(group);
+  for (int ii = group * GROUP_SIZE; bnum == -1 && steal && ii < (group + 1) * GROUP_SIZE; ++ii)
+  { // the index leaves reserved blocks out
     if (!bitmap_get(bbm, ii))
     {
-      bitmap_put(bbm, ii, 1);
-      printf("+ alloc_block() -> %d\n", ii);
-      return ii;
+      bnum = ii;
+    }
+  }
+  if (bnum != -1)
+  {
+    claim_block(bnum, home);
+  }
+  group_unlock(group);
+  return bnum;
+}
+
+// Allocate a new block and return its index.
+int alloc_block()
+{
+  int home = home_group();
+  for (int steal = 0; steal < 2; steal++)
+  { // out of space apart from reservations, take one of those
+    for (int i = 0; i < GROUP_COUNT; i++)
+    {
+      int group = (home + i) % GROUP_COUNT;
+      int bnum = alloc_in_group(group, steal, group == home);
+      if (bnum != -1)
+      {
+        return bnum;
+      }
     }
   }
   fprintf(stderr, "ran out of blocks to allocate");
   return -1;
 }
 
-// Deallocate the block with the given index.
+int alloc_block_at(int bnum)
+{
+  if (bnum <= 0 || bnum >= BLOCK_COUNT)
+  {
+    return -1;
+  }
+  int group = group_of(bnum);
+  group_lock(group);
+  int rv = bitmap_get(get_blocks_bitmap(), bnum) ? -1 : claim_block(bnum, 1);
+  group_unlock(group);
+  return rv;
+}
+
+void block_reserve(int bnum, int on)
+{
+  group_lock(group_of(bnum));
+  bitmap_put(reserved, bnum, on);
+  if (on)
+  {
+    extent_take(bnum);
+  }
+  else if (!bitmap_get(get_blocks_bitmap(), bnum))
+  {
+    extent_give(bnum);
+  }
+  group_unlock(group_of(bnum));
+}
+
+int blocks_find_run(int count, int group, int *length)
+{
+  int best = -1;
+  *length = 0;
+  for (int i = 0; i < GROUP_COUNT; i++)
+  { // the first group with a fit wins, else the longest run anywhere
+    int g = (group + i) % GROUP_COUNT;
+    int found_length;
+    group_lock(g);
+    int found = extent_best_fit(g, count, &found_length);
+    if (found == -1)
+    {
+      found = extent_longest(g, &found_length);
+    }
+    group_unlock(g);
+    if (found != -1 && (found_length >= count || found_length > *length))
+    {
+      best = found;
+      *length = found_length < count ? found_length : count;
+    }
+    if (*length == count)
+    {
+      break;
+    }
+  }
+  return best;
+}
+
+int alloc_run(int count)
+{
+  int length;
+  int start = blocks_find_run(count, home_group(), &length);
+  if (start == -1 || length < count)
+  {
+    return -1;
+  }
+  for (int i = 0; i < count; i++)
+  {
+    if (alloc_block_at(start + i) == -1)
+    { // taken in the meantime
+      while (--i >= 0)
+      {
+        free_block(start + i);
+      }
+      return -1;
+    }
+  }
+  return start;
+}
+
+int block_reserved(int bnum)
+{
+  return bitmap_get(reserved, bnum) && !bitmap_get(get_blocks_bitmap(), bnum);
+}
+
+// Drop a reference to the block with the given index, deallocating it if it was the last.
 void free_block(int bnum)
 {
   printf("+ free_block(%d)\n", bnum);
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, bnum, 0);
+  int group = group_of(bnum);
+  group_lock(group);
+  block_info_t *info = get_block_info(bnum);
+  if (info->extra_refs > 0)
+  { // someone else still points at it
+    info->extra_refs--;
+  }
+  else if (!block_in_snapshot(bnum))
+  { // otherwise left for the reclaimer once the snapshot is deleted
+    bitmap_put(get_blocks_bitmap(), bnum, 0);
+    extent_give(bnum);
+    group_count_blocks(group, 1, 0);
+  }
+  group_unlock(group);
+}
+
+void reclaim_block(int bnum)
+{
+  int group = group_of(bnum);
+  group_lock(group);
+  if (bitmap_get(get_blocks_bitmap(), bnum))
+  {
+    bitmap_put(get_blocks_bitmap(), bnum, 0);
+    get_block_info(bnum)->extra_refs = 0;
+    extent_give(bnum);
+    group_count_blocks(group, 1, 0);
+  }
+  group_unlock(group);
 }
@@ -4,20 +4,160 @@
  *
  * A block-based abstraction over a disk image file.
  *
- * The disk image is mmapped, so block data is accessed using pointers.
+ * Block data is accessed using pointers, whichever backend brings the
+ * image into memory (see backend.h).
  */
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <stdint.h>
 #include <stdio.h>
 
+#include "geometry.h"
+#include "group.h"
+
+#ifdef NUFS_RUNTIME_GEOMETRY
 extern const int BLOCK_COUNT; // we split the "disk" into blocks (default = 256)
 extern const int BLOCK_SIZE;  // default = 4K
 extern const int NUFS_SIZE;   // default = 1MB
 
 extern const int BLOCK_BITMAP_SIZE;
+#else
+#define BLOCK_COUNT GEOMETRY_BLOCK_COUNT // we split the "disk" into blocks (see geometry.h)
+#define BLOCK_SIZE GEOMETRY_BLOCK_SIZE
+#define NUFS_SIZE (BLOCK_SIZE * BLOCK_COUNT)
+
+#define BLOCK_BITMAP_SIZE (BLOCK_COUNT / 8)
+#endif
 // Note: assumes block count is divisible by 8 // default = 256 / 8 = 32
 
+#define NUFS_MAGIC 0x5346554e // "NUFS"
+#define NUFS_VERSION 2 // 1 had 32 byte inodes in blocks 1-2, upgraded at mount (see upgrade.h)
+#define MAX_SNAPSHOTS 8
+#define SNAPSHOT_NAME_LENGTH 23
+#define MAX_ORPHANS 32
+#define INODE_TABLE_START 1  // the live inode table always follows block 0
+// One 64 byte inode (INODE_SIZE) for every block, 4 blocks of 4K
+#define INODE_TABLE_BLOCKS ((GEOMETRY_BLOCK_COUNT * 64 + GEOMETRY_BLOCK_SIZE - 1) / GEOMETRY_BLOCK_SIZE)
+
+// The live inode table's block numbers, to initialize an int[INODE_TABLE_BLOCKS]
+#if INODE_TABLE_BLOCKS == 1
+#define INODE_TABLE_LIVE {INODE_TABLE_START}
+#elif INODE_TABLE_BLOCKS == 2
+#define INODE_TABLE_LIVE {INODE_TABLE_START, INODE_TABLE_START + 1}
+#elif INODE_TABLE_BLOCKS == 4
+#define INODE_TABLE_LIVE {INODE_TABLE_START, INODE_TABLE_START + 1, INODE_TABLE_START + 2, INODE_TABLE_START + 3}
+#else
+#error "no live inode table for this geometry"
+#endif
+
+/**
+ * A point in time copy of the filesystem.
+ *
+ * Only the inode table and the inode bitmap are copied; every other block
+ * is shared with the live tree until the live tree writes to it.
+ */
+typedef struct snapshot
+{
+  char name[SNAPSHOT_NAME_LENGTH + 1]; // empty for an unused slot
+  uint16_t gen;                        // blocks born in this generation or earlier belong to it
+  uint16_t _reserved;
+  int itable[INODE_TABLE_BLOCKS];      // private copy of the inode table
+  uint8_t ibm[GEOMETRY_BLOCK_COUNT / 8]; // copy of the inode bitmap (BLOCK_COUNT bits)
+} snapshot_t;
+
+/**
+ * Free space of one allocation group, kept current by the allocators so
+ * statfs doesn't have to count it.
+ */
+typedef struct group_desc
+{
+  uint16_t free_blocks;
+  uint16_t free_inodes; // only inodes that fit in the inode table are counted
+} group_desc_t;
+
+/**
+ * Filesystem wide state, kept in block 0 after the bitmaps and root entry.
+ */
+typedef struct superblock
+{
+  uint32_t magic;
+  uint32_t version;
+  uint16_t gen;           // current generation, bumped by every snapshot and reclaim pass
+  uint16_t sweep_pending; // a deleted snapshot still has blocks to give back
+  snapshot_t snapshots[MAX_SNAPSHOTS];
+  group_desc_t groups[GROUP_COUNT]; // checked against the bitmaps at mount
+  int32_t orphans[MAX_ORPHANS];     // inodes whose blocks are still being given back, 0 for a free slot
+} superblock_t;
+
+/**
+ * Per block bookkeeping for copy-on-write, one entry for every block.
+ */
+typedef struct block_info
+{
+  uint8_t extra_refs; // references beyond the first (a shared block is written by copying)
+  uint8_t _reserved;
+  uint16_t birth;     // generation the block was allocated in
+} block_info_t;
+
+/**
+ * How the image is mapped, see blocks_set_policy.
+ *
+ * The metadata region is block 0 and the live inode table, everything after
+ * it is the data region.
+ */
+typedef struct map_policy
+{
+  int populate;    // fault the whole image in when it is mapped (MAP_POPULATE)
+  int lock_meta;   // keep the metadata region resident (mlock)
+  int hugepages;   // ask for transparent huge pages (MADV_HUGEPAGE)
+  int meta_advice; // MADV_ advice for the metadata region
+  int data_advice; // MADV_ advice for the data region
+  int readonly;    // map the image PROT_READ and never write it, it must be formatted already
+} map_policy_t;
+
+/**
+ * Fill in the madvise advice of a named profile.
+ *
+ * "normal" leaves both regions alone and "willneed" starts reading the
+ * whole image in the background. "sequential" and "random" ask for the
+ * metadata region ahead of use and give the data region that advice.
+ *
+ * @param name The profile name.
+ * @param policy Where to set meta_advice and data_advice.
+ *
+ * @return 0, or -1 for an unknown profile.
+ */
+int map_profile(const char *name, map_policy_t *policy);
+
+/**
+ * Set how blocks_init maps the image. The default is a plain shared mapping.
+ *
+ * @param policy The policy to use from the next blocks_init on.
+ */
+void blocks_set_policy(const map_policy_t *policy);
+
+/**
+ * The policy blocks_init maps the image with.
+ */
+const map_policy_t *blocks_policy();
+
+/**
+ * Choose how blocks_init gets the image into memory, see backend.h.
+ *
+ * @param name "mmap" (the default), "pread", "direct", "uring", "uring-direct",
+ *             "memory" or "memfd".
+ * @param cache_blocks How many blocks the pread, direct and uring backends may cache.
+ *
+ * @return 0, or -1 for an unknown backend.
+ */
+int blocks_set_backend(const char *name, int cache_blocks);
+
+/**
+ * The name of the backend in use.
+ */
+const char *blocks_backend();
+
 /** 
  * Compute the number of blocks needed to store the given number of bytes.
  *
@@ -25,7 +165,7 @@ extern const int BLOCK_BITMAP_SIZE;
  *
  * @return Number of blocks needed to store the given number of bytes.
  */
-int bytes_to_blocks(int bytes);
+int bytes_to_blocks(int64_t bytes);
 
 /**
  * Load and initialize the given disk image.
@@ -39,6 +179,38 @@ void blocks_init(const char *image_path);
  */
 void blocks_free();
 
+/**
+ * Put everything written so far on disk.
+ *
+ * @return 0, or -1 if the image could not be synced.
+ */
+int blocks_flush();
+
+/**
+ * Say these blocks are about to be read, so backends that do their own I/O
+ * can start reading them all at once.
+ *
+ * @param bnums The block numbers, 0s are skipped.
+ * @param count How many there are.
+ */
+void blocks_prefetch(const int *bnums, int count);
+
+/**
+ * Say the current request is done with the blocks it got, called when the
+ * storage lock is let go for good. Pointers from blocks_get_block and
+ * blocks_read_block are only valid until then.
+ */
+void blocks_request_done();
+
+/**
+ * Give the kernel a hint about how a run of blocks will be accessed.
+ *
+ * @param bnum First block of the run.
+ * @param count Number of blocks in the run.
+ * @param advice One of the MADV_ constants, e.g. MADV_WILLNEED.
+ */
+void blocks_advise(int bnum, int count, int advice);
+
 /**
  * Get the block with the given index, returning a pointer to its start.
  *
@@ -48,6 +220,25 @@ void blocks_free();
  */
 void *blocks_get_block(int bnum);
 
+/**
+ * Get the block with the given index to read only. Cheaper than
+ * blocks_get_block with backends that write blocks back.
+ *
+ * @param bnum Block number (index).
+ *
+ * @return Pointer to the beginning of the block in memory.
+ */
+const void *blocks_read_block(int bnum);
+
+/**
+ * Blocks the backend couldn't read since the image was attached. A block
+ * that fails is handed out as zeros that are never written back, so a
+ * caller that sees this go up while it reads should fail with -EIO.
+ *
+ * @return The count, always 0 for the backends that map the image.
+ */
+long blocks_read_errors();
+
 /**
  * Return a pointer to the beginning of the block bitmap.
  *
@@ -69,20 +260,127 @@ void *get_inode_bitmap();
  */
 void *get_root_entry();
 
+/**
+ * Return a pointer to the superblock.
+ *
+ * @return A pointer to the superblock stored in block 0.
+ */
+superblock_t *get_superblock();
+
+/**
+ * Return the copy-on-write bookkeeping for the given block.
+ *
+ * @param bnum The block number.
+ *
+ * @return A pointer to the block's entry in the block info table.
+ */
+block_info_t *get_block_info(int bnum);
+
+/**
+ * Recompute which generations are held by snapshots.
+ *
+ * Must be called whenever the snapshot table changes.
+ */
+void blocks_snapshots_changed();
+
+/**
+ * Check whether a block has to be copied before it is written.
+ *
+ * A block is shared if it has extra references or belongs to a snapshot.
+ *
+ * @param bnum The block number.
+ *
+ * @return 1 if the block is shared, 0 if it can be written in place.
+ */
+int block_shared(int bnum);
+
+/**
+ * Check whether a block is still held by some snapshot.
+ *
+ * @param bnum The block number.
+ *
+ * @return 1 if a snapshot references the block.
+ */
+int block_in_snapshot(int bnum);
+
+/**
+ * Add a reference to an allocated block.
+ *
+ * @param bnum The block number.
+ */
+void block_ref(int bnum);
+
 /**
  * Allocate a new block and return its number.
  *
- * Grabs the first unused block and marks it as allocated.
+ * Grabs the first unused block that isn't reserved, in the calling CPU's
+ * allocation group first (see group.h), and marks it as allocated. When
+ * only reserved blocks are left, one of those is taken.
  *
  * @return The index of the newly allocated block.
  */
 int alloc_block();
 
 /**
- * Deallocate the block with the given number.
+ * Allocate the given block.
+ *
+ * @param bnum The block number, a reservation on it is dropped.
+ *
+ * @return bnum, or -1 if the block is in use.
+ */
+int alloc_block_at(int bnum);
+
+/**
+ * Set a free block aside, so alloc_block passes over it, or stop doing so.
+ * Reservations are only kept in memory.
+ *
+ * @param bnum The block number.
+ * @param on 1 to reserve it, 0 to let it go.
+ */
+void block_reserve(int bnum, int on);
+
+/**
+ * Whether the block is free and reserved.
+ */
+int block_reserved(int bnum);
+
+/**
+ * Find a run of free, unreserved blocks without allocating it, through the
+ * free extent index (see extent.h). Runs don't cross allocation groups.
+ *
+ * @param count The length wanted.
+ * @param group The allocation group to look in first.
+ * @param length Set to the length of the run found, at most count.
+ *
+ * @return The start of the smallest run of at least count blocks in the
+ *         first group that has one (best fit), else of the longest run;
+ *         -1 if nothing is free.
+ */
+int blocks_find_run(int count, int group, int *length);
+
+/**
+ * Allocate count contiguous blocks, best fit.
+ *
+ * @return The first block, or -1 if no run is long enough.
+ */
+int alloc_run(int count);
+
+/**
+ * Drop a reference to the block with the given number.
+ *
+ * The block is only deallocated once the last reference is gone and no
+ * snapshot holds it; snapshot blocks are given back by the reclaimer.
  *
  * @param bnun The block number to deallocate.
  */
 void free_block(int bnum);
 
+/**
+ * Deallocate a block no matter who still points at it, for the snapshot
+ * reclaimer once nothing live or in a snapshot does.
+ *
+ * @param bnum The block number.
+ */
+void reclaim_block(int bnum);
+
 #endif
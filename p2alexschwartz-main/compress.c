@@ -0,0 +1,235 @@
+#include "compress.h"
+#include "lz.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define CACHE_CLUSTERS 8
+
+typedef struct cached_cluster
+{
+    inode_t *node; //0 for an empty slot
+    int cluster;
+    int first;     //block number the stream starts in, in case the cluster moved
+    unsigned long used; //for picking the least recently used slot
+    char data[CLUSTER_SIZE];
+} cached_cluster_t;
+
+//everything here runs under the storage lock
+static cached_cluster_t cache[CACHE_CLUSTERS];
+static unsigned long clock_now = 0;
+static char scratch[CLUSTER_SIZE];
+static char plain[CLUSTER_SIZE]; //a cluster's uncompressed data while it changes form, too big for a stack
+static compress_stats_t stats;
+
+int compress_enabled(inode_t *node)
+{
+    return (node->mode & INODE_COMPRESSED) && !S_ISDIR(node->mode);
+}
+
+static int cluster_full(inode_t *node, int cluster)
+{
+    return (cluster + 1) * CLUSTER_SIZE <= node->size;
+}
+
+int cluster_is_compressed(inode_t *node, int cluster)
+{ //a real block is never block 0, so a 0 pointer inside the file only happens in a compressed cluster
+    return cluster_full(node, cluster) &&
+           inode_get_bnum(node, (cluster + 1) * CLUSTER_BLOCKS - 1) == 0;
+}
+
+void cluster_forget(inode_t *node, int from_cluster)
+{
+    for (int i = 0; i < CACHE_CLUSTERS; i++)
+    {
+        if (cache[i].node == node && cache[i].cluster >= from_cluster)
+        {
+            cache[i].node = 0;
+        }
+    }
+}
+
+const void *cluster_data(inode_t *node, int cluster)
+{
+    int first = inode_get_bnum(node, cluster * CLUSTER_BLOCKS);
+    cached_cluster_t *slot = &cache[0];
+    for (int i = 0; i < CACHE_CLUSTERS; i++)
+    {
+        if (cache[i].node == node && cache[i].cluster == cluster && cache[i].first == first)
+        {
+            stats.cache_hits++;
+            cache[i].used = ++clock_now;
+            return cache[i].data;
+        }
+        if (slot->node != 0 && (cache[i].node == 0 || cache[i].used < slot->used))
+        {
+            slot = &cache[i];
+        }
+    }
+    stats.cache_misses++;
+
+    uint32_t length;
+    memcpy(&length, blocks_read_block(first), sizeof(length));
+    int packed = length + sizeof(length);
+    for (int i = 0; i < CLUSTER_BLOCKS - 1 && i * BLOCK_SIZE < packed; i++)
+    { //gather the stream, it can span every block but the last
+        int chunk = packed - i * BLOCK_SIZE < BLOCK_SIZE ? packed - i * BLOCK_SIZE : BLOCK_SIZE;
+        memcpy(scratch + i * BLOCK_SIZE, blocks_read_block(inode_get_bnum(node, cluster * CLUSTER_BLOCKS + i)), chunk);
+    }
+    if (packed > CLUSTER_SIZE - BLOCK_SIZE ||
+        lz_decompress(scratch + sizeof(length), length, slot->data, CLUSTER_SIZE) != CLUSTER_SIZE)
+    { //left out of the cache, the next read finds it corrupt again
+        printf("cluster %d of a compressed file is corrupt\n", cluster);
+        return 0;
+    }
+    slot->node = node;
+    slot->cluster = cluster;
+    slot->first = first;
+    slot->used = ++clock_now;
+    return slot->data;
+}
+
+int cluster_compress(inode_t *node, int cluster)
+{
+    if (!compress_enabled(node) || !cluster_full(node, cluster) || cluster_is_compressed(node, cluster))
+    {
+        return 0;
+    }
+    int first = cluster * CLUSTER_BLOCKS;
+    for (int i = 0; i < CLUSTER_BLOCKS; i++)
+    {
+        memcpy(plain + i * BLOCK_SIZE, blocks_read_block(inode_get_bnum(node, first + i)), BLOCK_SIZE);
+    }
+    uint32_t length;
+    int packed = lz_compress(plain, CLUSTER_SIZE, scratch + sizeof(length),
+                             CLUSTER_SIZE - BLOCK_SIZE - sizeof(length));
+    if (packed < 0)
+    { //not even one block saved
+        stats.stored++;
+        return 0;
+    }
+    length = packed;
+    memcpy(scratch, &length, sizeof(length));
+    int used = bytes_to_blocks(packed + sizeof(length));
+
+    //make everything that changes private first, so running out of space leaves the cluster as it was
+    int last = first + CLUSTER_BLOCKS - 1;
+    if (inode_set_bnum(node, last, inode_get_bnum(node, last)) == -1)
+    {
+        return 0;
+    }
+    for (int i = 0; i < used; i++)
+    {
+        if (inode_cow_bnum(node, first + i) == -1)
+        {
+            return 0;
+        }
+    }
+    for (int i = 0; i < used; i++)
+    {
+        memcpy(blocks_get_block(inode_get_bnum(node, first + i)), scratch + i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    for (int i = used; i < CLUSTER_BLOCKS; i++)
+    {
+        free_block(inode_get_bnum(node, first + i));
+        inode_set_bnum(node, first + i, 0);
+    }
+    cluster_forget(node, cluster);
+    stats.compressed++;
+    printf("compressed cluster %d into %d blocks (%d bytes)\n", cluster, used, packed);
+    return 1;
+}
+
+int cluster_inflate(inode_t *node, int cluster)
+{
+    if (!cluster_is_compressed(node, cluster))
+    {
+        return 0;
+    }
+    int first = cluster * CLUSTER_BLOCKS;
+    int last = first + CLUSTER_BLOCKS - 1;
+    const void *data = cluster_data(node, cluster);
+    if (data == 0)
+    {
+        return -EIO;
+    }
+    memcpy(plain, data, CLUSTER_SIZE);
+    if (inode_set_bnum(node, last, 0) == -1)
+    { //only makes the cont_block private, the pointer is 0 already
+        return -ENOSPC;
+    }
+
+    int used = 0;
+    while (inode_get_bnum(node, first + used) != 0)
+    {
+        used++;
+    }
+    int fresh[CLUSTER_BLOCKS];
+    for (int i = used; i < CLUSTER_BLOCKS; i++)
+    {
+        fresh[i] = alloc_block();
+        if (fresh[i] == -1)
+        {
+            while (--i >= used)
+            {
+                free_block(fresh[i]);
+            }
+            return -ENOSPC;
+        }
+    }
+    for (int i = 0; i < used; i++)
+    {
+        if (inode_cow_bnum(node, first + i) == -1)
+        {
+            for (int j = used; j < CLUSTER_BLOCKS; j++)
+            {
+                free_block(fresh[j]);
+            }
+            return -ENOSPC;
+        }
+    }
+    //the cont_block is private, so these can't fail
+    for (int i = used; i < CLUSTER_BLOCKS; i++)
+    {
+        inode_set_bnum(node, first + i, fresh[i]);
+    }
+    for (int i = 0; i < CLUSTER_BLOCKS; i++)
+    {
+        memcpy(blocks_get_block(inode_get_bnum(node, first + i)), plain + i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    cluster_forget(node, cluster);
+    stats.inflated++;
+    return 0;
+}
+
+int compress_set(inode_t *node, int on)
+{
+    int clusters = node->size / CLUSTER_SIZE;
+    if (on)
+    {
+        node->mode |= INODE_COMPRESSED;
+        for (int c = 0; c < clusters; c++)
+        {
+            cluster_compress(node, c);
+        }
+        return 0;
+    }
+    for (int c = 0; c < clusters; c++)
+    { //the flag stays on until every cluster is plain again
+        int rv = cluster_inflate(node, c);
+        if (rv != 0)
+        {
+            return rv;
+        }
+    }
+    node->mode &= ~INODE_COMPRESSED;
+    return 0;
+}
+
+compress_stats_t *compress_get_stats()
+{
+    return &stats;
+}
@@ -0,0 +1,50 @@
+// Transparent compression of file data.
+//
+// The data of a file with INODE_COMPRESSED set is cut into clusters of
+// CLUSTER_BLOCKS blocks. A full cluster whose data compresses into fewer
+// blocks is stored as a 4 byte length followed by the lz stream in its
+// first blocks, and the block pointers for the rest of the cluster are 0.
+// Clusters that don't compress and the partial cluster at the end of the
+// file are stored as they are.
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "inode.h"
+
+#define CLUSTER_BLOCKS 4
+#define CLUSTER_SIZE (CLUSTER_BLOCKS * GEOMETRY_BLOCK_SIZE) // BLOCK_SIZE isn't constant in every build
+
+typedef struct compress_stats
+{
+    long compressed; // clusters stored compressed
+    long stored;     // full clusters that didn't compress and were kept as is
+    long inflated;   // compressed clusters turned back into plain blocks to be written
+    long cache_hits;
+    long cache_misses;
+} compress_stats_t;
+
+// Whether writes to node compress its data (directories never are)
+int compress_enabled(inode_t *node);
+
+// Turn compression of node on or off, converting the data already in it. 0, -ENOSPC or -EIO (see cluster_inflate)
+int compress_set(inode_t *node, int on);
+
+// Whether the given cluster of node is stored compressed
+int cluster_is_compressed(inode_t *node, int cluster);
+
+// Store a full cluster compressed if that saves at least a block. 1 if it did
+int cluster_compress(inode_t *node, int cluster);
+
+// Turn a compressed cluster back into CLUSTER_BLOCKS plain blocks. 0, -ENOSPC when out of space or -EIO if it is corrupt
+int cluster_inflate(inode_t *node, int cluster);
+
+// The CLUSTER_SIZE bytes of a compressed cluster, valid until the next call, or 0 if it is corrupt
+const void *cluster_data(inode_t *node, int cluster);
+
+// Drop the cached data of node's clusters from the given one on
+void cluster_forget(inode_t *node, int from_cluster);
+
+// Counters since mount
+compress_stats_t *compress_get_stats();
+
+#endif
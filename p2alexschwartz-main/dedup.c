@@ -0,0 +1,155 @@
+#include "dedup.h"
+#include "bitmap.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define INDEX_SIZE 512 //power of two, at least twice BLOCK_COUNT
+
+typedef uint32_t lanes_t __attribute__((vector_size(32))); //8 lanes, one AVX2 register or two SSE ones
+
+typedef struct index_entry
+{
+  uint64_t hash;
+  int bnum; //0 for an empty slot
+} index_entry_t;
+
+static index_entry_t known[INDEX_SIZE];
+static int inline_on = 0;
+static dedup_stats_t stats;
+
+uint64_t dedup_hash(const void *block)
+{
+  const uint8_t *bytes = (const uint8_t *)block;
+  const lanes_t prime1 = {2654435761u, 2654435761u, 2654435761u, 2654435761u,
+                          2654435761u, 2654435761u, 2654435761u, 2654435761u};
+  const lanes_t prime2 = {2246822519u, 2246822519u, 2246822519u, 2246822519u,
+                          2246822519u, 2246822519u, 2246822519u, 2246822519u};
+  lanes_t acc = {1, 2, 3, 4, 5, 6, 7, 8};
+
+  //xxhash32 style rounds on 8 independent lanes at once
+  for (int i = 0; i < BLOCK_SIZE; i += sizeof(lanes_t))
+  {
+    lanes_t v;
+    memcpy(&v, bytes + i, sizeof(v));
+    acc += v * prime2;
+    acc = (acc << 13) | (acc >> 19);
+    acc *= prime1;
+  }
+
+  uint64_t hash = BLOCK_SIZE;
+  for (int lane = 0; lane < 8; lane++)
+  {
+    hash = (hash ^ acc[lane]) * 0x9e3779b97f4a7c15ull;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
+
+void dedup_set_inline(int on)
+{
+  inline_on = on;
+}
+
+int dedup_inline()
+{
+  return inline_on;
+}
+
+dedup_stats_t *dedup_get_stats()
+{
+  return &stats;
+}
+
+//A remembered block is only a match if it is still allocated and still holds the same bytes
+static int same_block(int candidate, int bnum)
+{
+  return candidate != bnum && bitmap_get(get_blocks_bitmap(), candidate) &&
+         get_block_info(candidate)->extra_refs < UINT8_MAX &&
+         memcmp(blocks_read_block(candidate), blocks_read_block(bnum), BLOCK_SIZE) == 0;
+}
+
+//Point the node's file_bnum th block at an identical known block, or remember it. 1 if it was shared
+static int dedup_block(inode_t *node, int file_bnum)
+{
+  int bnum = inode_get_bnum(node, file_bnum);
+  if (bnum <= 0)
+  {
+    return 0;
+  }
+  uint64_t hash = dedup_hash(blocks_read_block(bnum));
+  stats.scanned++;
+
+  index_entry_t *slot = 0;
+  for (int i = 0; i < INDEX_SIZE; i++)
+  {
+    index_entry_t *entry = &known[(hash + i) & (INDEX_SIZE - 1)];
+    if (entry->bnum == 0)
+    {
+      slot = entry;
+      break;
+    }
+    if (entry->hash != hash)
+    {
+      continue;
+    }
+    if (entry->bnum == bnum)
+    { //already the remembered copy
+      return 0;
+    }
+    if (same_block(entry->bnum, bnum))
+    {
+      if (inode_set_bnum(node, file_bnum, entry->bnum) == -1)
+      {
+        return 0;
+      }
+      block_ref(entry->bnum);
+      free_block(bnum);
+      stats.shared++;
+      printf("dedup: block %d is the same as %d\n", bnum, entry->bnum);
+      return 1;
+    }
+    slot = entry; //stale, the block changed or was freed since
+    break;
+  }
+  if (slot)
+  {
+    slot->hash = hash;
+    slot->bnum = bnum;
+  }
+  return 0;
+}
+
+void dedup_range(inode_t *node, off_t offset, size_t size)
+{
+  int first = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  int end = (offset + size) / BLOCK_SIZE;
+  if (offset + size == node->size)
+  { //the last block counts as full when the write ends the file
+    end = bytes_to_blocks(node->size);
+  }
+  for (int i = first; i < end; i++)
+  {
+    dedup_block(node, i);
+  }
+}
+
+long dedup_scan()
+{
+  long shared = 0;
+  void *ibm = get_inode_bitmap();
+  for (int inum = 0; inum < BLOCK_COUNT; inum++)
+  {
+    if (!bitmap_get(ibm, inum))
+    {
+      continue;
+    }
+    inode_t *node = get_inode(inum);
+    for (int i = 0; i < bytes_to_blocks(node->size); i++)
+    {
+      shared += dedup_block(node, i);
+    }
+  }
+  printf("dedup_scan() -> %ld blocks shared\n", shared);
+  return shared;
+}
@@ -0,0 +1,38 @@
+// Block level deduplication.
+//
+// Blocks are hashed with a vectorized hash to find candidates, confirmed
+// byte for byte, and identical blocks are then shared through their
+// reference counts. Sharing is safe because every write to a shared block
+// goes through copy-on-write (see inode_cow_bnum).
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+
+#include "inode.h"
+
+typedef struct dedup_stats
+{
+  long scanned; // blocks hashed
+  long shared;  // blocks replaced by a reference to an identical block
+} dedup_stats_t;
+
+// Hash one block's contents
+uint64_t dedup_hash(const void *block);
+
+// Turn deduplication of every full block inode_write writes on or off
+void dedup_set_inline(int on);
+int dedup_inline();
+
+// Share every block of the live tree that is identical to one seen before it.
+// Returns the number of blocks given back to the allocator (or to snapshots)
+long dedup_scan();
+
+// Share the blocks of node covering [offset, offset + size) if an identical block is known.
+// Only blocks entirely inside the range are looked at
+void dedup_range(inode_t *node, off_t offset, size_t size);
+
+// Counters since mount
+dedup_stats_t *dedup_get_stats();
+
+#endif
@@ -0,0 +1,336 @@
+#define _GNU_SOURCE
+#include "defrag.h"
+#include "storage.h"
+#include "inode.h"
+#include "bitmap.h"
+#include "group.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static pthread_t defragger;
+static pthread_cond_t defrag_wanted = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t defrag_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int defrag_requested = 0;
+static int defragger_running = 0;
+static int defragger_stop = 0;
+
+static long budget_ns = DEFAULT_DEFRAG_BUDGET_US * 1000L;
+static defrag_stats_t stats;
+
+//Where a pass is, kept across slices
+typedef struct cursor
+{
+    int inum;
+    int file_bnum; //the next file block to look at
+    int last;      //where the file block before it is now, 0 at the start of a file
+    int dest;      //the run the file is being moved into, from dest up to dest_end
+    int dest_end;
+    long moved;
+    long files;
+    int moved_file; //whether the current file has had blocks moved
+} cursor_t;
+
+void defrag_set_budget(int usec)
+{
+    budget_ns = (usec > 0 ? usec : DEFAULT_DEFRAG_BUDGET_US) * 1000L;
+}
+
+static long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int live(int inum)
+{
+    //orphans (no refs) are on their way out
+    return inode_fits(inum) && bitmap_get(get_inode_bitmap(), inum) && get_inode(inum)->refs > 0 &&
+           get_inode(inum)->size > 0;
+}
+
+//Extents of every file, and how many files have more than one
+static void count_extents(long *extents, long *fragmented)
+{
+    *extents = 0;
+    *fragmented = 0;
+    for (int inum = 0; inum < BLOCK_COUNT; inum++)
+    {
+        if (live(inum))
+        {
+            int n = inode_extents(get_inode(inum));
+            *extents += n;
+            *fragmented += n > 1;
+        }
+    }
+}
+
+//How many blocks from bnum on are free and not reserved, up to max
+static int free_run_at(int bnum, int max)
+{
+    int length = 0;
+    while (length < max && bnum + length < BLOCK_COUNT && !bitmap_get(get_blocks_bitmap(), bnum + length) &&
+           !block_reserved(bnum + length))
+    {
+        length++;
+    }
+    return length;
+}
+
+//How many of the file's blocks from file_bnum on already follow each other, up to max
+static int current_run(inode_t *node, int file_bnum, int max)
+{
+    int length = 0;
+    int prev = 0;
+    for (int i = file_bnum; i < bytes_to_blocks(node->size) && length < max; i++)
+    {
+        int bnum = inode_get_bnum(node, i);
+        if (bnum <= 0)
+        { //the unused tail of a compressed cluster
+            continue;
+        }
+        if (prev > 0 && bnum != prev + 1)
+        {
+            break;
+        }
+        prev = bnum;
+        length++;
+    }
+    return length;
+}
+
+//Move the next piece of the file at the cursor to the run it is being moved into, finding
+//a run first if it needs one and there is one longer than where the blocks already are.
+//Returns the number of blocks moved
+static int move_piece(inode_t *node, cursor_t *cur)
+{
+    int nblocks = bytes_to_blocks(node->size);
+    int fbs[DEFRAG_PIECE], old[DEFRAG_PIECE];
+    int count = 0;
+    int i = cur->file_bnum;
+    for (; i < nblocks && count < DEFRAG_PIECE; i++)
+    {
+        int bnum = inode_get_bnum(node, i);
+        if (bnum <= 0)
+        {
+            continue;
+        }
+        if (block_shared(bnum))
+        {
+            break;
+        }
+        fbs[count] = i;
+        old[count++] = bnum;
+    }
+    if (count == 0)
+    { //stopped at a shared block, which stays put
+        if (i < nblocks)
+        {
+            cur->last = inode_get_bnum(node, i++);
+        }
+        cur->file_bnum = i;
+        return 0;
+    }
+
+    if (cur->dest < cur->dest_end)
+    { //blocks may have been taken since the last slice
+        int length = free_run_at(cur->dest, cur->dest_end - cur->dest);
+        cur->dest_end = cur->dest + length;
+    }
+    if (cur->dest == cur->dest_end)
+    {
+        int want = nblocks - cur->file_bnum;
+        want = want < GROUP_SIZE ? want : GROUP_SIZE;
+        int here = current_run(node, cur->file_bnum, want);
+        int length;
+        int found = blocks_find_run(want, group_of(cur->last > 0 ? cur->last : old[0]), &length);
+        if (found == -1 || length <= here)
+        { //no better than where they are, leave that run alone
+            count = here < count ? here : count;
+            cur->file_bnum = fbs[count - 1] + 1;
+            cur->last = old[count - 1];
+            return 0;
+        }
+        cur->dest = found;
+        cur->dest_end = found + length;
+    }
+
+    int moved = 0;
+    for (; moved < count && cur->dest < cur->dest_end; moved++)
+    { //copy, point the file at the copy, then let the old block go
+        int bnum = alloc_block_at(cur->dest);
+        if (bnum == -1)
+        {
+            cur->dest_end = cur->dest;
+            break;
+        }
+        memcpy(blocks_get_block(bnum), blocks_read_block(old[moved]), BLOCK_SIZE);
+        if (inode_set_bnum(node, fbs[moved], bnum) == -1)
+        {
+            free_block(bnum);
+            cur->dest_end = cur->dest;
+            break;
+        }
+        free_block(old[moved]);
+        cur->dest++;
+    }
+    if (moved > 0)
+    {
+        cur->file_bnum = fbs[moved - 1] + 1;
+        cur->last = cur->dest - 1;
+        cur->moved_file = 1;
+    }
+    else
+    { //couldn't be moved, it stays put
+        cur->file_bnum = fbs[0] + 1;
+        cur->last = old[0];
+    }
+    return moved;
+}
+
+//Work through files from the cursor on, with the storage lock held, until the budget
+//is spent. Returns 1 once every file has been looked at
+static int slice(cursor_t *cur)
+{
+    long start = now_ns();
+    while (cur->inum < BLOCK_COUNT)
+    {
+        if (now_ns() - start >= budget_ns)
+        {
+            return 0;
+        }
+        inode_t *node = live(cur->inum) ? get_inode(cur->inum) : 0;
+        if (node != 0 && cur->file_bnum == 0 && inode_extents(node) <= 1)
+        {
+            node = 0;
+        }
+        if (node != 0 && cur->file_bnum < bytes_to_blocks(node->size))
+        {
+            cur->moved += move_piece(node, cur);
+            continue;
+        }
+        //done with this file
+        if (cur->moved_file && node != 0)
+        {
+            printf("defrag: inode %d now in %d extents\n", cur->inum, inode_extents(node));
+            cur->files++;
+        }
+        cur->inum++;
+        cur->file_bnum = 0;
+        cur->last = 0;
+        cur->dest = 0;
+        cur->dest_end = 0;
+        cur->moved_file = 0;
+    }
+    return 1;
+}
+
+static int stop_wanted()
+{
+    pthread_mutex_lock(&defrag_mutex);
+    int stop = defragger_stop;
+    pthread_mutex_unlock(&defrag_mutex);
+    return stop;
+}
+
+long defrag_run()
+{
+    cursor_t cur = {0};
+    long extents, fragmented;
+
+    storage_lock();
+    count_extents(&extents, &fragmented);
+    stats.running = 1;
+    storage_unlock();
+
+    int done = 0;
+    while (!done && !stop_wanted())
+    {
+        storage_lock();
+        done = slice(&cur);
+        storage_unlock();
+        if (!done)
+        { //let requests in for as long as the slice kept them out
+            struct timespec pause = {budget_ns / 1000000000L, budget_ns % 1000000000L};
+            nanosleep(&pause, 0);
+        }
+    }
+
+    storage_lock();
+    stats.running = 0;
+    stats.passes++;
+    stats.moved = cur.moved;
+    stats.files = cur.files;
+    stats.extents_before = extents;
+    stats.fragmented_before = fragmented;
+    count_extents(&stats.extents_after, &stats.fragmented_after);
+    storage_unlock();
+
+    printf("defrag_run() -> %ld blocks in %ld files, %ld -> %ld extents\n", cur.moved, cur.files, extents,
+           stats.extents_after);
+    return cur.moved;
+}
+
+static void *defragger_main(void *arg)
+{
+    pthread_mutex_lock(&defrag_mutex);
+    while (!defragger_stop)
+    {
+        if (!defrag_requested)
+        {
+            pthread_cond_wait(&defrag_wanted, &defrag_mutex);
+            continue;
+        }
+        defrag_requested = 0;
+        pthread_mutex_unlock(&defrag_mutex);
+
+        defrag_run();
+
+        pthread_mutex_lock(&defrag_mutex);
+    }
+    pthread_mutex_unlock(&defrag_mutex);
+    return 0;
+}
+
+void defrag_request()
+{
+    pthread_mutex_lock(&defrag_mutex);
+    defrag_requested = 1;
+    pthread_cond_signal(&defrag_wanted);
+    pthread_mutex_unlock(&defrag_mutex);
+}
+
+void defrag_start()
+{
+    if (storage_readonly())
+    {
+        return;
+    }
+    defragger_stop = 0;
+    int rv = pthread_create(&defragger, 0, defragger_main, 0);
+    assert(rv == 0);
+    defragger_running = 1;
+}
+
+void defrag_stop()
+{
+    if (!defragger_running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&defrag_mutex);
+    defragger_stop = 1;
+    pthread_cond_signal(&defrag_wanted);
+    pthread_mutex_unlock(&defrag_mutex);
+    pthread_join(defragger, 0);
+    defragger_running = 0;
+}
+
+defrag_stats_t *defrag_get_stats()
+{
+    return &stats;
+}
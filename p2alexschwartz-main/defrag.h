@@ -0,0 +1,50 @@
+// Online defragmentation.
+//
+// Images that lived a while have files scattered block by block, and
+// reading one back jumps all over the image. A defragmentation pass walks
+// the live inodes and moves the blocks of every file in more than one
+// extent into runs of free blocks, a piece at a time: each block is copied
+// first, then the file is pointed at the copy and the old block freed, so
+// the file reads the same at every step. Shared blocks (clones, dedup,
+// snapshots) stay where they are, moving them would unshare them.
+//
+// A pass holds the storage lock for at most the time budget at once and
+// then waits as long, so a request never waits on it for more than the
+// budget. Passes run in a background thread, started with defrag_request
+// (NUFS_IOC_DEFRAG), or in the calling thread with defrag_run.
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#define DEFAULT_DEFRAG_BUDGET_US 1000
+#define DEFRAG_PIECE 8 //blocks moved at most at once
+
+typedef struct defrag_stats
+{
+    int running;            // a pass is under way
+    long passes;            // passes finished since mount
+    long moved;             // blocks relocated by the last finished pass
+    long files;             // files it relocated blocks of
+    long extents_before;    // data extents of all files before and after it
+    long extents_after;
+    long fragmented_before; // files in more than one extent before and after it
+    long fragmented_after;
+} defrag_stats_t;
+
+// Longest the storage lock is held at once by a pass, in microseconds
+void defrag_set_budget(int usec);
+
+// Run a whole pass in the calling thread, which must not hold the storage lock.
+// Returns the number of blocks moved
+long defrag_run();
+
+// Ask the background defragmenter for a pass, after the one under way if there is one
+void defrag_request();
+
+// Start and stop the background defragmenter
+void defrag_start();
+void defrag_stop();
+
+// Counters of the last pass, read with the storage lock held
+defrag_stats_t *defrag_get_stats();
+
+#endif
@@ -1,26 +1,33 @@
 #include "directory.h"
 #include "blocks.h"
 #include "bitmap.h"
+#include "path.h"
+#include "golden.h"
+#include "lazytime.h"
 
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 const int ROOT_INUM = 0;
 const char ROOT_NAME[2] = "/";
-const int DIR_PER_BLOCK = 64; //BLOCK_SIZE / sizeof(dirent_t)
+#ifdef NUFS_RUNTIME_GEOMETRY
+const int DIR_PER_BLOCK = GEOMETRY_BLOCK_SIZE / sizeof(dirent_t);
+#endif
 
 void directory_init()
 {
     // inode 0 stores the root directory
-    void *ibm = get_inode_bitmap();
-    bitmap_put(ibm, ROOT_INUM, 1);
+    claim_inode(ROOT_INUM);
 
     inode_t *root = get_inode(ROOT_INUM);
     if (root->size == 0)
     { //if this is the first init
         directory_const(root);
+        inode_stamp(ROOT_INUM, TIME_ALL);
     }
+    root->mode = (root->mode & INODE_FLAGS) | 040000;
 
     dirent_t *root_entry = (dirent_t *)get_root_entry();
     strcpy(root_entry->name, ROOT_NAME);
@@ -28,75 +35,193 @@ void directory_init()
     root_entry->mode = 040755; //directory default
 }
 
+static directory_stats_t stats;
+
+//Bit positions of name in a block's bloom filter, double hashing off one FNV-1a pass
+static void bloom_bits(const char *name, int bits[DIR_BLOOM_HASHES])
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; name[i] != '\0' && i < DIR_NAME_LENGTH; i++)
+    { //only the stored part of the name can ever match
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    uint32_t step = (hash >> 17) | 1;
+    for (int i = 0; i < DIR_BLOOM_HASHES; i++)
+    {
+        bits[i] = (hash + i * step) % (DIR_BLOOM_BYTES * 8);
+    }
+}
+
+static void bloom_add(header_t *header, const char *name)
+{
+    int bits[DIR_BLOOM_HASHES];
+    bloom_bits(name, bits);
+    for (int i = 0; i < DIR_BLOOM_HASHES; i++)
+    {
+        bitmap_put(header->bloom, bits[i], 1);
+    }
+}
+
+static int bloom_maybe(header_t *header, const char *name)
+{
+    int bits[DIR_BLOOM_HASHES];
+    bloom_bits(name, bits);
+    for (int i = 0; i < DIR_BLOOM_HASHES; i++)
+    {
+        if (bitmap_get(header->bloom, bits[i]) == 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//Recompute a block's filter from the entries it holds (bloom filters can't remove names)
+static void bloom_rebuild(dirent_t *block)
+{
+    header_t *header = (header_t *)block;
+    memset(header->bloom, 0, DIR_BLOOM_BYTES);
+    for (int i = DIR_HEADER_SLOTS; i < DIR_PER_BLOCK; i++)
+    {
+        if (bitmap_get(header->bm, i))
+        {
+            bloom_add(header, block[i].name);
+        }
+    }
+    header->bloom_ok = 1;
+}
+
+//Set up an empty directory block with only the header in use
+static void directory_block_init(dirent_t *block)
+{
+    header_t *header = (header_t *)block;
+    memset(header, 0, sizeof(header_t)); //ensure garbage data isn't in the map
+    header->free = DIR_PER_BLOCK - DIR_HEADER_SLOTS;
+    for (int i = 0; i < DIR_HEADER_SLOTS; i++)
+    { //Position 0 (and more with large blocks) is taken as the header
+        bitmap_put(header->bm, i, 1);
+    }
+    header->bloom_ok = 1;
+}
+
 void directory_const(inode_t *di)
 {
     printf("Constructing a new directory\n");
     dirent_t directory[DIR_PER_BLOCK];
-    header_t *header = (header_t *)directory;
-    header->free = DIR_PER_BLOCK - 1;
-    bitmap_put(header->bm, 0, 1); //Position 0 is taken as the header
-    for (int i = 1; i < DIR_PER_BLOCK; i++)
-    { //ensure garbage data isn't in the map
-        bitmap_put(header->bm, i, 0);
-    }
+    directory_block_init(directory);
     assert(BLOCK_SIZE == inode_write(di, directory, BLOCK_SIZE, 0)); //TODO truncate
 }
 
-//Get the dirent_t of the named directory / file contained within the given directory
-dirent_t *directory_lookup(inode_t *di, const char *name)
+//Find the named entry in place, also handing back the header of the block it was found in and
+//that block's number in the directory. With for_write the block is made private first so the
+//caller can change it.
+static dirent_t *directory_find(inode_t *di, const char *name, header_t **found_in, int *found_at, int for_write)
 {
-    dirent_t *directory = (dirent_t *)malloc(di->size);
-    assert(di->size == inode_read(di, directory, di->size, 0));
-    for (int i = 1; i < di->size / sizeof(dirent_t); ++i)
-    {
-        header_t *header = (header_t *)(directory + DIR_PER_BLOCK * (i / DIR_PER_BLOCK)); //header of the portion
-        if (0 == bitmap_get(header->bm, i % DIR_PER_BLOCK) || i % DIR_PER_BLOCK == 0)
-        { //empty or full with the header
+    for (int b = 0; b < di->size / BLOCK_SIZE; ++b)
+    { //directory blocks are read in place, a miss never touches the entries of a filtered block
+        dirent_t *block = (dirent_t *)blocks_read_block(inode_get_bnum(di, b));
+        header_t *header = (header_t *)block;
+        stats.block_probes++;
+        if (header->bloom_ok && !bloom_maybe(header, name))
+        { //a block fsck changed gets its filter back when it is next written
+            stats.bloom_skips++;
             continue;
         }
-        char *name_space = directory[i].name;
-        if (strcmp(name_space, name) == 0)
+        for (int i = DIR_HEADER_SLOTS; i < DIR_PER_BLOCK; ++i)
         {
-            dirent_t *real = (dirent_t *)blocks_get_block(inode_get_bnum(di, i / DIR_PER_BLOCK)); //modifiable
-            free(directory);
-            return real + i % DIR_PER_BLOCK;
+            if (bitmap_get(header->bm, i) && strcmp(block[i].name, name) == 0)
+            {
+                if (for_write)
+                {
+                    int bnum = inode_cow_bnum(di, b);
+                    if (bnum == -1)
+                    {
+                        return 0;
+                    }
+                    block = (dirent_t *)blocks_get_block(bnum); //modifiable
+                    header = (header_t *)block;
+                }
+                if (found_in)
+                {
+                    *found_in = header;
+                }
+                if (found_at)
+                {
+                    *found_at = b;
+                }
+                return block + i;
+            }
         }
+        stats.bloom_false++;
     }
-    free(directory);
     return 0;
 }
 
-dirent_t *directory_path_lookup(const char *path)
+//Get the dirent_t of the named directory / file contained within the given directory
+dirent_t *directory_lookup(inode_t *di, const char *name)
+{
+    return directory_find(di, name, 0, 0, 0);
+}
+
+directory_stats_t *directory_get_stats()
+{
+    return &stats;
+}
+
+static dirent_t *directory_walk(const char *path, int for_write)
 {
-    if (strlen(path) == 0 || strcmp(path, ROOT_NAME) == 0)
+    dirent_t *entry = get_root_entry();
+    char name[DIR_NAME_LENGTH + 1];
+    while (path_next(&path, name, sizeof(name)))
     {
-        return get_root_entry();
+        if (!S_ISDIR(entry->mode))
+        { //a file can't contain anything
+            return 0;
+        }
+        const char *rest = path;
+        while (*rest == '/')
+        {
+            rest++;
+        }
+        //only the last component's block is made writable
+        entry = directory_find(get_inode(entry->inum), name, 0, 0, for_write && *rest == '\0');
+        if (entry == 0)
+        {
+            return 0;
+        }
     }
-    slist_t *folders = slist_explode(path[0] == '/' ? path + 1 : path, '/'); //cut the initial /
-    dirent_t *output = directory_realitive_path_lookup(get_inode(ROOT_INUM), folders);
-    slist_free(folders);
-    return output;
+    return entry;
 }
 
-//get all the files at the given path realitive to the given directory
-dirent_t *directory_realitive_path_lookup(inode_t *di, slist_t *path)
+dirent_t *directory_path_lookup(const char *path)
 {
-    if (path->next == 0)
-    { //if this was the desired folder
-        return directory_lookup(di, path->data);
+    dirent_t *entry;
+    if (golden_lookup(path, &entry))
+    { //golden images answer from the table built at mount
+        return entry;
     }
-    inode_t *next = get_inode(directory_lookup(di, path->data)->inum);
-    return directory_realitive_path_lookup(next, path->next);
+    return directory_walk(path, 0);
+}
+
+dirent_t *directory_path_lookup_rw(const char *path)
+{
+    return directory_walk(path, 1);
 }
 
 int directory_put(inode_t *di, const char *name, int inum, mode_t mode)
+{
+    int hint = 0;
+    return directory_put_from(di, name, inum, mode, &hint);
+}
+
+int directory_put_from(inode_t *di, const char *name, int inum, mode_t mode, int *hint)
 {
     printf("Putting %s assosiated with the number %d in the given directory\n", name, inum);
     int block = -1;
-    header_t dir_header[1];
-    for (int i = 0; i < di->size / BLOCK_SIZE; ++i)
-    {
-        assert(inode_read(di, dir_header, sizeof(header_t), i * BLOCK_SIZE) == sizeof(header_t));
+    for (int i = *hint; i < di->size / BLOCK_SIZE; ++i)
+    { //headers are read in place, like lookups read the entries
+        header_t *dir_header = (header_t *)blocks_read_block(inode_get_bnum(di, i));
         if (dir_header->free != 0)
         {
             block = i;
@@ -104,25 +229,28 @@ int directory_put(inode_t *di, const char *name, int inum, mode_t mode)
         }
     }
 
-    header_t *header;
     if (block == -1)
     {
         dirent_t directory[DIR_PER_BLOCK];
-        header = (header_t *)directory;
-        header->free = DIR_PER_BLOCK - 1;
-        bitmap_put(header->bm, 0, 1); //Position 0 is taken as the header
-        for (int i = 1; i < DIR_PER_BLOCK; i++)
-        {
-            bitmap_put(header->bm, i, 0);
-        }
+        directory_block_init(directory);
         block = di->size / BLOCK_SIZE; //size is always divisible by BLOCK_SIZE
         assert(BLOCK_SIZE == inode_write(di, directory, BLOCK_SIZE, di->size));
     }
-    dirent_t *directory = (dirent_t *)blocks_get_block(inode_get_bnum(di, block));
-    header = (header_t *)directory;
-    for (int i = 1; i < di->size / sizeof(dirent_t); ++i)
+    int bnum = inode_cow_bnum(di, block);
+    if (bnum == -1)
     {
-        if (bitmap_get(header->bm, i % DIR_PER_BLOCK) == 0)
+        return 1;
+    }
+    *hint = block; //the blocks before it are full
+    dirent_t *directory = (dirent_t *)blocks_get_block(bnum);
+    header_t *header = (header_t *)directory;
+    if (!header->bloom_ok)
+    {
+        bloom_rebuild(directory);
+    }
+    for (int i = DIR_HEADER_SLOTS; i < DIR_PER_BLOCK; ++i)
+    {
+        if (bitmap_get(header->bm, i) == 0)
         {
             memcpy(directory[i].name, name, DIR_NAME_LENGTH);
             directory[i].name[DIR_NAME_LENGTH] = '\0'; //Caps the string to the array size
@@ -130,94 +258,122 @@ int directory_put(inode_t *di, const char *name, int inum, mode_t mode)
             directory[i].mode = mode;
             bitmap_put(header->bm, i, 1);
             header->free -= 1;
+            bloom_add(header, directory[i].name);
             return 0;
         }
     }
     return 1;
 }
 
-int directory_delete(inode_t *di, const char *name)
+int directory_build(inode_t *di, const dirent_t *entries, int count)
 {
-    printf("Removing directory entry by the name of %s\n", name);
-    dirent_t *directory = (dirent_t *)malloc(di->size);
-    assert(di->size == inode_read(di, directory, di->size, 0)); //not modifiable
-    for (int i = 1; i < di->size / sizeof(dirent_t); ++i)
+    printf("Building a directory of %d entries\n", count);
+    int per_block = DIR_PER_BLOCK - DIR_HEADER_SLOTS;
+    int nblocks = count == 0 ? 1 : (count + per_block - 1) / per_block;
+    dirent_t *directory = malloc(nblocks * BLOCK_SIZE);
+    if (directory == 0)
     {
-        header_t *header = (header_t *)(directory + DIR_PER_BLOCK * (i / DIR_PER_BLOCK)); //header of the portion
-        if (0 == bitmap_get(header->bm, i % DIR_PER_BLOCK) || i % DIR_PER_BLOCK == 0)
-        { //empty or full with the header
-            continue;
-        }
-
-        if (strcmp(directory[i].name, name) == 0)
+        return -1;
+    }
+    for (int b = 0; b < nblocks; ++b)
+    { //every block but the last is filled up
+        dirent_t *block = directory + b * DIR_PER_BLOCK;
+        header_t *header = (header_t *)block;
+        directory_block_init(block);
+        for (int i = DIR_HEADER_SLOTS; i < DIR_PER_BLOCK && b * per_block + i - DIR_HEADER_SLOTS < count; ++i)
         {
-            header_t *real = (header_t *)blocks_get_block(inode_get_bnum(di, i / DIR_PER_BLOCK)); //modifiable
-            bitmap_put(real->bm, i % DIR_PER_BLOCK, 0);
-            real->free += 1;
-            free(directory);
-            return 0;
+            block[i] = entries[b * per_block + i - DIR_HEADER_SLOTS];
+            block[i].name[DIR_NAME_LENGTH] = '\0';
+            bitmap_put(header->bm, i, 1);
+            header->free -= 1;
+            bloom_add(header, block[i].name);
         }
     }
+    int size = nblocks * BLOCK_SIZE;
+    int rv = inode_write(di, directory, size, 0) == size ? 0 : -1;
     free(directory);
-    return -1;
+    return rv;
 }
 
-slist_t *directory_list(const char *path)
+int directory_delete(inode_t *di, const char *name)
 {
-    printf("listing everything in %s\n", path);
-    slist_t *folders = slist_explode(path[0] == '/' ? path + 1 : path, '/');
-    slist_t *output = directory_realitive_list(get_inode(ROOT_INUM), folders);
-    slist_free(folders);
-    return output;
+    int block;
+    if (directory_remove(di, name, &block) == -1)
+    {
+        return -1;
+    }
+    directory_refilter(di, block);
+    return 0;
 }
 
-//get all the files at the given path realitive to the given directory
-slist_t *directory_realitive_list(inode_t *di, slist_t *path)
+int directory_remove(inode_t *di, const char *name, int *block)
 {
-    if (path == 0)
-    { //if this was the desired folder
-        printf("We've arrived\n");
-        return directory_list_given(di);
+    printf("Removing directory entry by the name of %s\n", name);
+    header_t *header;
+    dirent_t *entry = directory_find(di, name, &header, block, 1);
+    if (entry == 0)
+    {
+        return -1;
     }
-    printf("next looking for %s\n", path->data);
-    inode_t *next = get_inode(directory_lookup(di, path->data)->inum);
-    return directory_realitive_list(next, path->next);
+    bitmap_put(header->bm, entry - (dirent_t *)header, 0);
+    header->free += 1;
+    return entry->inum;
 }
 
-slist_t *directory_list_given(inode_t *di)
+void directory_refilter(inode_t *di, int block)
 {
-    slist_t *output = NULL;
-    dirent_t *directory = (dirent_t *)malloc(di->size);
-    assert(di->size == inode_read(di, directory, di->size, 0));
+    int bnum = inode_cow_bnum(di, block);
+    if (bnum != -1)
+    { //without room for a private copy the old filter stays, it only lets more names through
+        bloom_rebuild((dirent_t *)blocks_get_block(bnum));
+    }
+}
 
-    for (int i = 1; i < di->size / sizeof(dirent_t); ++i)
-    {
-        header_t *header = (header_t *)(directory + DIR_PER_BLOCK * (i / DIR_PER_BLOCK)); //header of the portion
-        if (0 == bitmap_get(header->bm, i % DIR_PER_BLOCK) || i % DIR_PER_BLOCK == 0)
-        { //empty or full with the header
-            continue;
+int directory_refilter_all(inode_t *di)
+{
+    int count = di->size / BLOCK_SIZE;
+    for (int b = 0; b < count; ++b)
+    { //the bytes of the filter were never written before it existed, whatever is there can't be trusted
+        int bnum = inode_get_bnum(di, b);
+        if (bnum > 0)
+        {
+            bloom_rebuild((dirent_t *)blocks_get_block(bnum));
         }
-        output = slist_cons(directory[i].name, output);
     }
-    free(directory);
-    return output;
+    return count;
 }
 
-void print_directory(inode_t *dd)
+int directory_foreach(inode_t *di, int (*visit)(dirent_t *entry, void *arg), void *arg)
 {
-    dirent_t *directory = (dirent_t *)malloc(dd->size);
-    assert(dd->size == inode_read(dd, directory, dd->size, 0));
-    for (int i = 1; i < dd->size / sizeof(dirent_t); ++i)
+    for (int b = 0; b < di->size / BLOCK_SIZE; ++b)
     {
-        void *pointer = (void *)(directory + DIR_PER_BLOCK * (i / DIR_PER_BLOCK)); //header of the portion
-        header_t *header = (header_t *)pointer;
-        if (0 == bitmap_get(header->bm, i % DIR_PER_BLOCK) || i % DIR_PER_BLOCK == 0)
-        { //empty or full with the header
-            continue;
+        dirent_t *block = (dirent_t *)blocks_read_block(inode_get_bnum(di, b));
+        header_t *header = (header_t *)block;
+        for (int i = DIR_HEADER_SLOTS; i < DIR_PER_BLOCK; ++i)
+        {
+            if (bitmap_get(header->bm, i) == 0)
+            { //empty
+                continue;
+            }
+            int rv = visit(block + i, arg);
+            if (rv != 0)
+            {
+                return rv;
+            }
         }
-        printf("%s\n", directory[i].name);
     }
-    free(directory);
+    return 0;
+}
+
+static int print_entry(dirent_t *entry, void *arg)
+{
+    printf("%s\n", entry->name);
+    return 0;
+}
+
+void print_directory(inode_t *dd)
+{
+    directory_foreach(dd, print_entry, 0);
 }
 
 void copy_folder(const char *path, char *buf, size_t size)
@@ -7,9 +7,11 @@
 #define DIRECTORY_H
 
 #define DIR_NAME_LENGTH 48
+#define DIR_BLOOM_BYTES 48 // 384 bit filter per directory block
+#define DIR_BLOOM_HASHES 4
+#define DIR_BITMAP_BYTES (GEOMETRY_BLOCK_SIZE / 64 / 8) // a bit for every 64 byte slot of a block
 
 #include "inode.h"
-#include "slist.h"
 
 #include <sys/types.h>
 #include <stdint.h>
@@ -24,32 +26,61 @@ typedef struct directent
 } dirent_t;
 
 typedef struct header
-{                //The header of a directory, must be the same size as directent
-  uint8_t bm[8]; //A bitmap of the used directent indicies
+{                               //The header of a directory block, in its first DIR_HEADER_SLOTS entries
+  uint8_t bm[DIR_BITMAP_BYTES]; //A bitmap of the used directent indicies, the header's own are set
   int free;
-  char _reserved[52];
+  uint8_t bloom[DIR_BLOOM_BYTES]; //Bloom filter over the names stored in this block
+  uint8_t bloom_ok;               //0 while the filter may be stale, e.g. after fsck changed the entries
+  char _reserved[3];
 } header_t;
 
+#define DIR_HEADER_SLOTS ((int)((sizeof(header_t) + sizeof(dirent_t) - 1) / sizeof(dirent_t))) // 1 for 4K blocks
+
+_Static_assert(sizeof(dirent_t) == 64, "DIR_BITMAP_BYTES counts 64 byte entries");
+_Static_assert(sizeof(header_t) == 64 || GEOMETRY_BLOCK_SIZE != 4096, "4K directory blocks keep their layout");
+
+typedef struct directory_stats
+{                     //counters for negative lookup acceleration
+  long block_probes;  //directory blocks considered by directory_lookup
+  long bloom_skips;   //blocks skipped without comparing any names
+  long bloom_false;   //blocks the filter let through that did not hold the name
+} directory_stats_t;
+
 extern const int ROOT_INUM;
 extern const char ROOT_NAME[2];
+#ifdef NUFS_RUNTIME_GEOMETRY
 extern const int DIR_PER_BLOCK;
+#else
+#define DIR_PER_BLOCK (BLOCK_SIZE / (int)sizeof(dirent_t))
+#endif
 
 void directory_init();
 void directory_const(inode_t *dirent_t);
 //get the inum of the directory with the given name in the given directory
 dirent_t *directory_lookup(inode_t *di, const char *name);
-//get all the files at the given path realitive to the root directory
+//get the entry at the given path realitive to the root directory, 0 if any part is missing
 dirent_t *directory_path_lookup(const char *path);
-//get all the files at the given path realitive to the given directory
-dirent_t *directory_realitive_path_lookup(inode_t *di, slist_t *path);
+//same as directory_path_lookup, but the returned entry may be changed in place
+dirent_t *directory_path_lookup_rw(const char *path);
 int directory_put(inode_t *di, const char *name, int inum, mode_t mode);
+//same as directory_put, but starts looking for room at block *hint, and leaves there the block it used
+int directory_put_from(inode_t *di, const char *name, int inum, mode_t mode, int *hint);
+//lay the entries out in whole blocks in the directory, which must hold none yet, 0 or -1 if it didn't fit
+int directory_build(inode_t *di, const dirent_t *entries, int count);
 int directory_delete(inode_t *di, const char *name);
-slist_t *directory_list(const char *path);
-//get all the files at the given path realitive to the given directory
-slist_t *directory_realitive_list(inode_t *di, slist_t *path);
-//returns a list of inums of all the files / directories in a specific directory
-slist_t *directory_list_given(inode_t *di);
+//same as directory_delete, but leaves the block's bloom filter naming the entry (still no false
+//negatives) until directory_refilter. Returns the inum the entry had and sets block, or -1
+int directory_remove(inode_t *di, const char *name, int *block);
+//rebuild the bloom filter of the directory's block-th block from the entries it holds
+void directory_refilter(inode_t *di, int block);
+//rebuild the filter of every block of the directory in place, shared blocks too (they all hold the
+//same entries), for images whose blocks were written before the filter existed. Returns the blocks
+int directory_refilter_all(inode_t *di);
+//calls visit on every entry in the directory in place, stopping early if it returns non zero
+int directory_foreach(inode_t *di, int (*visit)(dirent_t *entry, void *arg), void *arg);
 void print_directory(inode_t *dd);
+//the lookup counters since mount (or the last reset)
+directory_stats_t *directory_get_stats();
 void copy_folder(const char *path, char *buf, size_t size);
 void copy_file(const char *path, char *buf, size_t size);
 
@@ -0,0 +1,178 @@
+/**
+ * @file extent.c
+ *
+ * The free extent index: a free mask and length lists per group.
+ */
+#include <stdint.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "extent.h"
+#include "group.h"
+
+_Static_assert(GROUP_SIZE == 64, "a group's free blocks are one 64-bit mask");
+
+typedef struct extent_index
+{
+  uint64_t free;                // bit i: block i of the group is free and not reserved
+  uint64_t lengths;             // bit n - 1: some extent is n blocks long
+  int8_t head[GROUP_SIZE + 1];  // the first extent of each length, by its start in the group, -1 if none
+  int8_t next[GROUP_SIZE];      // the other extents of the same length
+  int8_t prev[GROUP_SIZE];
+} extent_index_t;
+
+static extent_index_t indexes[GROUP_COUNT];
+
+// Where the extent around free block i starts.
+static int start_of(extent_index_t *index, int i)
+{
+  uint64_t used_below = ~index->free & ((1ull << i) - 1);
+  return used_below ? 64 - __builtin_clzll(used_below) : 0;
+}
+
+// One past where the extent around free block i ends.
+static int end_of(extent_index_t *index, int i)
+{
+  uint64_t used_above = ~index->free & ~((2ull << i) - 1);
+  return used_above ? __builtin_ctzll(used_above) : GROUP_SIZE;
+}
+
+static void add_extent(extent_index_t *index, int start, int length)
+{
+  index->prev[start] = -1;
+  index->next[start] = index->head[length];
+  if (index->head[length] != -1)
+  {
+    index->prev[index->head[length]] = start;
+  }
+  index->head[length] = start;
+  index->lengths |= 1ull << (length - 1);
+}
+
+static void remove_extent(extent_index_t *index, int start, int length)
+{
+  if (index->prev[start] != -1)
+  {
+    index->next[index->prev[start]] = index->next[start];
+  }
+  else
+  {
+    index->head[length] = index->next[start];
+  }
+  if (index->next[start] != -1)
+  {
+    index->prev[index->next[start]] = index->prev[start];
+  }
+  if (index->head[length] == -1)
+  {
+    index->lengths &= ~(1ull << (length - 1));
+  }
+}
+
+void extents_init()
+{
+  void *bbm = get_blocks_bitmap();
+  for (int g = 0; g < GROUP_COUNT; g++)
+  {
+    extent_index_t *index = &indexes[g];
+    index->free = 0;
+    index->lengths = 0;
+    for (int n = 0; n <= GROUP_SIZE; n++)
+    {
+      index->head[n] = -1;
+    }
+    for (int i = 0; i < GROUP_SIZE; i++)
+    {
+      int bnum = g * GROUP_SIZE + i;
+      if (!bitmap_get(bbm, bnum) && !block_reserved(bnum))
+      {
+        index->free |= 1ull << i;
+      }
+    }
+    for (int i = 0; i < GROUP_SIZE; i++)
+    {
+      if ((index->free >> i & 1) && start_of(index, i) == i)
+      {
+        add_extent(index, i, end_of(index, i) - i);
+      }
+    }
+  }
+}
+
+void extent_take(int bnum)
+{
+  extent_index_t *index = &indexes[group_of(bnum)];
+  int i = bnum % GROUP_SIZE;
+  if (!(index->free >> i & 1))
+  {
+    return;
+  }
+  int start = start_of(index, i);
+  int end = end_of(index, i);
+  remove_extent(index, start, end - start);
+  index->free &= ~(1ull << i);
+  if (i > start)
+  {
+    add_extent(index, start, i - start);
+  }
+  if (end > i + 1)
+  {
+    add_extent(index, i + 1, end - i - 1);
+  }
+}
+
+void extent_give(int bnum)
+{
+  extent_index_t *index = &indexes[group_of(bnum)];
+  int i = bnum % GROUP_SIZE;
+  if (index->free >> i & 1)
+  {
+    return;
+  }
+  index->free |= 1ull << i;
+  int start = start_of(index, i);
+  int end = end_of(index, i);
+  if (i > start)
+  { // joins the extent before it
+    remove_extent(index, start, i - start);
+  }
+  if (end > i + 1)
+  { // and the one after it
+    remove_extent(index, i + 1, end - i - 1);
+  }
+  add_extent(index, start, end - start);
+}
+
+int extent_first(int group)
+{
+  extent_index_t *index = &indexes[group];
+  return index->free ? group * GROUP_SIZE + __builtin_ctzll(index->free) : -1;
+}
+
+int extent_best_fit(int group, int count, int *length)
+{
+  extent_index_t *index = &indexes[group];
+  if (count < 1 || count > GROUP_SIZE)
+  {
+    return -1;
+  }
+  uint64_t fits = index->lengths & ~((1ull << (count - 1)) - 1);
+  if (fits == 0)
+  {
+    return -1;
+  }
+  *length = __builtin_ctzll(fits) + 1;
+  return group * GROUP_SIZE + index->head[*length];
+}
+
+int extent_longest(int group, int *length)
+{
+  extent_index_t *index = &indexes[group];
+  if (index->lengths == 0)
+  {
+    *length = 0;
+    return -1;
+  }
+  *length = 64 - __builtin_clzll(index->lengths);
+  return group * GROUP_SIZE + index->head[*length];
+}
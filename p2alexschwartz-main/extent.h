@@ -0,0 +1,61 @@
+/**
+ * @file extent.h
+ *
+ * An in-memory index of the free extents (runs of free blocks) of each
+ * allocation group, for finding contiguous space without scanning the
+ * bitmap.
+ *
+ * Every group keeps a 64-bit mask of its blocks that are free and not
+ * reserved, and its extents in lists by length, with a mask of the
+ * lengths that have any. The smallest extent that holds a request (best
+ * fit) is then a couple of bit scans away, and so is the extent around a
+ * block that is taken or given back. Extents end at group borders.
+ *
+ * The bitmap in block 0 stays the record of what is in use; the index is
+ * rebuilt from it when the image is opened and changed along with it by
+ * blocks.c. All of these run with the group locked.
+ */
+#ifndef EXTENT_H
+#define EXTENT_H
+
+/**
+ * Rebuild the index of every group from the block bitmap.
+ */
+void extents_init();
+
+/**
+ * Note that a block is no longer free (allocated or reserved).
+ */
+void extent_take(int bnum);
+
+/**
+ * Note that a block is free again.
+ */
+void extent_give(int bnum);
+
+/**
+ * The first free block of a group.
+ *
+ * @return The block number, or -1 if the group has none.
+ */
+int extent_first(int group);
+
+/**
+ * Find the smallest extent of a group at least count blocks long.
+ *
+ * @param length Set to the length of the extent found.
+ *
+ * @return Its first block, or -1 if there is none.
+ */
+int extent_best_fit(int group, int count, int *length);
+
+/**
+ * Find the longest extent of a group.
+ *
+ * @param length Set to its length, 0 if the group is full.
+ *
+ * @return Its first block, or -1 if there is none.
+ */
+int extent_longest(int group, int *length);
+
+#endif
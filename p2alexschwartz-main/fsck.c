@@ -0,0 +1,534 @@
+#include "fsck.h"
+#include "directory.h"
+#include "bitmap.h"
+#include "compress.h"
+#include "extent.h"
+#include "group.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define MAX_FSCK_THREADS 64
+#define MIN_PER_THREAD 1024 //inodes or directories each thread needs before starting it costs less than it saves
+#define DATA_START (INODE_TABLE_START + INODE_TABLE_BLOCKS)
+#define MAX_FILE_BLOCKS (DIRECT_BLOCKS + GEOMETRY_BLOCK_SIZE / sizeof(int)) //direct pointers and one cont_block
+
+//shared between the threads of a phase, counters are only changed atomically
+static int repairing;
+static fsck_report_t *found;
+//one entry per inode or block, the image has 256 of each
+static int links[256];      //directory entries naming each inode
+static int refs[256];       //live block pointers to each block
+static uint8_t is_dir[256]; //inodes known to be directories
+static int in_use[256];     //inodes allocated and named by some directory (or the root)
+static uint8_t pending[256]; //inodes on the orphan list, waiting for the reclaimer
+
+//directories left to scan, taken by whichever thread is free
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static int queue[256];
+static int queued, scanned;
+
+typedef struct range
+{
+    int first; //inodes first up to end
+    int end;
+    void (*check)(int inum);
+} range_t;
+
+static void note(long *counter)
+{
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+static int usable(int inum)
+{
+    return inum >= 0 && inum < BLOCK_COUNT && inode_fits(inum);
+}
+
+static int allocated(int inum)
+{
+    return usable(inum) && bitmap_get(get_inode_bitmap(), inum);
+}
+
+static int valid_block(int bnum)
+{
+    return bnum >= DATA_START && bnum < BLOCK_COUNT;
+}
+
+//The file's i th block, or 0 if its pointer leads outside the data blocks. Only a repair
+//cuts those off (check_block_map), so with -n everything after still has to step over them
+static int followable(inode_t *node, int i)
+{
+    if (i >= MAX_FILE_BLOCKS || (i >= DIRECT_BLOCKS && !valid_block(node->cont_block)))
+    {
+        return 0;
+    }
+    int bnum = inode_get_bnum(node, i);
+    return valid_block(bnum) ? bnum : 0;
+}
+
+//Cut the file short at its first block pointer that points outside the data blocks
+static void check_block_map(int inum)
+{
+    if (!allocated(inum))
+    {
+        return;
+    }
+    inode_t *node = get_inode(inum);
+    int nblocks = node->size < 0 ? 0 : bytes_to_blocks(node->size);
+    int keep = nblocks < MAX_FILE_BLOCKS ? nblocks : MAX_FILE_BLOCKS;
+    if (keep > DIRECT_BLOCKS && !valid_block(node->cont_block))
+    {
+        keep = DIRECT_BLOCKS;
+    }
+    for (int i = 0; i < keep; i++)
+    {
+        int bnum = inode_get_bnum(node, i);
+        if (bnum != 0 && !valid_block(bnum))
+        {
+            keep = i;
+        }
+        else if (bnum == 0 && !compress_enabled(node))
+        { //only compressed clusters leave blocks out
+            keep = i;
+        }
+    }
+    if (keep < nblocks || node->size < 0)
+    {
+        printf("fsck: inode %d has a bad block pointer at file block %d of %d\n", inum, keep, nblocks);
+        note(&found->bad_pointers);
+        if (repairing)
+        {
+            node->size = keep * BLOCK_SIZE;
+            if (keep <= DIRECT_BLOCKS)
+            {
+                node->cont_block = 0;
+            }
+        }
+    }
+}
+
+//Queue a directory for scanning the first time it is seen
+static void queue_dir(int inum)
+{
+    pthread_mutex_lock(&queue_lock);
+    if (!is_dir[inum])
+    {
+        is_dir[inum] = 1;
+        queue[queued++] = inum;
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+//Count the entries of one directory, dropping those that name no usable inode
+static void scan_dir(int inum)
+{
+    inode_t *node = get_inode(inum);
+    for (int b = 0; b < node->size / BLOCK_SIZE; b++)
+    {
+        int bnum = followable(node, b);
+        if (bnum == 0)
+        { //a bad pointer, already counted
+            continue;
+        }
+        dirent_t *block = (dirent_t *)blocks_get_block(bnum);
+        header_t *header = (header_t *)block;
+        int used = 0;
+        int changed = 0;
+        for (int i = DIR_HEADER_SLOTS; i < DIR_PER_BLOCK; i++)
+        {
+            if (!bitmap_get(header->bm, i))
+            {
+                continue;
+            }
+            int child = block[i].inum;
+            if (!allocated(child) || child == ROOT_INUM)
+            {
+                printf("fsck: %s in directory %d names inode %d, which is not in use\n", block[i].name,
+                       inum, child);
+                note(&found->bad_entries);
+                if (repairing)
+                {
+                    bitmap_put(header->bm, i, 0);
+                    changed = 1;
+                }
+                continue;
+            }
+            used++;
+            __atomic_fetch_add(&links[child], 1, __ATOMIC_RELAXED);
+            if (S_ISDIR(block[i].mode) && (get_inode(child)->mode & S_IFMT) == 0)
+            { //inodes from before the type was kept in them are found through their entry
+                queue_dir(child);
+            }
+        }
+        int header_bits = 0;
+        for (int i = 0; i < DIR_HEADER_SLOTS; i++)
+        {
+            header_bits += bitmap_get(header->bm, i);
+        }
+        if (header_bits != DIR_HEADER_SLOTS || header->free != DIR_PER_BLOCK - DIR_HEADER_SLOTS - used)
+        {
+            printf("fsck: directory %d block %d says %d entries are free, %d are\n", inum, b, header->free,
+                   DIR_PER_BLOCK - DIR_HEADER_SLOTS - used);
+            note(&found->bad_headers);
+            if (repairing)
+            {
+                for (int i = 0; i < DIR_HEADER_SLOTS; i++)
+                {
+                    bitmap_put(header->bm, i, 1);
+                }
+                header->free = DIR_PER_BLOCK - DIR_HEADER_SLOTS - used;
+                changed = 1;
+            }
+        }
+        if (changed)
+        { //rebuilt when the block is next written
+            header->bloom_ok = 0;
+        }
+    }
+}
+
+static void *dir_worker(void *arg)
+{
+    for (;;)
+    {
+        pthread_mutex_lock(&queue_lock);
+        int inum = scanned < queued ? queue[scanned++] : -1;
+        pthread_mutex_unlock(&queue_lock);
+        if (inum == -1)
+        {
+            return 0;
+        }
+        scan_dir(inum);
+    }
+}
+
+//Count the live tree's pointers to every block
+static void count_refs(int inum)
+{
+    if (!in_use[inum])
+    {
+        return;
+    }
+    inode_t *node = get_inode(inum);
+    int nblocks = bytes_to_blocks(node->size);
+    for (int i = 0; i < nblocks; i++)
+    {
+        int bnum = followable(node, i);
+        if (bnum > 0)
+        {
+            __atomic_fetch_add(&refs[bnum], 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (nblocks > DIRECT_BLOCKS && valid_block(node->cont_block))
+    {
+        __atomic_fetch_add(&refs[node->cont_block], 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void *range_worker(void *arg)
+{
+    range_t *range = (range_t *)arg;
+    for (int inum = range->first; inum < range->end; inum++)
+    {
+        range->check(inum);
+    }
+    return 0;
+}
+
+//How many of the threads asked for are worth starting for count inodes or directories
+static int useful_threads(int threads, int count)
+{
+    int useful = count / MIN_PER_THREAD;
+    return useful < 1 ? 1 : useful < threads ? useful : threads;
+}
+
+//Run check on every inode, split into one range per thread
+static void each_inode(int threads, void (*check)(int inum))
+{
+    pthread_t workers[MAX_FSCK_THREADS];
+    range_t ranges[MAX_FSCK_THREADS];
+    threads = useful_threads(threads, BLOCK_COUNT);
+    if (threads == 1)
+    {
+        range_t all = {0, BLOCK_COUNT, check};
+        range_worker(&all);
+        return;
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        ranges[t].first = BLOCK_COUNT * t / threads;
+        ranges[t].end = BLOCK_COUNT * (t + 1) / threads;
+        ranges[t].check = check;
+        pthread_create(&workers[t], 0, range_worker, &ranges[t]);
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        pthread_join(workers[t], 0);
+    }
+}
+
+//Scan every queued directory, and the ones found in them, with all threads
+static void scan_dirs(int threads)
+{
+    pthread_t workers[MAX_FSCK_THREADS];
+    if (useful_threads(threads, queued - scanned) == 1)
+    { //goes on until the directories it finds are scanned too
+        dir_worker(0);
+        return;
+    }
+    while (scanned < queued)
+    { //a thread that ran out may have missed directories queued after it
+        for (int t = 0; t < threads; t++)
+        {
+            pthread_create(&workers[t], 0, dir_worker, 0);
+        }
+        for (int t = 0; t < threads; t++)
+        {
+            pthread_join(workers[t], 0);
+        }
+    }
+}
+
+//Free an inode no directory names, and drop the links of what it named if it is a directory
+static void free_orphan(int inum)
+{
+    printf("fsck: inode %d is in use but no directory names it\n", inum);
+    found->orphans++;
+    if (!repairing)
+    {
+        return;
+    }
+    inode_t *node = get_inode(inum);
+    if (is_dir[inum])
+    {
+        for (int b = 0; b < node->size / BLOCK_SIZE && followable(node, b) != 0; b++)
+        {
+            dirent_t *block = (dirent_t *)blocks_read_block(followable(node, b));
+            for (int i = DIR_HEADER_SLOTS; i < DIR_PER_BLOCK; i++)
+            {
+                int child = block[i].inum;
+                if (bitmap_get(((header_t *)block)->bm, i) && allocated(child) && child != ROOT_INUM &&
+                    --links[child] == 0)
+                {
+                    free_orphan(child);
+                }
+            }
+        }
+    }
+    node->refs = 0;
+    node->size = 0; //its blocks are freed with the other unused ones
+    node->cont_block = 0;
+    bitmap_put(get_inode_bitmap(), inum, 0);
+}
+
+//Take in the orphan list, once the directories are known. What it names keeps its blocks
+//until the reclaimer gets to it, so it isn't freed here like an unnamed inode
+static void check_pending()
+{
+    int32_t *orphans = get_superblock()->orphans;
+    for (int i = 0; i < MAX_ORPHANS; i++)
+    {
+        int inum = orphans[i];
+        if (inum == 0)
+        {
+            continue;
+        }
+        if (!allocated(inum) || links[inum] > 0 || pending[inum])
+        {
+            printf("fsck: orphan list slot %d names inode %d, which isn't waiting to be freed\n", i, inum);
+            found->bad_pending++;
+            if (repairing)
+            {
+                orphans[i] = 0;
+            }
+            continue;
+        }
+        pending[inum] = 1;
+    }
+}
+
+//Mark the blocks a snapshot's tree holds on to
+static void mark_snapshot(const snapshot_t *snap, uint8_t *marks)
+{
+    for (int i = 0; i < INODE_TABLE_BLOCKS; i++)
+    {
+        if (valid_block(snap->itable[i]))
+        {
+            marks[snap->itable[i]] = 1;
+        }
+    }
+    for (int inum = 0; inum < BLOCK_COUNT; inum++)
+    {
+        if (!usable(inum) || !bitmap_get((void *)snap->ibm, inum))
+        {
+            continue;
+        }
+        inode_t *node = get_inode_in(snap->itable, inum);
+        int nblocks = bytes_to_blocks(node->size);
+        if (nblocks > DIRECT_BLOCKS)
+        {
+            if (!valid_block(node->cont_block))
+            {
+                nblocks = DIRECT_BLOCKS;
+            }
+            else
+            {
+                marks[node->cont_block] = 1;
+            }
+        }
+        for (int i = 0; i < nblocks && i < MAX_FILE_BLOCKS; i++)
+        {
+            int bnum = inode_get_bnum(node, i);
+            if (valid_block(bnum))
+            {
+                marks[bnum] = 1;
+            }
+        }
+    }
+}
+
+//Make the block bitmap and extra_refs agree with what uses each block
+static void check_blocks()
+{
+    uint8_t marks[256] = {0};
+    superblock_t *sb = get_superblock();
+    for (int i = 0; i < MAX_SNAPSHOTS; i++)
+    {
+        if (sb->snapshots[i].name[0] != '\0')
+        {
+            mark_snapshot(&sb->snapshots[i], marks);
+        }
+    }
+    void *bbm = get_blocks_bitmap();
+    for (int bnum = DATA_START; bnum < BLOCK_COUNT; bnum++)
+    {
+        int used = refs[bnum] > 0 || marks[bnum];
+        if (used && !bitmap_get(bbm, bnum))
+        {
+            printf("fsck: block %d is in use but free in the bitmap\n", bnum);
+            found->lost_blocks++;
+        }
+        else if (!used && bitmap_get(bbm, bnum))
+        {
+            printf("fsck: block %d is marked in use but nothing uses it\n", bnum);
+            found->leaked_blocks++;
+        }
+        block_info_t *info = get_block_info(bnum);
+        int extra = refs[bnum] > 1 ? refs[bnum] - 1 : 0;
+        extra = extra < UINT8_MAX ? extra : UINT8_MAX;
+        if (used && info->extra_refs != extra)
+        {
+            printf("fsck: block %d has %d extra references, not %d\n", bnum, extra, info->extra_refs);
+            found->bad_shares++;
+        }
+        if (repairing)
+        {
+            bitmap_put(bbm, bnum, used);
+            info->extra_refs = used ? extra : 0;
+        }
+    }
+}
+
+long fsck_run(int repair, int threads, fsck_report_t *report)
+{
+    threads = threads < 1 ? 1 : threads > MAX_FSCK_THREADS ? MAX_FSCK_THREADS : threads;
+    repairing = repair;
+    found = report;
+    memset(report, 0, sizeof(fsck_report_t));
+    memset(links, 0, sizeof(links));
+    memset(refs, 0, sizeof(refs));
+    memset(is_dir, 0, sizeof(is_dir));
+    memset(in_use, 0, sizeof(in_use));
+    memset(pending, 0, sizeof(pending));
+
+    //the block maps first, everything after follows them
+    each_inode(threads, check_block_map);
+
+    //then the directories, from every inode that says it is one
+    queued = scanned = 0;
+    if (repair)
+    {
+        bitmap_put(get_inode_bitmap(), ROOT_INUM, 1);
+    }
+    queue_dir(ROOT_INUM);
+    for (int inum = 0; inum < BLOCK_COUNT; inum++)
+    {
+        if (allocated(inum) && S_ISDIR(get_inode(inum)->mode))
+        {
+            queue_dir(inum);
+        }
+    }
+    scan_dirs(threads);
+    check_pending();
+
+    //link counts, and what nothing names
+    for (int inum = 0; inum < BLOCK_COUNT; inum++)
+    {
+        if (!allocated(inum))
+        {
+            if (bitmap_get(get_inode_bitmap(), inum))
+            { //past the end of its inode table block
+                found->orphans++;
+                if (repair)
+                {
+                    bitmap_put(get_inode_bitmap(), inum, 0);
+                }
+            }
+            else if (usable(inum) && get_inode(inum)->size != 0)
+            { //alloc_inode expects free inodes to be empty
+                printf("fsck: inode %d is free but still has %ld bytes\n", inum, get_inode(inum)->size);
+                found->stale_inodes++;
+                if (repair)
+                {
+                    get_inode(inum)->size = 0;
+                    get_inode(inum)->cont_block = 0;
+                }
+            }
+            continue;
+        }
+        if (inum != ROOT_INUM && links[inum] == 0 && !pending[inum])
+        {
+            free_orphan(inum);
+        }
+    }
+    for (int inum = 0; inum < BLOCK_COUNT; inum++)
+    {
+        inode_t *node = get_inode(inum);
+        in_use[inum] = allocated(inum) && (inum == ROOT_INUM || links[inum] > 0 || pending[inum]);
+        if (!in_use[inum] || inum == ROOT_INUM)
+        {
+            continue;
+        }
+        if (node->refs != links[inum])
+        {
+            printf("fsck: inode %d has refs %d, %d entries name it\n", inum, node->refs, links[inum]);
+            found->bad_links++;
+            if (repair)
+            {
+                node->refs = links[inum];
+            }
+        }
+        if (repair && is_dir[inum] && !S_ISDIR(node->mode))
+        { //not a problem, but the type is kept in the inode now
+            node->mode = (node->mode & ~S_IFMT) | S_IFDIR;
+        }
+    }
+
+    //then who uses which block
+    each_inode(threads, count_refs);
+    check_blocks();
+    if (repair)
+    {
+        groups_init();
+        extents_init();
+    }
+
+    long problems = report->bad_pointers + report->bad_entries + report->bad_headers + report->orphans +
+                    report->stale_inodes + report->bad_links + report->lost_blocks + report->leaked_blocks +
+                    report->bad_shares + report->bad_pending;
+    printf("fsck_run(%d, %d) -> %ld problems\n", repair, threads, problems);
+    return problems;
+}
@@ -0,0 +1,44 @@
+// Offline consistency check and repair of an image.
+//
+// Cross-checks the inode block maps, the directories, the inode bitmap and
+// link counts, and the block bitmap and shared block counts:
+//
+// - block pointers outside the data blocks cut the file short there
+// - directory entries naming a free or unusable inode are removed, and a
+//   directory block's free count is recounted from its bitmap
+// - inodes in use that no directory names are freed (with whatever they
+//   named, for a directory), free inodes are emptied, and refs is set to
+//   the number of entries
+// - inodes on the superblock's orphan list count as named, with no refs,
+//   and slots naming a free, named or repeated inode are cleared
+// - blocks the live tree or a snapshot uses are marked in use, the rest
+//   freed, and extra_refs is set from the number of live references
+//
+// The inode table and the directories are scanned in parallel, one range
+// of inodes (or one directory) per thread at a time, and repairs are made
+// in place. A thread is only started for each 1024 inodes or directories,
+// fewer don't pay for it, so the 256 inodes of an image are checked by the
+// calling thread alone. Runs on an image opened with storage_init and the mmap
+// backend, with nothing else using it.
+#ifndef FSCK_H
+#define FSCK_H
+
+typedef struct fsck_report
+{
+    long bad_pointers;  // block pointers out of range, the file was cut short there
+    long bad_entries;   // directory entries naming a free or unusable inode
+    long bad_headers;   // directory blocks with a wrong free count or header bit
+    long orphans;       // inodes in use that no directory names
+    long stale_inodes;  // free inodes that still have a size, alloc_inode would reuse their blocks
+    long bad_links;     // inodes whose refs didn't match the entries naming them
+    long lost_blocks;   // blocks in use but free in the bitmap
+    long leaked_blocks; // blocks marked in use that nothing uses
+    long bad_shares;    // blocks whose extra_refs didn't match their references
+    long bad_pending;   // orphan list slots naming a free, named or repeated inode
+} fsck_report_t;
+
+// Check the open image with the given number of threads, fixing what is found if repair is set.
+// Returns the number of problems found
+long fsck_run(int repair, int threads, fsck_report_t *report);
+
+#endif
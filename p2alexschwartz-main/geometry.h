@@ -0,0 +1,34 @@
+/**
+ * @file geometry.h
+ *
+ * The geometry of the image, fixed when nufs is built.
+ *
+ * A profile is picked with make PROFILE=NAME:
+ * - 4k (the default): 256 blocks of 4K, a 1MB image
+ * - 64k: 256 blocks of 64K, a 16MB image
+ * - runtime: 4k, with BLOCK_SIZE, BLOCK_COUNT, NUFS_SIZE and DIR_PER_BLOCK
+ *   left as const ints defined in blocks.c and directory.c, so every
+ *   division and loop bound that uses them is worked out at runtime.
+ *
+ * Otherwise they are constant expressions, and whatever the on-disk
+ * structures need of them is checked with static assertions next to the
+ * structures, so a geometry they can't hold doesn't build. An image can
+ * only be mounted by a build of the profile that made it.
+ */
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#ifndef NUFS_BLOCK_SHIFT
+#define NUFS_BLOCK_SHIFT 12 // 4K blocks
+#endif
+
+#define GEOMETRY_BLOCK_SIZE (1 << NUFS_BLOCK_SHIFT)
+#define GEOMETRY_BLOCK_COUNT 256 // in every profile, block 0 has room for the bitmaps of this many
+
+#ifdef NUFS_RUNTIME_GEOMETRY
+#define GEOMETRY_PROFILE "runtime"
+#else
+#define GEOMETRY_PROFILE "constant"
+#endif
+
+#endif
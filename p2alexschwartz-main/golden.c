@@ -0,0 +1,329 @@
+#include "golden.h"
+#include "compress.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define BUCKET_PATHS 4 //paths per bucket on average
+#define MAX_SEED 65536 //seeds tried for a bucket before giving up
+
+typedef struct golden_slot
+{
+    const char *path;
+    dirent_t *entry;
+} golden_slot_t;
+
+//Paths found while walking the tree, kept as offsets while the name pool grows
+typedef struct walk
+{
+    size_t *offsets;
+    dirent_t **entries;
+    long count;
+    long room;
+    char *names;
+    size_t used;
+    size_t size;
+    char prefix[PATH_MAX];
+} walk_t;
+
+static golden_slot_t *slots = 0;
+static int *seeds = 0; //per bucket: 0 if empty, > 0 the seed its paths hash to slots with, < 0 -1 - the slot of its one path
+static char *names = 0; //every path, one after the other
+static long nslots = 0;
+static long nbuckets = 0;
+static pthread_mutex_t compressed_lock = PTHREAD_MUTEX_INITIALIZER;
+static golden_stats_t stats;
+
+static long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+//FNV-1a from a seeded start, then mixed so each seed spreads the paths differently
+static uint32_t hash(const char *path, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (; *path != '\0'; path++)
+    {
+        h ^= (uint8_t)*path;
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static int add_path(walk_t *w, const char *path, dirent_t *entry)
+{
+    size_t length = strlen(path) + 1;
+    if (w->count == w->room)
+    {
+        w->room = w->room ? w->room * 2 : 256;
+        w->offsets = realloc(w->offsets, w->room * sizeof(size_t));
+        w->entries = realloc(w->entries, w->room * sizeof(dirent_t *));
+    }
+    if (w->used + length > w->size)
+    {
+        w->size = (w->used + length) * 2;
+        w->names = realloc(w->names, w->size);
+    }
+    if (w->offsets == 0 || w->entries == 0 || w->names == 0)
+    {
+        return -1;
+    }
+    memcpy(w->names + w->used, path, length);
+    w->offsets[w->count] = w->used;
+    w->entries[w->count++] = entry;
+    w->used += length;
+    return 0;
+}
+
+static int collect(dirent_t *entry, void *arg)
+{
+    walk_t *w = (walk_t *)arg;
+    size_t length = strlen(w->prefix);
+    if (length + 1 + strlen(entry->name) >= sizeof(w->prefix))
+    { //too deep to be looked up anyway
+        return 0;
+    }
+    sprintf(w->prefix + length, "/%s", entry->name);
+    int rv = add_path(w, w->prefix, entry);
+    if (rv == 0 && S_ISDIR(entry->mode))
+    {
+        rv = directory_foreach(get_inode(entry->inum), collect, w);
+    }
+    w->prefix[length] = '\0';
+    return rv;
+}
+
+void golden_forget()
+{
+    free(slots);
+    free(seeds);
+    free(names);
+    slots = 0;
+    seeds = 0;
+    names = 0;
+}
+
+static const char *path_of(walk_t *w, long i)
+{
+    return names + w->offsets[i];
+}
+
+//Give every path a slot, see golden.h. Returns the largest seed a bucket needed, or -1
+static int place(walk_t *w)
+{
+    long *first = calloc(nbuckets + 1, sizeof(long)); //bucket b's paths are members[first[b]] on
+    long *fill = calloc(nbuckets, sizeof(long));
+    long *members = malloc(w->count * sizeof(long));
+    long *taken = malloc(w->count * sizeof(long)); //slots picked for the bucket being placed
+    int max_seed = first && fill && members && taken ? 0 : -1;
+    long biggest = 0;
+    if (max_seed == 0)
+    {
+        for (long i = 0; i < w->count; i++)
+        {
+            first[hash(path_of(w, i), 0) % nbuckets + 1]++;
+        }
+        for (long b = 0; b < nbuckets; b++)
+        {
+            first[b + 1] += first[b];
+        }
+        for (long i = 0; i < w->count; i++)
+        {
+            long b = hash(path_of(w, i), 0) % nbuckets;
+            members[first[b] + fill[b]++] = i;
+            biggest = fill[b] > biggest ? fill[b] : biggest;
+        }
+    }
+
+    for (long size = biggest; max_seed != -1 && size > 1; size--)
+    { //the biggest buckets are placed while there is the most room
+        for (long b = 0; b < nbuckets && max_seed != -1; b++)
+        {
+            if (fill[b] != size)
+            {
+                continue;
+            }
+            int seed = 1;
+            for (; seed < MAX_SEED; seed++)
+            {
+                long k = 0;
+                for (; k < size; k++)
+                {
+                    long slot = hash(path_of(w, members[first[b] + k]), seed) % nslots;
+                    long j = 0;
+                    while (j < k && taken[j] != slot)
+                    {
+                        j++;
+                    }
+                    if (slots[slot].path != 0 || j < k)
+                    {
+                        break;
+                    }
+                    taken[k] = slot;
+                }
+                if (k == size)
+                {
+                    break;
+                }
+            }
+            if (seed == MAX_SEED)
+            {
+                max_seed = -1;
+                break;
+            }
+            for (long k = 0; k < size; k++)
+            {
+                long i = members[first[b] + k];
+                slots[taken[k]] = (golden_slot_t){path_of(w, i), w->entries[i]};
+            }
+            seeds[b] = seed;
+            max_seed = seed > max_seed ? seed : max_seed;
+        }
+    }
+
+    long next = 0;
+    for (long b = 0; b < nbuckets && max_seed != -1; b++)
+    { //the rest have a bucket each and take what is left in order
+        if (fill[b] != 1)
+        {
+            continue;
+        }
+        while (slots[next].path != 0)
+        {
+            next++;
+        }
+        long i = members[first[b]];
+        slots[next] = (golden_slot_t){path_of(w, i), w->entries[i]};
+        seeds[b] = -1 - next;
+    }
+    free(first);
+    free(fill);
+    free(members);
+    free(taken);
+    return max_seed;
+}
+
+int golden_build()
+{
+    long start = now_ns();
+    golden_forget();
+    walk_t *w = calloc(1, sizeof(walk_t));
+    if (w == 0)
+    {
+        return -1;
+    }
+    int rv = add_path(w, "/", (dirent_t *)get_root_entry());
+    if (rv == 0)
+    {
+        rv = directory_foreach(get_inode(ROOT_INUM), collect, w);
+    }
+    names = w->names;
+    nslots = w->count + w->count / 4 + 1;
+    nbuckets = w->count / BUCKET_PATHS + 1;
+    slots = calloc(nslots, sizeof(golden_slot_t));
+    seeds = calloc(nbuckets, sizeof(int));
+    int max_seed = rv == 0 && slots != 0 && seeds != 0 ? place(w) : -1;
+    long count = w->count;
+    free(w->offsets);
+    free(w->entries);
+    free(w);
+    if (max_seed == -1)
+    {
+        golden_forget();
+        printf("golden_build() -> -1, lookups walk the directories\n");
+        return -1;
+    }
+
+    stats.paths = count;
+    stats.slots = nslots;
+    stats.buckets = nbuckets;
+    stats.max_seed = max_seed;
+    stats.build_ns = now_ns() - start;
+    printf("golden_build() -> %ld paths in %ld slots, seeds up to %d, %ld us\n", count, nslots, max_seed,
+           stats.build_ns / 1000);
+    return count;
+}
+
+//Only paths spelled the way the table has them: from the root, no empty components or
+//trailing slash, and no name the directories would have cut short
+static int canonical(const char *path)
+{
+    if (path[0] != '/')
+    {
+        return 0;
+    }
+    if (path[1] == '\0')
+    {
+        return 1;
+    }
+    int length = 0;
+    for (const char *c = path + 1;; c++)
+    {
+        if (*c != '/' && *c != '\0')
+        {
+            length++;
+            continue;
+        }
+        if (length == 0 || length > DIR_NAME_LENGTH)
+        {
+            return 0;
+        }
+        if (*c == '\0')
+        {
+            return 1;
+        }
+        length = 0;
+    }
+}
+
+int golden_lookup(const char *path, dirent_t **entry)
+{
+    if (slots == 0 || !canonical(path))
+    {
+        return 0;
+    }
+    *entry = 0;
+    int seed = seeds[hash(path, 0) % nbuckets];
+    if (seed == 0)
+    {
+        return 1;
+    }
+    golden_slot_t *slot = &slots[seed < 0 ? -1 - seed : hash(path, seed) % nslots];
+    if (strcmp(slot->path, path) == 0)
+    {
+        *entry = slot->entry;
+    }
+    return 1;
+}
+
+int golden_read(inode_t *node, void *buf, size_t size, off_t offset)
+{
+    if (!compress_enabled(node))
+    {
+        return inode_read(node, buf, size, offset);
+    }
+    pthread_mutex_lock(&compressed_lock);
+    stats.compressed++;
+    int rv = inode_read(node, buf, size, offset);
+    pthread_mutex_unlock(&compressed_lock);
+    return rv;
+}
+
+golden_stats_t *golden_get_stats()
+{
+    return &stats;
+}
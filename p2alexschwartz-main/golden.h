@@ -0,0 +1,48 @@
+// Serving golden images: immutable images mounted read only.
+//
+// With -o golden the image is mapped PROT_READ and nothing in it is ever
+// written, so requests need no storage lock (storage_lock does nothing)
+// and there is no dirty state to track. Every path in the tree is put in a
+// minimal perfect hash table at mount, and directory_path_lookup answers
+// from it: one hash, one displacement and one string compare, instead of
+// a walk through the directory blocks of every component.
+//
+// The table is hash and displace: paths are hashed into buckets of about
+// four, and each bucket gets the first seed that sends all of its paths to
+// slots nothing else uses yet (biggest buckets first). A bucket of one
+// takes the next free slot directly.
+#ifndef GOLDEN_H
+#define GOLDEN_H
+
+#include "directory.h"
+
+#include <sys/types.h>
+
+typedef struct golden_stats
+{
+    long paths;      // paths in the table
+    long slots;      // size of the table
+    long buckets;    // buckets the paths were hashed into
+    int max_seed;    // the largest seed a bucket needed
+    long build_ns;   // time taken to walk the tree and build the table
+    long compressed; // reads of compressed files, which still take the golden lock
+} golden_stats_t;
+
+// Build the path table over the tree being served, once storage_init_golden has opened the image.
+// Returns the number of paths, or -1 if the table couldn't be built (lookups walk the tree then)
+int golden_build();
+
+// Drop the table, when another image is opened
+void golden_forget();
+
+// Look the path up in the table. Returns 0 if the table can't answer for it (not built, or a
+// path written in a way the tree wasn't), else 1 with entry set to the entry or 0 if there is none
+int golden_lookup(const char *path, dirent_t **entry);
+
+// inode_read without the storage lock. The cache of decompressed clusters is shared, so compressed
+// files are still read one at a time
+int golden_read(inode_t *node, void *buf, size_t size, off_t offset);
+
+golden_stats_t *golden_get_stats();
+
+#endif
@@ -0,0 +1,156 @@
+/**
+ * @file group.c
+ *
+ * Locks of the allocation groups, and their free counters in the
+ * superblock.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "group.h"
+#include "inode.h"
+
+_Static_assert(GROUP_SIZE == 64, "a group's slice of a bitmap is one 64-bit word");
+
+typedef struct group
+{
+  pthread_mutex_t lock;
+  long home;
+  long away;
+} __attribute__((aligned(64))) group_t; // one cache line each, the point is not to share
+
+static group_t groups[GROUP_COUNT];
+static uint64_t usable[GROUP_COUNT]; // the inodes of each group that can be handed out at all
+static group_stats_t stats;
+
+// A group's slice of a bitmap, bit i for block or inode i of the group
+static uint64_t slice(const void *bitmap, int group)
+{
+  uint64_t word;
+  memcpy(&word, (const uint8_t *)bitmap + group * GROUP_SIZE / 8, sizeof(word));
+  return word;
+}
+
+static uint64_t usable_inodes(int group)
+{
+  uint64_t mask = 0;
+  for (int i = 0; i < GROUP_SIZE; i++)
+  {
+    mask |= (uint64_t)inode_fits(group * GROUP_SIZE + i) << i;
+  }
+  return mask;
+}
+
+void groups_init()
+{
+  group_desc_t *descs = get_superblock()->groups;
+  const void *bbm = get_blocks_bitmap();
+  const void *ibm = get_inode_bitmap();
+  for (int g = 0; g < GROUP_COUNT; g++)
+  {
+    pthread_mutex_init(&groups[g].lock, 0);
+    groups[g].home = 0;
+    groups[g].away = 0;
+    usable[g] = usable_inodes(g);
+
+    int free_blocks = GROUP_SIZE - __builtin_popcountll(slice(bbm, g));
+    int free_inodes = __builtin_popcountll(~slice(ibm, g) & usable[g]);
+    if (descs[g].free_blocks != free_blocks || descs[g].free_inodes != free_inodes)
+    { // both 0 on a new image or one from before the counters, nothing to report
+      if (descs[g].free_blocks != 0 || descs[g].free_inodes != 0)
+      {
+        printf("group %d: superblock says %d free blocks and %d free inodes, bitmaps say %d and %d\n",
+               g, descs[g].free_blocks, descs[g].free_inodes, free_blocks, free_inodes);
+      }
+      if (!blocks_policy()->readonly)
+      { // statfs will be off on an image served read only
+        descs[g].free_blocks = free_blocks;
+        descs[g].free_inodes = free_inodes;
+      }
+    }
+  }
+}
+
+int group_of(int n) { return n / GROUP_SIZE; }
+
+int home_group()
+{
+  int cpu = sched_getcpu();
+  return cpu < 0 ? 0 : cpu % GROUP_COUNT;
+}
+
+void group_lock(int group) { pthread_mutex_lock(&groups[group].lock); }
+
+void group_unlock(int group) { pthread_mutex_unlock(&groups[group].lock); }
+
+int group_free_blocks(int group) { return get_superblock()->groups[group].free_blocks; }
+
+int group_free_inodes(int group) { return get_superblock()->groups[group].free_inodes; }
+
+void groups_total(int *free_blocks, int *free_inodes)
+{
+  const group_desc_t *descs = get_superblock()->groups;
+  *free_blocks = 0;
+  *free_inodes = 0;
+  for (int g = 0; g < GROUP_COUNT; g++)
+  {
+    *free_blocks += descs[g].free_blocks;
+    *free_inodes += descs[g].free_inodes;
+  }
+}
+
+int groups_usable_inodes()
+{
+  int count = 0;
+  for (int g = 0; g < GROUP_COUNT; g++)
+  {
+    count += __builtin_popcountll(usable[g]);
+  }
+  return count;
+}
+
+int group_first_free_inode(int group)
+{
+  uint64_t free = ~slice(get_inode_bitmap(), group) & usable[group];
+  if (group == 0)
+  { // inode 0 is the root, claimed rather than allocated
+    free &= ~1ull;
+  }
+  return free == 0 ? -1 : group * GROUP_SIZE + __builtin_ctzll(free);
+}
+
+static void count(group_t *group, int delta, int home)
+{
+  if (delta < 0)
+  { // only allocations say anything about placement
+    *(home ? &group->home : &group->away) += 1;
+  }
+}
+
+void group_count_blocks(int group, int delta, int home)
+{
+  get_superblock()->groups[group].free_blocks += delta;
+  count(&groups[group], delta, home);
+}
+
+void group_count_inodes(int group, int delta, int home)
+{
+  get_superblock()->groups[group].free_inodes += delta;
+  count(&groups[group], delta, home);
+}
+
+group_stats_t *group_get_stats()
+{
+  memset(&stats, 0, sizeof(stats));
+  for (int g = 0; g < GROUP_COUNT; g++)
+  {
+    stats.home += groups[g].home;
+    stats.away += groups[g].away;
+  }
+  return &stats;
+}
@@ -0,0 +1,91 @@
+/**
+ * @file group.h
+ *
+ * Allocation groups: the blocks and the inodes are split into GROUP_COUNT
+ * ranges of GROUP_SIZE, each with its own lock and free counters. The
+ * counters are kept in the superblock, so statfs only has to add them up.
+ * The locks make the allocator safe to call without the storage lock, but
+ * every FUSE callback holds that for its whole run, so in a mount they are
+ * never contended and allocations don't run in parallel.
+ *
+ * The bitmaps in block 0 stay the record of what is in use, a group owns
+ * its slice of them and of the block_info table. Each CPU has a home
+ * group that alloc_block and alloc_inode try first; alloc_inode_near
+ * tries the group of a related inode instead, so a directory's entries
+ * end up together.
+ */
+#ifndef GROUP_H
+#define GROUP_H
+
+#include "geometry.h"
+
+#define GROUP_SIZE 64 // blocks, and inodes, per group
+#define GROUP_COUNT (GEOMETRY_BLOCK_COUNT / GROUP_SIZE)
+
+typedef struct group_stats
+{
+  long home; // allocations from the preferred group
+  long away; // allocations that had to go to another group
+} group_stats_t;
+
+/**
+ * Check the free counters of every group in the superblock against the
+ * bitmaps, and correct them if they are off. Called by blocks_init.
+ */
+void groups_init();
+
+/**
+ * The group a block or inode number belongs to.
+ */
+int group_of(int n);
+
+/**
+ * The group of the CPU the calling thread runs on.
+ */
+int home_group();
+
+/**
+ * Lock a group's slice of the bitmaps and its counters.
+ */
+void group_lock(int group);
+void group_unlock(int group);
+
+/**
+ * Free blocks and inodes in a group. Read without the lock they are only
+ * a hint.
+ */
+int group_free_blocks(int group);
+int group_free_inodes(int group);
+
+/**
+ * Free blocks and inodes of the whole image, from the counters.
+ */
+void groups_total(int *free_blocks, int *free_inodes);
+
+/**
+ * How many inodes can be handed out at all, free or not.
+ */
+int groups_usable_inodes();
+
+/**
+ * The lowest numbered free inode of a group that can be handed out, or -1,
+ * found in the group's slice of the inode bitmap in one go. Called with the
+ * group locked.
+ */
+int group_first_free_inode(int group);
+
+/**
+ * Note blocks or inodes of a group being allocated (delta -1) or freed
+ * (delta 1), with the group locked.
+ *
+ * @param home Whether an allocation was in the preferred group.
+ */
+void group_count_blocks(int group, int delta, int home);
+void group_count_inodes(int group, int delta, int home);
+
+/**
+ * Counters since the image was opened.
+ */
+group_stats_t *group_get_stats();
+
+#endif
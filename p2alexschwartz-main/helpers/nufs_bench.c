@@ -0,0 +1,1457 @@
+// Micro benchmarks for nufs internals, run against a scratch image
+// without going through FUSE.
+//
+// usage: nufs_bench <name> [image]
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "batch.h"
+#include "bitmap.h"
+#include "compress.h"
+#include "dedup.h"
+#include "defrag.h"
+#include "group.h"
+#include "directory.h"
+#include "fsck.h"
+#include "golden.h"
+#include "lazytime.h"
+#include "mkfs.h"
+#include "orphan.h"
+#include "readahead.h"
+#include "storage.h"
+#include "window.h"
+#include "writebuf.h"
+
+#define BENCH_IMAGE "bench.nufs"
+
+static double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static const char *image = BENCH_IMAGE;
+
+// Start every benchmark from a freshly formatted image.
+static void fresh_image()
+{
+  unlink(image);
+  storage_init(image);
+}
+
+// Compiler-style include probing: every header is looked for in each
+// search directory in turn, so most lookups miss.
+static int bench_probe()
+{
+  const int dirs = 4, headers = 600, rounds = 200;
+  char path[64];
+
+  fresh_image();
+  inode_t *root = get_inode(ROOT_INUM);
+  int inums[dirs];
+  for (int d = 0; d < dirs; d++)
+  {
+    inums[d] = alloc_inode();
+    directory_const(get_inode(inums[d]));
+    sprintf(path, "inc%d", d);
+    directory_put(root, path, inums[d], 040755);
+  }
+  for (int h = 0; h < headers; h++)
+  { // each header lives in exactly one of the search directories
+    sprintf(path, "header_%d.h", h);
+    directory_put(get_inode(inums[h % dirs]), path, inums[h % dirs], 0100644);
+  }
+
+  directory_stats_t *stats = directory_get_stats();
+  memset(stats, 0, sizeof(*stats));
+  long misses = 0;
+  double start = now_ns();
+  for (int r = 0; r < rounds; r++)
+  {
+    for (int h = 0; h < headers; h++)
+    {
+      sprintf(path, "header_%d.h", h);
+      for (int d = 0; d < dirs; d++)
+      {
+        if (directory_lookup(get_inode(inums[d]), path) != 0)
+        {
+          break;
+        }
+        misses++;
+      }
+    }
+  }
+  double elapsed = now_ns() - start;
+  long checked = stats->block_probes - stats->bloom_skips;
+  long hits = rounds * headers;
+
+  fprintf(stderr, "probe: %ld lookups, %ld ENOENT, %.1f ns/lookup\n",
+          hits + misses, misses, elapsed / (hits + misses));
+  fprintf(stderr, "probe: %ld block probes, %ld skipped by bloom, "
+                  "false positive rate %.2f%%\n",
+          stats->block_probes, stats->bloom_skips,
+          100.0 * stats->bloom_false / (stats->bloom_false + stats->bloom_skips));
+  fprintf(stderr, "probe: %ld blocks scanned in full\n", checked);
+  return 0;
+}
+
+static int used_blocks()
+{
+  int used = 0;
+  for (int i = 0; i < BLOCK_COUNT; i++)
+  {
+    used += bitmap_get(get_blocks_bitmap(), i);
+  }
+  return used;
+}
+
+// Write files of 4 blocks where every other file repeats an earlier one
+// (vendored copies), returning the time spent in inode_write.
+static double write_vendored(int files)
+{
+  char data[4 * 4096];
+  double spent = 0;
+  for (int f = 0; f < files; f++)
+  {
+    for (int i = 0; i < sizeof(data); i++)
+    {
+      data[i] = (char)(i * 31 + (f / 2) * 7 + i / 4096);
+    }
+    int inum = alloc_inode();
+    double start = now_ns();
+    inode_write(get_inode(inum), data, sizeof(data), 0);
+    spent += now_ns() - start;
+  }
+  return spent;
+}
+
+// Space saved by an offline scan, and what inline dedup adds to inode_write.
+static int bench_dedup()
+{
+  const int files = 40, rounds = 50;
+
+  fresh_image();
+  write_vendored(files);
+  int before = used_blocks();
+  long shared = dedup_scan();
+  fprintf(stderr, "dedup: offline scan shared %ld blocks, %d -> %d blocks in use\n",
+          shared, before, used_blocks());
+
+  for (int on = 0; on <= 1; on++)
+  {
+    double spent = 0;
+    for (int r = 0; r < rounds; r++)
+    {
+      fresh_image();
+      dedup_set_inline(on);
+      spent += write_vendored(files);
+    }
+    fprintf(stderr, "dedup: inline %s, %.0f ns per 4 block write, %d blocks in use\n",
+            on ? "on " : "off", spent / (rounds * files), used_blocks());
+  }
+  dedup_set_inline(0);
+  return 0;
+}
+
+// Log-like text, the kind of data compression is for.
+static void fill_text(char *data, int size)
+{
+  int at = 0;
+  for (int line = 0; at < size; line++)
+  {
+    at += snprintf(data + at, size - at, "{\"ts\":%d,\"level\":\"%s\",\"req\":%d,\"msg\":\"request done\"}\n",
+                   1700000000 + line, line % 7 ? "info" : "warn", (line * 7919) % 100000);
+  }
+}
+
+static void fill_random(char *data, int size)
+{
+  for (int i = 0; i < size; i++)
+  {
+    data[i] = rand();
+  }
+}
+
+// Ratio and throughput of compressed files against plain ones, written and
+// read back 4K at a time like FUSE does.
+static int bench_compress()
+{
+  const int size = 512 * 1024, chunk = 4096, rounds = 20;
+  static char data[512 * 1024], back[512 * 1024];
+  struct
+  {
+    const char *name;
+    void (*fill)(char *, int);
+  } kinds[] = {{"text", fill_text}, {"random", fill_random}};
+
+  for (int k = 0; k < 2; k++)
+  {
+    kinds[k].fill(data, size);
+    for (int on = 0; on <= 1; on++)
+    {
+      double wrote = 0, read = 0;
+      int blocks = 0;
+      for (int r = 0; r < rounds; r++)
+      {
+        fresh_image();
+        int before = used_blocks();
+        inode_t *node = get_inode(alloc_inode());
+        compress_set(node, on);
+        double start = now_ns();
+        for (int at = 0; at < size; at += chunk)
+        {
+          inode_write(node, data + at, chunk, at);
+        }
+        wrote += now_ns() - start;
+        start = now_ns();
+        for (int at = 0; at < size; at += chunk)
+        {
+          inode_read(node, back + at, chunk, at);
+        }
+        read += now_ns() - start;
+        blocks = used_blocks() - before;
+        if (memcmp(data, back, size) != 0)
+        {
+          fprintf(stderr, "compress: %s data read back wrong\n", kinds[k].name);
+          return 1;
+        }
+      }
+      double mb = (double)size * rounds / (1024 * 1024);
+      fprintf(stderr, "compress: %-6s %s %3d blocks (ratio %.2f), write %6.1f MB/s, read %6.1f MB/s\n",
+              kinds[k].name, on ? "on " : "off", blocks, (double)size / BLOCK_SIZE / blocks,
+              mb / (wrote / 1e9), mb / (read / 1e9));
+    }
+  }
+  return 0;
+}
+
+// Write the image out and drop it from the page cache, so the next reads
+// have to go to the disk.
+static void drop_cache()
+{
+  blocks_free();
+  int fd = open(image, O_RDWR);
+  fsync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+  storage_init(image);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Latency of the first lookup and read of every file after mounting cold,
+// under each way of mapping the image.
+static int bench_mapping()
+{
+  const int dirs = 4, files = 25, rounds = 20;
+  const int ops = dirs * files;
+  static double lat[20 * 100];
+  struct
+  {
+    const char *name;
+    map_policy_t policy;
+  } setups[] = {
+      {"plain", {0, 0, 0, MADV_NORMAL, MADV_NORMAL}},
+      {"populate", {1, 0, 0, MADV_NORMAL, MADV_NORMAL}},
+      {"mlock", {0, 1, 0, MADV_NORMAL, MADV_NORMAL}},
+      {"hugepages", {0, 0, 1, MADV_NORMAL, MADV_NORMAL}},
+      {"populate+mlock", {1, 1, 0, MADV_NORMAL, MADV_NORMAL}},
+      {"willneed", {0, 0, 0, MADV_WILLNEED, MADV_WILLNEED}},
+      {"random", {0, 0, 0, MADV_WILLNEED, MADV_RANDOM}},
+      {"sequential", {0, 0, 0, MADV_WILLNEED, MADV_SEQUENTIAL}},
+  };
+  char path[64], data[4096];
+
+  for (int s = 0; s < sizeof(setups) / sizeof(setups[0]); s++)
+  {
+    double mount = 0;
+    int n = 0;
+    for (int r = 0; r < rounds; r++)
+    {
+      map_policy_t plain = {0, 0, 0, MADV_NORMAL, MADV_NORMAL};
+      blocks_set_policy(&plain);
+      fresh_image();
+      for (int d = 0; d < dirs; d++)
+      {
+        int inum = alloc_inode();
+        directory_const(get_inode(inum));
+        sprintf(path, "d%d", d);
+        directory_put(get_inode(ROOT_INUM), path, inum, 040755);
+        for (int f = 0; f < files; f++)
+        {
+          int file = alloc_inode();
+          memset(data, 'a' + f % 26, sizeof(data));
+          inode_write(get_inode(file), data, sizeof(data), 0);
+          sprintf(path, "f%d", f);
+          directory_put(get_inode(inum), path, file, 0100644);
+        }
+      }
+
+      blocks_set_policy(&setups[s].policy);
+      double start = now_ns();
+      drop_cache();
+      mount += now_ns() - start;
+      for (int i = 0; i < ops; i++)
+      { // a fixed shuffle of all the files
+        int op = (i * 37) % ops;
+        sprintf(path, "/d%d/f%d", op / files, op % files);
+        start = now_ns();
+        dirent_t *entry = directory_path_lookup(path);
+        inode_read(get_inode(entry->inum), data, sizeof(data), 0);
+        lat[n++] = now_ns() - start;
+      }
+    }
+    qsort(lat, n, sizeof(double), compare_doubles);
+    fprintf(stderr, "mapping: %-14s mount %6.0f us, p50 %5.1f us, p99 %5.1f us, p99.9 %5.1f us, max %6.1f us\n",
+            setups[s].name, mount / rounds / 1e3, lat[n / 2] / 1e3, lat[n * 99 / 100] / 1e3,
+            lat[n * 999 / 1000] / 1e3, lat[n - 1] / 1e3);
+  }
+  return 0;
+}
+
+// Cold sequential reads of a file whose blocks are interleaved with another
+// file's, 4K at a time like FUSE does, with and without readahead.
+static int bench_readahead()
+{
+  const int blocks = 100, rounds = 20;
+  char data[4096];
+
+  for (int on = 0; on <= 1; on++)
+  {
+    double spent = 0;
+    readahead_stats_t *stats = readahead_get_stats();
+    memset(stats, 0, sizeof(*stats));
+    for (int r = 0; r < rounds; r++)
+    {
+      fresh_image();
+      int inums[2] = {alloc_inode(), alloc_inode()};
+      for (int b = 0; b < blocks; b++)
+      {
+        for (int f = 0; f < 2; f++)
+        {
+          memset(data, 'a' + f, sizeof(data));
+          inode_write(get_inode(inums[f]), data, sizeof(data), b * sizeof(data));
+        }
+      }
+      drop_cache();
+
+      inode_t *node = get_inode(inums[0]);
+      readahead_t ra;
+      readahead_init(&ra);
+      double start = now_ns();
+      for (int b = 0; b < blocks; b++)
+      {
+        if (on)
+        {
+          readahead_access(&ra, node, b * sizeof(data), sizeof(data));
+        }
+        inode_read(node, data, sizeof(data), b * sizeof(data));
+      }
+      spent += now_ns() - start;
+    }
+    double mb = (double)blocks * sizeof(data) * rounds / (1024 * 1024);
+    fprintf(stderr, "readahead: %s %6.1f MB/s cold sequential, %ld madvise calls for %ld blocks\n",
+            on ? "on " : "off", mb / (spent / 1e9), stats->calls / rounds, stats->blocks / rounds);
+  }
+  return 0;
+}
+
+// Mixed reads and overwrites of 100 files spread over the whole image,
+// under each backend and cache budget. Every operation is one request.
+static int bench_backend()
+{
+  const int files = 100, ops = 20000;
+  struct
+  {
+    const char *backend;
+    int cache;
+  } setups[] = {{"mmap", 0}, {"pread", 16}, {"pread", 64}, {"pread", 256},
+                {"direct", 16}, {"direct", 64}, {"direct", 256}};
+  char data[2 * 4096];
+  int inums[100];
+
+  for (int s = 0; s < sizeof(setups) / sizeof(setups[0]); s++)
+  {
+    blocks_set_backend("mmap", DEFAULT_CACHE_BLOCKS);
+    fresh_image();
+    for (int f = 0; f < files; f++)
+    {
+      inums[f] = alloc_inode();
+      memset(data, 'a' + f % 26, sizeof(data));
+      inode_write(get_inode(inums[f]), data, sizeof(data), 0);
+    }
+    blocks_set_backend(setups[s].backend, setups[s].cache);
+    drop_cache();
+    memset(backend_get_stats(), 0, sizeof(backend_stats_t));
+
+    srand(1);
+    double start = now_ns();
+    for (int i = 0; i < ops; i++)
+    {
+      inode_t *node;
+      storage_lock();
+      node = get_inode(inums[rand() % files]);
+      if (rand() % 5 == 0)
+      {
+        inode_write(node, data, 4096, (rand() % 2) * 4096);
+      }
+      else
+      {
+        inode_read(node, data, sizeof(data), 0);
+      }
+      storage_unlock();
+    }
+    double spent = now_ns() - start;
+    storage_flush();
+    backend_stats_t *stats = backend_get_stats();
+    fprintf(stderr, "backend: %-6s cache %3d: %6.2f us/op", setups[s].backend, setups[s].cache,
+            spent / ops / 1e3);
+    if (strcmp(setups[s].backend, "mmap") != 0)
+    {
+      fprintf(stderr, ", hit rate %5.1f%%, %ld writebacks, %ld overflows",
+              100.0 * stats->hits / (stats->hits + stats->misses), stats->writebacks, stats->overflows);
+    }
+    fprintf(stderr, "\n");
+  }
+  blocks_set_backend("mmap", DEFAULT_CACHE_BLOCKS);
+  return 0;
+}
+
+// Cold reads of 64K files whose blocks are scattered over the image, one
+// request per file, through plain O_DIRECT and through io_uring at each
+// queue depth.
+static int bench_uring()
+{
+  const int files = 12, blocks = 16, rounds = 20;
+  const int depths[] = {0, 1, 2, 4, 8, 16, 32, 64}; // 0 is the direct backend
+  static char data[16 * 4096];
+  int inums[12];
+
+  for (int d = 0; d < sizeof(depths) / sizeof(depths[0]); d++)
+  {
+    double spent = 0;
+    for (int r = 0; r < rounds; r++)
+    {
+      blocks_set_backend("mmap", DEFAULT_CACHE_BLOCKS);
+      fresh_image();
+      for (int f = 0; f < files; f++)
+      {
+        inums[f] = alloc_inode();
+      }
+      for (int b = 0; b < blocks; b++)
+      { // interleaved, so each file's blocks are 12 apart
+        for (int f = 0; f < files; f++)
+        {
+          memset(data, 'a' + f, 4096);
+          inode_write(get_inode(inums[f]), data, 4096, b * 4096);
+        }
+      }
+      blocks_set_backend(depths[d] ? "uring-direct" : "direct", 256);
+      backend_set_queue_depth(depths[d] ? depths[d] : DEFAULT_QUEUE_DEPTH);
+      drop_cache();
+
+      double start = now_ns();
+      for (int f = 0; f < files; f++)
+      {
+        storage_lock();
+        inode_read(get_inode(inums[f]), data, sizeof(data), 0);
+        storage_unlock();
+      }
+      spent += now_ns() - start;
+    }
+    double mb = (double)files * sizeof(data) * rounds / (1024 * 1024);
+    if (depths[d] == 0)
+      fprintf(stderr, "uring: direct (pread)   %7.1f MB/s\n", mb / (spent / 1e9));
+    else
+      fprintf(stderr, "uring: queue depth %3d  %7.1f MB/s\n", depths[d], mb / (spent / 1e9));
+  }
+  blocks_set_backend("mmap", DEFAULT_CACHE_BLOCKS);
+  return 0;
+}
+
+// A scratch workload: create a file, write it, fsync it and delete it,
+// one request each, on the image file and in memory.
+static int bench_scratch()
+{
+  const int ops = 2000;
+  const char *backends[] = {"mmap", "pread", "memory", "memfd"};
+  char data[2 * 4096];
+  char name[32];
+  memset(data, 'x', sizeof(data));
+
+  for (int b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+  {
+    blocks_set_backend(backends[b], DEFAULT_CACHE_BLOCKS);
+    fresh_image();
+    inode_t *root = get_inode(ROOT_INUM);
+
+    double start = now_ns();
+    for (int i = 0; i < ops; i++)
+    {
+      sprintf(name, "f%d", i);
+      storage_lock();
+      int inum = alloc_inode();
+      directory_put(root, name, inum, 0100644);
+      storage_unlock();
+
+      storage_lock();
+      inode_write(get_inode(inum), data, sizeof(data), 0);
+      storage_unlock();
+      storage_flush();
+
+      storage_lock();
+      directory_delete(root, name);
+      free_inode(inum);
+      storage_unlock();
+    }
+    double spent = now_ns() - start;
+    fprintf(stderr, "scratch: %-6s %7.2f us per create+write+fsync+delete\n", backends[b],
+            spent / ops / 1e3);
+  }
+  blocks_set_backend("mmap", DEFAULT_CACHE_BLOCKS);
+  return 0;
+}
+
+// Files appended to at the same time, a block per request in turn, then
+// each read back cold. Without windows their blocks interleave.
+static int bench_fragment()
+{
+  const int files = 8, blocks = 24, rounds = 20;
+  const int sizes[] = {0, 4, 8, 16};
+  static char data[24 * 4096];
+  int inums[8];
+
+  for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+  {
+    window_set_size(sizes[s]);
+    double spent = 0;
+    long extents = 0;
+    for (int r = 0; r < rounds; r++)
+    {
+      fresh_image();
+      for (int f = 0; f < files; f++)
+      {
+        inums[f] = alloc_inode();
+      }
+      for (int b = 0; b < blocks; b++)
+      {
+        for (int f = 0; f < files; f++)
+        {
+          memset(data, 'a' + f, 4096);
+          storage_lock();
+          inode_write(get_inode(inums[f]), data, 4096, b * 4096);
+          storage_unlock();
+        }
+      }
+      for (int f = 0; f < files; f++)
+      { // closed
+        window_release(get_inode(inums[f]));
+        extents += inode_extents(get_inode(inums[f]));
+      }
+      drop_cache();
+
+      double start = now_ns();
+      for (int f = 0; f < files; f++)
+      {
+        inode_read(get_inode(inums[f]), data, sizeof(data), 0);
+      }
+      spent += now_ns() - start;
+    }
+    double mb = (double)files * sizeof(data) * rounds / (1024 * 1024);
+    fprintf(stderr, "fragment: window %2d  %5.1f extents per MB, %7.1f MB/s cold read\n", sizes[s],
+            extents / mb, mb / (spent / 1e9));
+  }
+  window_set_size(DEFAULT_WINDOW_BLOCKS);
+  return 0;
+}
+
+static int global_lock; // take the storage lock around each allocation, as callbacks do
+
+static void allocator_lock()
+{
+  if (global_lock)
+    storage_lock();
+}
+
+static void allocator_unlock()
+{
+  if (global_lock)
+    storage_unlock();
+}
+
+static void *allocator_main(void *arg)
+{
+  const int ops = 20000;
+  for (int i = 0; i < ops; i++)
+  {
+    allocator_lock();
+    int bnum = alloc_block();
+    allocator_unlock();
+    allocator_lock();
+    int inum = alloc_inode();
+    allocator_unlock();
+
+    allocator_lock();
+    free_block(bnum);
+    free_inode(inum);
+    allocator_unlock();
+  }
+  return 0;
+}
+
+// Threads allocating and freeing a block and an inode over and over, with
+// every allocation under the storage lock, as in a mount, and with only the
+// group locks, which nothing in a mount does yet.
+static int bench_groups()
+{
+  const int counts[] = {1, 2, 4, 8};
+  pthread_t threads[8];
+
+  fresh_image();
+  for (global_lock = 1; global_lock >= 0; global_lock--)
+  {
+    for (int c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+    {
+      double start = now_ns();
+      for (int t = 0; t < counts[c]; t++)
+      {
+        pthread_create(&threads[t], 0, allocator_main, 0);
+      }
+      for (int t = 0; t < counts[c]; t++)
+      {
+        pthread_join(threads[t], 0);
+      }
+      double spent = now_ns() - start;
+      fprintf(stderr, "groups: %-12s %d threads %6.2f M allocations/s\n",
+              global_lock ? "storage lock" : "group locks", counts[c], counts[c] * 20000 * 2 / (spent / 1e3));
+    }
+  }
+  group_stats_t *stats = group_get_stats();
+  fprintf(stderr, "groups: %.1f%% of allocations in the home group\n",
+          100.0 * stats->home / (stats->home + stats->away));
+  return 0;
+}
+
+// Best fit for a run of count free blocks by scanning the bitmap, what
+// finding contiguous space took before the extent index.
+static int scan_best_fit(int count)
+{
+  void *bbm = get_blocks_bitmap();
+  int best = -1, best_length = BLOCK_COUNT + 1;
+  for (int i = 1; i < BLOCK_COUNT;)
+  {
+    int j = i;
+    while (j < BLOCK_COUNT && !bitmap_get(bbm, j))
+    {
+      j++;
+    }
+    if (j - i >= count && j - i < best_length)
+    {
+      best = i;
+      best_length = j - i;
+    }
+    i = j + 1;
+  }
+  return best;
+}
+
+// Looking for contiguous runs in an image where a random half of the
+// blocks are in use, through the extent index and by scanning the bitmap.
+static int bench_extents()
+{
+  const int counts[] = {1, 4, 8, 16}, lookups = 200000;
+  int held[256], n = 0;
+
+  fresh_image();
+  int free_blocks = 0;
+  for (int g = 0; g < GROUP_COUNT; g++)
+  {
+    free_blocks += group_free_blocks(g);
+  }
+  while (n < free_blocks)
+  {
+    held[n++] = alloc_block();
+  }
+  srand(1);
+  for (int i = 0; i < n; i++)
+  {
+    if (rand() % 2)
+      free_block(held[i]);
+  }
+
+  for (int c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+  {
+    int length, found = 0;
+    double start = now_ns();
+    for (int i = 0; i < lookups; i++)
+    {
+      found += blocks_find_run(counts[c], i % GROUP_COUNT, &length) != -1 && length == counts[c];
+    }
+    double indexed = now_ns() - start;
+    start = now_ns();
+    for (int i = 0; i < lookups; i++)
+    {
+      scan_best_fit(counts[c]);
+    }
+    double scanned = now_ns() - start;
+    fprintf(stderr, "extents: run of %2d  index %6.1f ns, bitmap scan %7.1f ns (%s)\n", counts[c],
+            indexed / lookups, scanned / lookups, found ? "found" : "none that long");
+  }
+  return 0;
+}
+
+// What statfs reports, from the counters and counted from the bitmaps
+static int bench_statfs()
+{
+  const int calls = 1000000;
+  int held[256], n = 0;
+
+  fresh_image();
+  srand(1);
+  for (int i = 0; i < 100; i++)
+  {
+    held[n++] = alloc_block();
+  }
+  for (int i = 0; i < n; i++)
+  {
+    if (rand() % 2)
+      free_block(held[i]);
+  }
+
+  int free_blocks, free_inodes, sum = 0;
+  double start = now_ns();
+  for (int i = 0; i < calls; i++)
+  {
+    groups_total(&free_blocks, &free_inodes);
+    sum += free_blocks;
+  }
+  double counted = now_ns() - start;
+
+  int scanned_blocks = 0;
+  start = now_ns();
+  for (int i = 0; i < calls; i++)
+  {
+    scanned_blocks = 0;
+    for (int bnum = 0; bnum < BLOCK_COUNT; bnum++)
+    {
+      scanned_blocks += !bitmap_get(get_blocks_bitmap(), bnum);
+    }
+    sum += scanned_blocks;
+  }
+  double scanned = now_ns() - start;
+  fprintf(stderr, "statfs: counters %5.1f ns, bitmap scan %7.1f ns (%d free blocks, scan says %d)\n",
+          counted / calls, scanned / calls, free_blocks, scanned_blocks);
+  return sum == 0 || free_blocks != scanned_blocks;
+}
+
+// The interleaved files of the fragment bench, read back cold before and
+// after a defragmentation pass
+static int bench_defrag()
+{
+  const int files = 8, blocks = 24, rounds = 20;
+  static char data[24 * 4096];
+  int inums[8];
+  double spent[2] = {0, 0};
+  long extents[2] = {0, 0}, moved = 0;
+
+  window_set_size(0);
+  defrag_set_budget(DEFAULT_DEFRAG_BUDGET_US);
+  for (int r = 0; r < rounds; r++)
+  {
+    fresh_image();
+    for (int f = 0; f < files; f++)
+    {
+      inums[f] = alloc_inode();
+    }
+    for (int b = 0; b < blocks; b++)
+    {
+      for (int f = 0; f < files; f++)
+      {
+        memset(data, 'a' + f, 4096);
+        storage_lock();
+        inode_write(get_inode(inums[f]), data, 4096, b * 4096);
+        storage_unlock();
+      }
+    }
+    // some files gone, so the rest have room to move into
+    for (int f = 0; f < files; f += 2)
+    {
+      storage_lock();
+      shrink_inode(get_inode(inums[f]), 0);
+      storage_unlock();
+    }
+    for (int pass = 0; pass < 2; pass++)
+    {
+      if (pass == 1)
+      {
+        moved += defrag_run();
+      }
+      drop_cache();
+      double start = now_ns();
+      for (int f = 1; f < files; f += 2)
+      {
+        extents[pass] += inode_extents(get_inode(inums[f]));
+        inode_read(get_inode(inums[f]), data, sizeof(data), 0);
+        if (data[0] != 'a' + f || data[sizeof(data) - 1] != 'a' + f)
+        {
+          fprintf(stderr, "defrag: file %d reads back wrong\n", f);
+          return 1;
+        }
+      }
+      spent[pass] += now_ns() - start;
+    }
+  }
+  double mb = (double)files / 2 * sizeof(data) * rounds / (1024 * 1024);
+  fprintf(stderr, "defrag: before %5.1f extents per MB, %7.1f MB/s cold read\n", extents[0] / mb,
+          mb / (spent[0] / 1e9));
+  fprintf(stderr, "defrag: after  %5.1f extents per MB, %7.1f MB/s cold read (%ld blocks moved)\n",
+          extents[1] / mb, mb / (spent[1] / 1e9), moved / rounds);
+  window_set_size(DEFAULT_WINDOW_BLOCKS);
+  return 0;
+}
+
+// A full image checked with 1 to 8 threads asked for, which all use one at this size
+static int bench_fsck()
+{
+  const int dirs = 4, files = 40, rounds = 200;
+  const int threads[] = {1, 2, 4, 8};
+  char name[32], data[4096];
+  memset(data, 'x', sizeof(data));
+
+  fresh_image();
+  inode_t *root = get_inode(ROOT_INUM);
+  for (int d = 0; d < dirs; d++)
+  {
+    int dir = alloc_inode();
+    get_inode(dir)->mode = 040755;
+    directory_const(get_inode(dir));
+    sprintf(name, "dir%d", d);
+    directory_put(root, name, dir, 040755);
+    for (int f = 0; f < files; f++)
+    {
+      int inum = alloc_inode();
+      if (inum == -1)
+        break;
+      sprintf(name, "file%d", f);
+      directory_put(get_inode(dir), name, inum, 0100644);
+      inode_write(get_inode(inum), data, f % 2 ? 1 : sizeof(data), 0);
+    }
+  }
+
+  fsck_report_t report;
+  for (int t = 0; t < sizeof(threads) / sizeof(threads[0]); t++)
+  {
+    long problems = 0;
+    double start = now_ns();
+    for (int r = 0; r < rounds; r++)
+    {
+      problems += fsck_run(0, threads[t], &report);
+    }
+    double spent = now_ns() - start;
+    fprintf(stderr, "fsck: %d threads %8.1f us per check (%ld problems)\n", threads[t], spent / rounds / 1e3,
+            problems / rounds);
+  }
+  return 0;
+}
+
+// A host tree copied in file by file the way the callbacks do it (every
+// write looks the path up again), against laying it out with mkfs_populate.
+// Both include reading the host files. Through a mount, every callback
+// also costs a FUSE round trip, which this leaves out
+static int bench_mkfs()
+{
+  const int dirs = 6, files = 20, rounds = 50;
+  const int sizes[] = {64, 700, 3000, 6000};
+  char tree[] = "/tmp/nufs_bench.XXXXXX";
+  char path[128], host[160];
+  static char data[8192];
+  if (mkdtemp(tree) == 0)
+  {
+    perror("mkdtemp");
+    return 1;
+  }
+  fill_text(data, sizeof(data));
+  for (int d = 0; d < dirs; d++)
+  {
+    sprintf(host, "%s/dir%d", tree, d);
+    mkdir(host, 0755);
+    for (int f = 0; f < files; f++)
+    {
+      sprintf(host, "%s/dir%d/file%d", tree, d, f);
+      int fd = open(host, O_WRONLY | O_CREAT, 0644);
+      write(fd, data, sizes[f % 4]);
+      close(fd);
+    }
+  }
+
+  double spent[2] = {0, 0};
+  long extents[2] = {0, 0};
+  for (int r = 0; r < rounds; r++)
+  {
+    fresh_image();
+    double start = now_ns();
+    for (int d = 0; d < dirs; d++)
+    {
+      storage_lock();
+      int dir = alloc_inode_near(ROOT_INUM);
+      get_inode(dir)->mode = 040000;
+      directory_const(get_inode(dir));
+      sprintf(path, "dir%d", d);
+      directory_put(get_inode(ROOT_INUM), path, dir, 040755);
+      storage_unlock();
+      for (int f = 0; f < files; f++)
+      {
+        sprintf(host, "%s/dir%d/file%d", tree, d, f);
+        int fd = open(host, O_RDONLY);
+        storage_lock(); // mknod
+        sprintf(path, "/dir%d", d);
+        dirent_t *parent = directory_path_lookup(path);
+        int inum = alloc_inode_near(parent->inum);
+        get_inode(inum)->mode = 0100000;
+        sprintf(path, "file%d", f);
+        directory_put(get_inode(parent->inum), path, inum, 0100644);
+        storage_unlock();
+        sprintf(path, "/dir%d/file%d", d, f);
+        int got;
+        for (off_t off = 0; (got = read(fd, data, 4096)) > 0; off += got)
+        { // one write callback per page
+          storage_lock();
+          inode_write(get_inode(directory_path_lookup(path)->inum), data, got, off);
+          storage_unlock();
+        }
+        close(fd);
+      }
+    }
+    spent[0] += now_ns() - start;
+    for (int inum = 1; inum < BLOCK_COUNT; inum++)
+      if (bitmap_get(get_inode_bitmap(), inum))
+        extents[0] += inode_extents(get_inode(inum));
+
+    fresh_image();
+    mkfs_stats_t stats;
+    start = now_ns();
+    if (mkfs_populate(tree, &stats) != 0)
+    {
+      fprintf(stderr, "mkfs: populating failed\n");
+      return 1;
+    }
+    spent[1] += now_ns() - start;
+    extents[1] += stats.extents;
+  }
+
+  int total = dirs * files;
+  fprintf(stderr, "mkfs: callbacks %8.1f us per tree, %6.0f files/s, %ld extents\n", spent[0] / rounds / 1e3,
+          total * rounds / (spent[0] / 1e9), extents[0] / rounds);
+  fprintf(stderr, "mkfs: populate  %8.1f us per tree, %6.0f files/s, %ld extents\n", spent[1] / rounds / 1e3,
+          total * rounds / (spent[1] / 1e9), extents[1] / rounds);
+  sprintf(host, "rm -rf %s", tree);
+  return system(host) != 0;
+}
+
+// Path lookups and small reads of every file, through the storage lock and
+// the directory walk, then from a golden image with neither
+static int bench_golden()
+{
+  const int dirs = 4, files = 40, rounds = 2000;
+  char paths[4 * 40][32], name[32];
+  char data[4096];
+  fill_text(data, sizeof(data));
+
+  fresh_image();
+  inode_t *root = get_inode(ROOT_INUM);
+  for (int d = 0; d < dirs; d++)
+  {
+    int dir = alloc_inode();
+    get_inode(dir)->mode = 040000;
+    directory_const(get_inode(dir));
+    sprintf(name, "dir%d", d);
+    directory_put(root, name, dir, 040755);
+    for (int f = 0; f < files; f++)
+    {
+      int inum = alloc_inode();
+      get_inode(inum)->mode = 0100000;
+      sprintf(name, "file%d", f);
+      directory_put(get_inode(dir), name, inum, 0100644);
+      inode_write(get_inode(inum), data, sizeof(data), 0);
+      sprintf(paths[d * files + f], "/dir%d/file%d", d, f);
+    }
+  }
+  storage_flush();
+
+  const char *modes[] = {"locked", "golden"};
+  for (int m = 0; m < 2; m++)
+  {
+    if (m == 1)
+    {
+      storage_init_golden(image);
+      golden_build();
+    }
+    double lookups = 0, reads = 0;
+    long found = 0;
+    for (int r = 0; r < rounds; r++)
+    {
+      double start = now_ns();
+      for (int i = 0; i < dirs * files; i++)
+      {
+        storage_lock();
+        found += directory_path_lookup(paths[i]) != 0;
+        storage_unlock();
+      }
+      double middle = now_ns();
+      for (int i = 0; i < dirs * files; i++)
+      {
+        storage_lock();
+        dirent_t *entry = directory_path_lookup(paths[i]);
+        inode_t *node = get_inode(entry->inum);
+        found += (m == 0 ? inode_read(node, data, 512, 0) : golden_read(node, data, 512, 0)) == 512;
+        storage_unlock();
+      }
+      lookups += middle - start;
+      reads += now_ns() - middle;
+    }
+    int count = dirs * files * rounds;
+    fprintf(stderr, "golden: %s %6.1f ns per lookup, %6.1f ns per lookup and 512 byte read (%ld found)\n",
+            modes[m], lookups / count, reads / count, found / rounds);
+  }
+  fprintf(stderr, "golden: table of %ld paths built in %ld us\n", golden_get_stats()->paths,
+          golden_get_stats()->build_ns / 1000);
+  return 0;
+}
+
+// Unlinking and truncating a large file, freeing its blocks right away
+// or leaving them on the orphan list for the reclaimer
+static int bench_orphan()
+{
+  const int blocks = 200, rounds = 50;
+  static char data[4096];
+  double unlink_ns[2] = {0, 0}, truncate_ns[2] = {0, 0}, drain_ns = 0;
+
+  memset(data, 'o', sizeof(data));
+  for (int lazy = 0; lazy < 2; lazy++)
+  {
+    for (int r = 0; r < rounds; r++)
+    {
+      fresh_image();
+      if (lazy)
+      {
+        orphan_start();
+      }
+      int inums[2];
+      for (int f = 0; f < 2; f++)
+      {
+        inums[f] = alloc_inode();
+        for (int b = 0; b < blocks / 2; b++)
+        {
+          inode_write(get_inode(inums[f]), data, sizeof(data), b * 4096);
+        }
+      }
+
+      storage_lock();
+      double start = now_ns();
+      if (lazy)
+        orphan_free_inode(inums[0]);
+      else
+        free_inode(inums[0]);
+      unlink_ns[lazy] += now_ns() - start;
+      start = now_ns();
+      if (lazy)
+        orphan_truncate(inums[1], 4096);
+      else
+        shrink_inode(get_inode(inums[1]), 4096);
+      truncate_ns[lazy] += now_ns() - start;
+      storage_unlock();
+
+      if (lazy)
+      { // until the reclaimer has given everything back
+        start = now_ns();
+        while (1)
+        {
+          storage_lock();
+          int left = orphan_pending();
+          storage_unlock();
+          if (left == 0)
+            break;
+          sched_yield();
+        }
+        drain_ns += now_ns() - start;
+        orphan_stop();
+      }
+    }
+  }
+  fprintf(stderr, "orphan: %d block file, unlink %8.0f ns sync, %8.0f ns lazy\n", blocks / 2,
+          unlink_ns[0] / rounds, unlink_ns[1] / rounds);
+  fprintf(stderr, "orphan: %d block cut,  truncate %6.0f ns sync, %8.0f ns lazy\n", blocks / 2 - 1,
+          truncate_ns[0] / rounds, truncate_ns[1] / rounds);
+  fprintf(stderr, "orphan: reclaimer drained both in %.0f ns (%ld blocks in %ld inodes)\n", drain_ns / rounds,
+          orphan_get_stats()->blocks / rounds, orphan_get_stats()->reclaimed / rounds);
+  return 0;
+}
+
+// 64 byte appends, the way a logger writes, each one looked up and written
+// into the image as before, or taken by the open file's write buffer
+static int bench_append()
+{
+  const int lines = 4096, rounds = 10;
+  char line[64];
+  static writebuf_t wb;
+  double spent[2] = {0, 0};
+
+  memset(line, 'l', sizeof(line) - 1);
+  line[sizeof(line) - 1] = '\n';
+  for (int buffered = 0; buffered < 2; buffered++)
+  {
+    for (int r = 0; r < rounds; r++)
+    {
+      fresh_image();
+      int inum = alloc_inode();
+      directory_put(get_inode(ROOT_INUM), "log", inum, 0100644);
+      storage_lock();
+      writebuf_open(&wb, inum);
+      storage_unlock();
+      double start = now_ns();
+      for (int i = 0; i < lines; i++)
+      {
+        storage_lock();
+        if (buffered)
+        {
+          writebuf_write(&wb, line, sizeof(line), i * sizeof(line));
+        }
+        else
+        {
+          dirent_t *entry = directory_path_lookup("/log");
+          inode_write(get_inode(entry->inum), line, sizeof(line), i * sizeof(line));
+        }
+        storage_unlock();
+      }
+      storage_lock();
+      writebuf_close(&wb);
+      storage_unlock();
+      spent[buffered] += now_ns() - start;
+      if (get_inode(inum)->size != lines * sizeof(line))
+      {
+        fprintf(stderr, "append: file is %ld bytes\n", get_inode(inum)->size);
+        return 1;
+      }
+    }
+  }
+  double mb = (double)lines * sizeof(line) * rounds / (1024 * 1024);
+  for (int buffered = 0; buffered < 2; buffered++)
+  {
+    fprintf(stderr, "append: %-10s %7.0f ns per 64 byte write, %6.1f MB/s\n", buffered ? "buffered" : "unbuffered",
+            spent[buffered] / (lines * rounds), mb / (spent[buffered] / 1e9));
+  }
+  fprintf(stderr, "append: %ld writes buffered in %ld write backs\n", writebuf_get_stats()->buffered,
+          writebuf_get_stats()->flushes);
+  return 0;
+}
+
+// Untar and rm -r of a directory of files, each create and unlink finding
+// the directory from the root and room from its first block as before, or
+// going through the batch
+static int bench_untar()
+{
+  const int files = 200, rounds = 50;
+  char path[64], name[64];
+  double spent[2][2] = {{0, 0}, {0, 0}}; // [batched][create, unlink]
+
+  for (int batched = 0; batched < 2; batched++)
+  {
+    for (int r = 0; r < rounds; r++)
+    {
+      fresh_image();
+      int d = alloc_inode();
+      get_inode(d)->mode = 040755;
+      directory_const(get_inode(d));
+      directory_put(get_inode(ROOT_INUM), "src", d, 040755);
+
+      double start = now_ns();
+      for (int i = 0; i < files; i++)
+      {
+        sprintf(path, "/src/file%04d.c", i);
+        storage_lock();
+        int dir = batched ? batch_parent(path, name) : -1;
+        if (!batched)
+        {
+          copy_folder(path, name, strlen(path));
+          dir = directory_path_lookup(name)->inum;
+          copy_file(path, name, strlen(path));
+        }
+        int inum = alloc_inode_near(dir);
+        get_inode(inum)->mode = 0100644;
+        if (batched)
+          batch_put(dir, name, inum, 0100644);
+        else
+          directory_put(get_inode(dir), name, inum, 0100644);
+        storage_unlock();
+      }
+      spent[batched][0] += now_ns() - start;
+
+      start = now_ns();
+      for (int i = 0; i < files; i++)
+      {
+        sprintf(path, "/src/file%04d.c", i);
+        storage_lock();
+        if (batched)
+        {
+          int dir = batch_parent(path, name);
+          free_inode(batch_delete(dir, name));
+        }
+        else
+        {
+          free_inode(directory_path_lookup(path)->inum);
+          copy_folder(path, name, strlen(path));
+          int dir = directory_path_lookup(name)->inum;
+          copy_file(path, name, strlen(path));
+          directory_delete(get_inode(dir), name);
+        }
+        storage_unlock();
+      }
+      storage_lock();
+      batch_end();
+      storage_unlock();
+      spent[batched][1] += now_ns() - start;
+      if (directory_path_lookup("/src/file0000.c") != 0)
+      {
+        fprintf(stderr, "untar: a file survived rm -r\n");
+        return 1;
+      }
+    }
+  }
+  for (int batched = 0; batched < 2; batched++)
+  {
+    fprintf(stderr, "untar: %-10s %9.0f files/s created, %9.0f files/s removed\n",
+            batched ? "batched" : "one by one", files * rounds / (spent[batched][0] / 1e9),
+            files * rounds / (spent[batched][1] / 1e9));
+  }
+  fprintf(stderr, "untar: %ld directory lookups saved, %ld filters rebuilt\n", batch_get_stats()->hits,
+          batch_get_stats()->refilters);
+  return 0;
+}
+
+// Reads and overwrites in place across many small files, writing every
+// atime and mtime change to the inode table as it happens or keeping them
+// in memory until unmount (lazytime)
+static int bench_inode()
+{
+  const int files = 64, ops = 200000;
+  char buf[64];
+  int inums[files];
+  double spent[2] = {0, 0};
+  long writes[2] = {0, 0};
+
+  memset(buf, 'i', sizeof(buf));
+  for (int lazy = 0; lazy < 2; lazy++)
+  {
+    fresh_image();
+    for (int i = 0; i < files; i++)
+    {
+      inums[i] = alloc_inode();
+      get_inode(inums[i])->mode = 0100644;
+      inode_write(get_inode(inums[i]), buf, sizeof(buf), 0);
+    }
+    lazytime_stats_t before = *lazytime_get_stats();
+    double start = now_ns();
+    for (int i = 0; i < ops; i++)
+    {
+      int inum = inums[i * 7 % files];
+      int which = i % 4 == 0 ? TIME_MTIME | TIME_CTIME : TIME_ATIME;
+      storage_lock();
+      if (which == TIME_ATIME)
+        inode_read(get_inode(inum), buf, sizeof(buf), 0);
+      else
+        inode_write(get_inode(inum), buf, sizeof(buf), 0);
+      if (lazy)
+        inode_touch(inum, which);
+      else
+        inode_stamp(inum, which);
+      storage_unlock();
+    }
+    storage_lock();
+    lazytime_flush_all(); // unmount
+    storage_unlock();
+    spent[lazy] = now_ns() - start;
+    writes[lazy] = lazytime_get_stats()->stamped - before.stamped + lazytime_get_stats()->flushed - before.flushed;
+  }
+  for (int lazy = 0; lazy < 2; lazy++)
+  {
+    fprintf(stderr, "inode: %-8s %6.0f ns per read or overwrite, %6ld inode table writes\n",
+            lazy ? "lazytime" : "strict", spent[lazy] / ops, writes[lazy]);
+  }
+
+  // stat of every inode, one shift and one cache line each
+  const int rounds = 20000;
+  long total = 0;
+  double start = now_ns();
+  for (int r = 0; r < rounds; r++)
+  {
+    for (int inum = 0; inum < BLOCK_COUNT; inum++)
+    {
+      inode_t *node = get_inode(inum);
+      total += node->mode != 0 ? node->size : 0;
+    }
+  }
+  fprintf(stderr, "inode: %6.1f ns per inode looked up (%ld)\n", (now_ns() - start) / (rounds * BLOCK_COUNT),
+          total / rounds);
+  return 0;
+}
+
+// Where file positions fall in their blocks, with the block size as a
+// constant and as a value the compiler can't see through (what every build
+// used to do, and PROFILE=runtime still does)
+static int runtime_block_size; // set from BLOCK_SIZE when the bench runs
+
+__attribute__((noinline)) static long split_constant(long positions)
+{
+  long sum = 0;
+  for (long i = 0; i < positions; i++)
+  {
+    long offset = i * 1237;
+    sum += offset / BLOCK_SIZE + offset % BLOCK_SIZE;
+  }
+  return sum;
+}
+
+__attribute__((noinline)) static long split_runtime(long positions)
+{
+  long sum = 0;
+  for (long i = 0; i < positions; i++)
+  {
+    long offset = i * 1237;
+    sum += offset / runtime_block_size + offset % runtime_block_size;
+  }
+  return sum;
+}
+
+static int count_entry(dirent_t *entry, void *arg)
+{
+  (*(long *)arg)++;
+  return 0;
+}
+
+// The geometry's hot loops: the block arithmetic on its own, then small
+// reads and directory walks through the library as built. Compare the
+// second part across builds (make bench PROFILE=runtime)
+static int bench_geometry()
+{
+  const long positions = 50000000;
+  const int reads = 2000000, walks = 20000;
+  char buf[100];
+
+  fprintf(stderr, "geometry: %d blocks of %d bytes, %d entries per directory block, %s build\n", BLOCK_COUNT,
+          BLOCK_SIZE, DIR_PER_BLOCK, GEOMETRY_PROFILE);
+  runtime_block_size = BLOCK_SIZE;
+  double start = now_ns();
+  long a = split_constant(positions);
+  double constant = now_ns() - start;
+  start = now_ns();
+  long b = split_runtime(positions);
+  double runtime = now_ns() - start;
+  if (a != b)
+  {
+    fprintf(stderr, "geometry: the two splits disagree\n");
+    return 1;
+  }
+  fprintf(stderr, "geometry: %5.2f ns per position split by BLOCK_SIZE, %5.2f by a variable\n",
+          constant / positions, runtime / positions);
+
+  fresh_image();
+  int inum = alloc_inode();
+  get_inode(inum)->mode = 0100644;
+  static char data[8 * 4096];
+  memset(data, 'g', sizeof(data));
+  inode_write(get_inode(inum), data, sizeof(data), 0);
+  int d = alloc_inode();
+  get_inode(d)->mode = 040755;
+  directory_const(get_inode(d));
+  char name[32];
+  for (int i = 0; i < 150; i++)
+  {
+    sprintf(name, "entry%03d", i);
+    directory_put(get_inode(d), name, inum, 0100644);
+  }
+
+  start = now_ns();
+  for (int i = 0; i < reads; i++)
+  {
+    inode_read(get_inode(inum), buf, sizeof(buf), (long)i * 977 % (sizeof(data) - sizeof(buf)));
+  }
+  double read_ns = (now_ns() - start) / reads;
+  long entries = 0;
+  start = now_ns();
+  for (int i = 0; i < walks; i++)
+  {
+    directory_foreach(get_inode(d), count_entry, &entries);
+  }
+  double walk_ns = (now_ns() - start) / walks;
+  fprintf(stderr, "geometry: %6.1f ns per 100 byte read, %7.1f ns per walk of %ld entries\n", read_ns, walk_ns,
+          entries / walks);
+  return 0;
+}
+
+typedef struct bench
+{
+  const char *name;
+  int (*run)();
+} bench_t;
+
+static bench_t benches[] = {
+    {"probe", bench_probe},
+    {"dedup", bench_dedup},
+    {"compress", bench_compress},
+    {"readahead", bench_readahead},
+    {"mapping", bench_mapping},
+    {"backend", bench_backend},
+    {"uring", bench_uring},
+    {"scratch", bench_scratch},
+    {"fragment", bench_fragment},
+    {"groups", bench_groups},
+    {"extents", bench_extents},
+    {"statfs", bench_statfs},
+    {"defrag", bench_defrag},
+    {"fsck", bench_fsck},
+    {"mkfs", bench_mkfs},
+    {"golden", bench_golden},
+    {"orphan", bench_orphan},
+    {"append", bench_append},
+    {"untar", bench_untar},
+    {"inode", bench_inode},
+    {"geometry", bench_geometry},
+};
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: %s <bench> [image]\n", argv[0]);
+    return 1;
+  }
+  if (argc > 2)
+  {
+    image = argv[2];
+  }
+  freopen("/dev/null", "w", stdout); // the library traces every call
+
+  for (int i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+  {
+    if (strcmp(argv[1], benches[i].name) == 0)
+    {
+      return benches[i].run();
+    }
+  }
+  fprintf(stderr, "unknown bench %s\n", argv[1]);
+  return 1;
+}
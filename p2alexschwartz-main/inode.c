@@ -1,45 +1,110 @@
 #include "inode.h"
 #include "bitmap.h"
+#include "dedup.h"
+#include "compress.h"
+#include "window.h"
+#include "group.h"
 
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
 #include <math.h>
 
 void print_inode(inode_t *node)
 {
-    printf("refs: %d, mode: %d, size: %d, block 0: %d, block 1: %d, block 2: %d, continuing blocks %d\n",
+    printf("refs: %d, mode: %d, size: %ld, block 0: %d, block 1: %d, block 2: %d, continuing blocks %d\n",
            node->refs, node->mode, node->size, node->blocks[0], node->blocks[1], node->blocks[2], node->cont_block);
 }
 
+static int itable[INODE_TABLE_BLOCKS] = INODE_TABLE_LIVE;
+
+void inode_set_table(const int *blocks)
+{
+    memcpy(itable, blocks, sizeof(itable));
+}
+
+inode_t *get_inode_in(const int *table, int inum)
+{
+    assert(inum >= 0 && inum < INODE_COUNT);
+    void *block = blocks_get_block(table[inum >> INODES_PER_BLOCK_SHIFT]);
+    return block + ((inum & (INODES_PER_BLOCK - 1)) << INODE_SIZE_SHIFT);
+}
+
 inode_t *get_inode(int inum)
 {
-    assert(inum >= 0 && inum < 256);
-    void *block = blocks_get_block(inum / 128 + 1);
-    return block + (inum % 128) * sizeof(inode_t);
+    return get_inode_in(itable, inum);
 }
 
-int alloc_inode()
+//Every inode does since version 2, version 1 packed 128 of 32 bytes into each table block
+int inode_fits(int inum)
 {
-    void *bbm = get_inode_bitmap();
+    return (inum % INODES_PER_BLOCK + 1) * sizeof(inode_t) <= BLOCK_SIZE;
+}
+
+//The first free inode of the group, set up with one reference
+static int alloc_inode_in(int group, int home)
+{
+    if (group_free_inodes(group) == 0)
+    {
+        return -1;
+    }
+    group_lock(group);
+    int inum = group_first_free_inode(group);
+    if (inum != -1)
+    {
+        bitmap_put(get_inode_bitmap(), inum, 1);
+        group_count_inodes(group, -1, home);
+    }
+    group_unlock(group);
+    if (inum != -1)
+    {
+        printf("+ alloc_inode() -> %d\n", inum);
+        inode_t *node = get_inode(inum);
+        node->cont_block = 0;
+        node->mode = 0;
+        node->refs = 1;
+    }
+    return inum;
+}
 
-    for (int ii = 1; ii < BLOCK_COUNT; ++ii)
-    { //equal number of blocks and inodes so it never runs out
-        if (!bitmap_get(bbm, ii))
+static int alloc_inode_from(int preferred)
+{
+    for (int i = 0; i < GROUP_COUNT; i++)
+    {
+        int group = (preferred + i) % GROUP_COUNT;
+        int inum = alloc_inode_in(group, group == preferred);
+        if (inum != -1)
         {
-            bitmap_put(bbm, ii, 1);
-            printf("+ alloc_inode() -> %d\n", ii);
-            inode_t *node = get_inode(ii);
-            node->cont_block = 0;
-            node->refs = 1;
-            return ii;
+            return inum;
         }
     }
-
     return -1;
 }
 
+int alloc_inode()
+{
+    return alloc_inode_from(home_group());
+}
+
+int alloc_inode_near(int inum)
+{
+    return alloc_inode_from(group_of(inum));
+}
+
+void claim_inode(int inum)
+{
+    void *bbm = get_inode_bitmap();
+    group_lock(group_of(inum));
+    if (!bitmap_get(bbm, inum))
+    {
+        bitmap_put(bbm, inum, 1);
+        group_count_inodes(group_of(inum), -1, 1);
+    }
+    group_unlock(group_of(inum));
+}
+
 void free_inode(int inum)
 {
     inode_t *node = get_inode(inum);
@@ -47,33 +112,47 @@ void free_inode(int inum)
     {
         shrink_inode(node, 0); //remove all the blocks
         void *bbm = get_inode_bitmap();
+        group_lock(group_of(inum));
         bitmap_put(bbm, inum, 0);
+        group_count_inodes(group_of(inum), 1, 0);
+        group_unlock(group_of(inum));
         printf(" + free_inode(%d)\n", inum);
     }
 }
 
-int round_up(double x)
-{ //it wasn't recognizing ceil
-    int truncated = (int)x;
-    return x > truncated ? x + 1 : x;
+//Make the cont_block private to this inode before changing any of its pointers
+static int cow_cont_block(inode_t *node)
+{
+    if (!block_shared(node->cont_block))
+    {
+        return node->cont_block;
+    }
+    int copy = alloc_block();
+    if (copy == -1)
+        return -1;
+    memcpy(blocks_get_block(copy), blocks_read_block(node->cont_block), BLOCK_SIZE);
+    free_block(node->cont_block);
+    node->cont_block = copy;
+    return copy;
 }
 
-int grow_inode(inode_t *node, int size)
+int64_t grow_inode(inode_t *node, int64_t size)
 {
     if (node->size >= size)
     {
         printf("large enough already\n");
         return node->size;
     }
-    int current = round_up((double)node->size / BLOCK_SIZE); //number of blocks
+    int current = bytes_to_blocks(node->size); //number of blocks
     printf("Starts with %d blocks\n", current);
+    int wanted = bytes_to_blocks(size < INODE_MAX_SIZE ? size : INODE_MAX_SIZE);
     int new_block;
-    for (int i = current; i < (float)size / BLOCK_SIZE; ++i)
+    for (int i = current; i < wanted; ++i)
     {
         if (i < DIRECT_BLOCKS)
         {
             printf("allocating a new direct block\n");
-            new_block = alloc_block();
+            new_block = window_alloc(node, i);
             if (new_block == -1)
                 return i * BLOCK_SIZE; //how much space was succesfully allocated
             node->blocks[i] = new_block;
@@ -88,44 +167,102 @@ int grow_inode(inode_t *node, int size)
                     return i * BLOCK_SIZE; //how much space was succesfully allocated
                 node->cont_block = new_block;
             }
+            else if (cow_cont_block(node) == -1)
+            {
+                return i * BLOCK_SIZE;
+            }
             printf("allocating a new block inside cont_block\n");
-            new_block = alloc_block();
+            new_block = window_alloc(node, i);
             if (new_block == -1)
                 return i * BLOCK_SIZE; //how much space was succesfully allocated
             ((int *)blocks_get_block(node->cont_block))[i - DIRECT_BLOCKS] = new_block;
         }
     }
+    if (size > INODE_MAX_SIZE)
+    { //past what the pointers can reach
+        return INODE_MAX_SIZE;
+    }
     node->size = size;
     return size;
 }
 
 //0 clears
-int shrink_inode(inode_t *node, int size)
+int64_t shrink_inode(inode_t *node, int64_t size)
 {
     if (node->size <= size)
     {
         return node->size;
     }
-    int current = node->size / BLOCK_SIZE;
-    for (int i = current; i * BLOCK_SIZE >= size; --i)
+    window_release(node);
+    if (compress_enabled(node))
     {
-        if (i < DIRECT_BLOCKS)
-        {
-            free_block(node->blocks[i]);
+        if (size % CLUSTER_SIZE != 0 && cluster_inflate(node, size / CLUSTER_SIZE) != 0)
+        { //a cluster cut short can't stay compressed, forgetting it would lose the part kept
+            return node->size;
         }
-        else
-        {
-            free_block(((int *)blocks_get_block(node->cont_block))[i - DIRECT_BLOCKS]);
-            if (i == DIRECT_BLOCKS)
-            {
-                node->cont_block = 0;
-            }
+        cluster_forget(node, size / CLUSTER_SIZE);
+    }
+    int keep = bytes_to_blocks(size);
+    for (int i = bytes_to_blocks(node->size) - 1; i >= keep; --i)
+    { //only blocks past the ones still needed for size
+        int bnum = inode_get_bnum(node, i);
+        if (bnum > 0)
+        { //0 is the unused tail of a compressed cluster
+            free_block(bnum);
         }
     }
+    if (keep <= DIRECT_BLOCKS && node->cont_block != 0)
+    {
+        free_block(node->cont_block);
+        node->cont_block = 0;
+    }
     node->size = size;
     return size;
 }
 
+int inode_extents(inode_t *node)
+{
+    int extents = 0;
+    int prev = 0;
+    for (int i = 0; i < bytes_to_blocks(node->size); i++)
+    {
+        int bnum = inode_get_bnum(node, i);
+        if (bnum > 0 && bnum != prev + 1)
+        { //0 is the unused tail of a compressed cluster, not a break
+            extents++;
+        }
+        prev = bnum > 0 ? bnum : prev;
+    }
+    return extents;
+}
+
+// Walk forward from file_bnum to the first block with data, then take the blocks after it that follow on
+int inode_next_extent(inode_t *node, int file_bnum, int *bnum, int *length, int *shared)
+{
+    int nblocks = bytes_to_blocks(node->size);
+    while (file_bnum < nblocks && inode_get_bnum(node, file_bnum) <= 0)
+    { //the unused tail of a compressed cluster has no block
+        file_bnum++;
+    }
+    if (file_bnum >= nblocks)
+    {
+        return -1;
+    }
+    *bnum = inode_get_bnum(node, file_bnum);
+    *shared = block_shared(*bnum);
+    *length = 1;
+    while (file_bnum + *length < nblocks)
+    {
+        int next = inode_get_bnum(node, file_bnum + *length);
+        if (next != *bnum + *length || block_shared(next) != *shared)
+        {
+            break;
+        }
+        ++*length;
+    }
+    return file_bnum;
+}
+
 // Returns the real block number pointed to by the given node's file_bnum th pointer
 int inode_get_bnum(inode_t *node, int file_bnum)
 {
@@ -137,18 +274,188 @@ int inode_get_bnum(inode_t *node, int file_bnum)
     {
         return -1;
     }
-    return ((int *)blocks_get_block(node->cont_block))[file_bnum - DIRECT_BLOCKS];
+    return ((const int *)blocks_read_block(node->cont_block))[file_bnum - DIRECT_BLOCKS];
+}
+
+// Returns a block number that can be written in place, copying the block first if it is shared
+int inode_cow_bnum(inode_t *node, int file_bnum)
+{
+    int bnum = inode_get_bnum(node, file_bnum);
+    if (bnum <= 0 || !block_shared(bnum))
+    {
+        return bnum;
+    }
+    int copy = alloc_block();
+    if (copy == -1)
+        return -1;
+    printf("copy on write of block %d to %d\n", bnum, copy);
+    memcpy(blocks_get_block(copy), blocks_read_block(bnum), BLOCK_SIZE);
+    if (file_bnum < DIRECT_BLOCKS)
+    {
+        node->blocks[file_bnum] = copy;
+    }
+    else
+    {
+        if (cow_cont_block(node) == -1)
+        {
+            free_block(copy);
+            return -1;
+        }
+        ((int *)blocks_get_block(node->cont_block))[file_bnum - DIRECT_BLOCKS] = copy;
+    }
+    free_block(bnum);
+    return copy;
+}
+
+// Point the file_bnum th pointer of the node at bnum, making room in the cont_block if needed
+int inode_set_bnum(inode_t *node, int file_bnum, int bnum)
+{
+    if (file_bnum < 0 || file_bnum >= INODE_MAX_SIZE / BLOCK_SIZE)
+    { //past the last pointer the cont_block has room for
+        return -1;
+    }
+    if (file_bnum < DIRECT_BLOCKS)
+    {
+        node->blocks[file_bnum] = bnum;
+        return 0;
+    }
+    if (node->cont_block == 0)
+    {
+        node->cont_block = alloc_block();
+        if (node->cont_block == -1)
+        {
+            node->cont_block = 0;
+            return -1;
+        }
+    }
+    else if (cow_cont_block(node) == -1)
+    {
+        return -1;
+    }
+    ((int *)blocks_get_block(node->cont_block))[file_bnum - DIRECT_BLOCKS] = bnum;
+    return 0;
+}
+
+//Copy size bytes between (or within) inodes through a block sized buffer
+static int inode_copy_range(inode_t *dst, inode_t *src, off_t src_off, off_t dst_off, size_t size)
+{
+    char buf[BLOCK_SIZE];
+    size_t done = 0;
+    while (done < size)
+    {
+        size_t chunk = size - done < BLOCK_SIZE ? size - done : BLOCK_SIZE;
+        int got = inode_read(src, buf, chunk, src_off + done);
+        if (got <= 0 || inode_write(dst, buf, got, dst_off + done) != got)
+        {
+            break;
+        }
+        done += got;
+    }
+    return done;
+}
+
+int inode_clone_range(inode_t *dst, inode_t *src, off_t src_off, off_t dst_off, size_t size)
+{
+    if (src_off < 0 || dst_off < 0 || src_off > src->size || dst_off > dst->size)
+    {
+        return -1;
+    }
+    if (size == 0 || size > src->size - src_off)
+    { //0 means everything up to the end of the source
+        size = src->size - src_off;
+    }
+    if (dst_off + size > INODE_MAX_SIZE)
+    { //sharing takes no room, so nothing else stops a clone from outgrowing the pointers
+        return -1;
+    }
+    if (dst == src && src_off < dst_off + size && dst_off < src_off + size)
+    { //overlapping ranges of the same file
+        return -1;
+    }
+    if (src_off % BLOCK_SIZE != dst_off % BLOCK_SIZE || compress_enabled(src) || compress_enabled(dst))
+    { //the blocks don't line up or don't hold plain data, nothing can be shared
+        return inode_copy_range(dst, src, src_off, dst_off, size);
+    }
+
+    size_t done = 0;
+    int head = (BLOCK_SIZE - dst_off % BLOCK_SIZE) % BLOCK_SIZE;
+    if (head > size)
+    {
+        head = size;
+    }
+    if (head > 0 && inode_copy_range(dst, src, src_off, dst_off, head) != head)
+    {
+        return -1;
+    }
+    done += head;
+
+    int shared = 0;
+    while (done < size)
+    {
+        off_t at = dst_off + done;
+        size_t left = size - done;
+        //a partial last block can be shared too if it ends both files
+        int whole = left >= BLOCK_SIZE ||
+                    (src_off + size == src->size && at + left >= dst->size);
+        int bnum = inode_get_bnum(src, (src_off + done) / BLOCK_SIZE);
+        if (!whole || get_block_info(bnum)->extra_refs == UINT8_MAX)
+        {
+            int copied = inode_copy_range(dst, src, src_off + done, at, left < BLOCK_SIZE ? left : BLOCK_SIZE);
+            if (copied <= 0)
+                break;
+            done += copied;
+            continue;
+        }
+
+        int file_bnum = at / BLOCK_SIZE;
+        int old = at < dst->size ? inode_get_bnum(dst, file_bnum) : 0;
+        if (inode_set_bnum(dst, file_bnum, bnum) == -1)
+        {
+            break;
+        }
+        block_ref(bnum);
+        if (old > 0)
+        {
+            free_block(old);
+        }
+        size_t chunk = left < BLOCK_SIZE ? left : BLOCK_SIZE;
+        if (at + chunk > dst->size)
+        {
+            dst->size = at + chunk;
+        }
+        done += chunk;
+        shared++;
+    }
+    printf("clone_range(%ld bytes @+%ld -> @+%ld) -> %ld bytes, %d blocks shared\n",
+           size, src_off, dst_off, done, shared);
+    return done;
 }
 
 // The node to write to, the data, the size of the data, the offset into the node to start writing
-int inode_write(inode_t *node, const void *buf, size_t size, off_t offset)
+ssize_t inode_write(inode_t *node, const void *buf, size_t size, off_t offset)
 {
     assert(offset <= node->size);
-    int end_size = size + offset;
+    long read_errors = blocks_read_errors();
+    int compressed = compress_enabled(node) && size > 0;
+    int first_cluster = offset / CLUSTER_SIZE;
+    int last_cluster = (offset + size - 1) / CLUSTER_SIZE;
+    for (int c = first_cluster; compressed && c <= last_cluster; c++)
+    { //written clusters are plain while the write lands, and compressed again after
+        int rv = cluster_inflate(node, c);
+        if (rv != 0)
+        { //nothing written, which the caller takes for out of space
+            return rv == -EIO ? rv : 0;
+        }
+    }
+    int64_t end_size = size + offset;
     if (end_size > node->size)
     { //if the number of blocks is the same grow_inode will do nothing
-        printf("growing node to size %d\n", end_size);
-        grow_inode(node, end_size);
+        printf("growing node to size %ld\n", end_size);
+        int64_t grown = grow_inode(node, end_size);
+        if (grown < end_size)
+        { //out of space, only write what fits
+            size = grown > offset ? grown - offset : 0;
+        }
     }
     int position = offset % BLOCK_SIZE;    //position to start writing from
     int remaining = BLOCK_SIZE - position; //the amount of data that goes in the current block
@@ -164,9 +471,13 @@ int inode_write(inode_t *node, const void *buf, size_t size, off_t offset)
     {
         printf("copying %d bytes from position %d to position %d in block %d\n",
                remaining, index, position + index, block);
-        int bnum = inode_get_bnum(node, 0);
+        int bnum = inode_cow_bnum(node, block);
+        if (bnum == -1)
+        { //no space left to copy a shared block into
+            break;
+        }
         printf("writing to block num %d at %p\n", bnum, blocks_get_block(bnum));
-        memcpy(blocks_get_block(inode_get_bnum(node, block)) + position + index, buf + index, remaining);
+        memcpy(blocks_get_block(bnum) + position, buf + index, remaining);
         index += remaining; //increment by the amount written
         block++;            //go to the next block
         position = 0;
@@ -179,16 +490,37 @@ int inode_write(inode_t *node, const void *buf, size_t size, off_t offset)
             remaining = size - index;
         }
     }
-    node->size = index; //redundent on success
+    if (offset + index > node->size)
+    { //grow_inode already covers this on success, never shrink on a write inside the file
+        node->size = offset + index;
+    }
+    for (int c = first_cluster; compressed && c <= last_cluster; c++)
+    {
+        cluster_compress(node, c);
+    }
+    if (blocks_read_errors() != read_errors)
+    { //a block written in part couldn't be read, the change to it was never kept
+        return -EIO;
+    }
+    if (dedup_inline())
+    {
+        dedup_range(node, offset, index);
+    }
     return index;
 }
 
+#define PREFETCH_BLOCKS 64
+
 // The node to read from, where to put the data, the amount of the data, the offset into the node to start reading
-int inode_read(inode_t *node, void *buf, size_t size, off_t offset)
+ssize_t inode_read(inode_t *node, void *buf, size_t size, off_t offset)
 {
+    if (offset >= node->size)
+    {
+        return 0;
+    }
     if (offset + size > node->size)
     {
-        printf("Tried to read %ld bytes from a node with %d stored (offset by %ld)\n", size, node->size, offset);
+        printf("Tried to read %ld bytes from a node with %ld stored (offset by %ld)\n", size, node->size, offset);
         size = node->size - offset;
     }
 
@@ -199,10 +531,33 @@ int inode_read(inode_t *node, void *buf, size_t size, off_t offset)
     }
     int index = 0;
     int block = offset / BLOCK_SIZE;
+    int compressed = compress_enabled(node);
+    long read_errors = blocks_read_errors();
+    int wanted[PREFETCH_BLOCKS];
+    int count = 0;
+    for (int b = block; b < bytes_to_blocks(offset + size) && count < PREFETCH_BLOCKS; b++)
+    { //let the backend read every block of a large read in one go
+        wanted[count++] = inode_get_bnum(node, b);
+    }
+    blocks_prefetch(wanted, count);
     while (index < size)
     {
         printf("copying over %d bytes from the %dth block of the given inode to the given buffer\n", remaining, block);
-        memcpy(buf + index, blocks_get_block(inode_get_bnum(node, block)), remaining);
+        const void *data;
+        if (compressed && cluster_is_compressed(node, block / CLUSTER_BLOCKS))
+        {
+            data = cluster_data(node, block / CLUSTER_BLOCKS);
+            if (data == 0)
+            {
+                return -EIO;
+            }
+            data += block % CLUSTER_BLOCKS * BLOCK_SIZE;
+        }
+        else
+        {
+            data = blocks_read_block(inode_get_bnum(node, block));
+        }
+        memcpy(buf + index, data + (offset + index) % BLOCK_SIZE, remaining);
         index += remaining;
         block++;
         if (BLOCK_SIZE < size - index)
@@ -214,5 +569,9 @@ int inode_read(inode_t *node, void *buf, size_t size, off_t offset)
             remaining = size - index;
         }
     }
+    if (blocks_read_errors() != read_errors)
+    { //some of what was copied is zeros standing in for a block the backend couldn't read
+        return -EIO;
+    }
     return index;
 }
\ No newline at end of file
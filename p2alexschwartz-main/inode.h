@@ -9,34 +9,90 @@
 
 #include "blocks.h"
 
+#define INODE_SIZE_SHIFT 6 // inodes are 64 bytes, one cache line
+#define INODE_SIZE (1 << INODE_SIZE_SHIFT)
+#define INODES_PER_BLOCK_SHIFT (NUFS_BLOCK_SHIFT - INODE_SIZE_SHIFT) // BLOCK_SIZE / INODE_SIZE
+#define INODES_PER_BLOCK (1 << INODES_PER_BLOCK_SHIFT)
+#define INODE_COUNT (INODES_PER_BLOCK * INODE_TABLE_BLOCKS) // slots in the table, the bitmap hands out BLOCK_COUNT
+
+// Version 2 of the on-disk inode (see NUFS_VERSION), what a lookup and a
+// read need first are at the front of the line
 typedef struct inode
 {
-  int refs;                  // reference count
-  int mode;                  // permission & type
-  int size;                  // bytes
-  int blocks[DIRECT_BLOCKS]; // single block pointer (if max file size <= 4K)
-  int cont_block;
+  int32_t mode;                  // type, and the INODE_ flags above it
+  int32_t refs;                  // reference count
+  int64_t size;                  // bytes
+  int32_t blocks[DIRECT_BLOCKS]; // the first blocks of the file
+  int32_t cont_block;            // a block of pointers to the rest
+  uint32_t _reserved;
+  int64_t atime; // nanoseconds since the epoch, changes may wait in memory (see lazytime.h)
+  int64_t mtime;
+  int64_t ctime;
 } inode_t;
 
+_Static_assert(sizeof(inode_t) == INODE_SIZE, "an inode is one cache line");
+_Static_assert(INODES_PER_BLOCK * INODE_SIZE == GEOMETRY_BLOCK_SIZE, "the inode table packs whole blocks");
+_Static_assert(INODE_COUNT >= GEOMETRY_BLOCK_COUNT, "an inode for every inode bitmap bit");
+
+// Per inode flags kept in the high bits of mode, clear of S_IFMT and the permissions
+#define INODE_COMPRESSED 0x01000000 // file data is stored in compressed clusters, directories pass it on to new entries
+#define INODE_FLAGS 0xff000000
+
+// The most a file can hold, its direct blocks and a cont_block full of pointers
+#define INODE_MAX_SIZE ((int64_t)(DIRECT_BLOCKS + BLOCK_SIZE / (int)sizeof(int32_t)) * BLOCK_SIZE)
+
 void print_inode(inode_t *node);
 inode_t *get_inode(int inum);
+// Get an inode from the given copy of the inode table (INODE_TABLE_BLOCKS block numbers)
+inode_t *get_inode_in(const int *table, int inum);
+// Use the given copy of the inode table, e.g. a snapshot's (INODE_TABLE_BLOCKS block numbers)
+void inode_set_table(const int *blocks);
+// Whether inum lies whole in its inode table block, the rest are never handed out
+int inode_fits(int inum);
+// Allocate an inode, in the calling CPU's allocation group if there is room
 int alloc_inode();
+// Allocate an inode in the same group as inum if there is room, e.g. next to its directory
+int alloc_inode_near(int inum);
+// Mark inum as in use, for the root directory
+void claim_inode(int inum);
 void free_inode(int inum);
 
-// Grow the inode's references to the point that it could contain size (rounded up to the nearest block)
-int grow_inode(inode_t *node, int size);
+// Grow the inode's references to the point that it could contain size (rounded up to the nearest block).
+// Returns size, or how much the blocks it did get hold if it ran out of room (the size is left alone)
+int64_t grow_inode(inode_t *node, int64_t size);
+
+// Shrink the inode's references to the point that it could contain size (rounded up to the nearest block).
+// Returns the new size, or the old one if a compressed cluster it cuts short couldn't be inflated (no room, or corrupt)
+int64_t shrink_inode(inode_t *node, int64_t size);
 
-// Shrink the inode's references to the point that it could contain size (rounded up to the nearest block)
-int shrink_inode(inode_t *node, int size);
+// Number of runs of consecutive blocks the node's data is stored in
+int inode_extents(inode_t *node);
+
+// Find the first run of consecutive blocks at or after file_bnum that are all shared or all not.
+// Returns the file block it starts at, and sets bnum to its first block and length to its
+// length in blocks, or returns -1 past the end of the data
+int inode_next_extent(inode_t *node, int file_bnum, int *bnum, int *length, int *shared);
 
 // Returns the real block number pointed to by the given node's file_bnum th pointer
 int inode_get_bnum(inode_t *node, int file_bnum);
 
+// Point the node's file_bnum th pointer at bnum (without touching the block it pointed at).
+// Returns 0, or -1 if there is no room for the cont_block or file_bnum is past INODE_MAX_SIZE
+int inode_set_bnum(inode_t *node, int file_bnum, int bnum);
+
+// Returns a block number for writing the file_bnum th block in place, copying the block first if it is shared
+int inode_cow_bnum(inode_t *node, int file_bnum);
+
+// Make size bytes of dst starting at dst_off the same as src starting at src_off (size 0 clones to the end of src).
+// Whole blocks are shared copy-on-write, only unaligned edges are copied. Returns the bytes cloned (fewer
+// if it ran out of room), or -1 for a negative offset, one past the end, or a range ending past INODE_MAX_SIZE
+int inode_clone_range(inode_t *dst, inode_t *src, off_t src_off, off_t dst_off, size_t size);
+
 // The node to write to, the data, the size of the data, the offset into the node to start writing
-int inode_write(inode_t *node, const void *buf, size_t size, off_t offset);
+ssize_t inode_write(inode_t *node, const void *buf, size_t size, off_t offset);
 
 // The node to read from, where to put the data, the amount of the data, the offset into the node to start reading
 
-int inode_read(inode_t *node, void *buf, size_t size, off_t offset);
+ssize_t inode_read(inode_t *node, void *buf, size_t size, off_t offset);
 
 #endif
@@ -0,0 +1,140 @@
+#include "lazytime.h"
+#include "inode.h"
+#include "bitmap.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static int64_t pending[INODE_COUNT][3]; //atime, mtime, ctime for the bits set in dirty
+static uint8_t dirty[INODE_COUNT];
+static int64_t since[INODE_COUNT]; //when the oldest waiting change was made
+static int dirty_count = 0;
+static int64_t oldest = INT64_MAX; //no later than the oldest since of a dirty inode
+static lazytime_stats_t stats;
+
+int64_t lazytime_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+//Put the waiting changes in the inode, unless it was freed since
+static void write_back(int inum)
+{
+    if (dirty[inum] == 0)
+    {
+        return;
+    }
+    if (bitmap_get(get_inode_bitmap(), inum))
+    {
+        inode_t *node = get_inode(inum);
+        node->atime = dirty[inum] & TIME_ATIME ? pending[inum][0] : node->atime;
+        node->mtime = dirty[inum] & TIME_MTIME ? pending[inum][1] : node->mtime;
+        node->ctime = dirty[inum] & TIME_CTIME ? pending[inum][2] : node->ctime;
+    }
+    dirty[inum] = 0;
+    dirty_count--;
+}
+
+void inode_touch(int inum, int which)
+{
+    int64_t now = lazytime_now();
+    if (dirty[inum] == 0)
+    {
+        since[inum] = now;
+        dirty_count++;
+        oldest = now < oldest ? now : oldest;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        pending[inum][i] = which & (1 << i) ? now : pending[inum][i];
+    }
+    dirty[inum] |= which;
+    stats.touched++;
+    if (now - since[inum] >= LAZYTIME_EXPIRE * 1000000000L)
+    {
+        write_back(inum);
+        stats.flushed++;
+    }
+}
+
+void inode_stamp(int inum, int which)
+{
+    write_back(inum);
+    int64_t now = lazytime_now();
+    inode_t *node = get_inode(inum);
+    node->atime = which & TIME_ATIME ? now : node->atime;
+    node->mtime = which & TIME_MTIME ? now : node->mtime;
+    node->ctime = which & TIME_CTIME ? now : node->ctime;
+    stats.stamped++;
+}
+
+void inode_set_times(int inum, int64_t atime, int64_t mtime)
+{
+    inode_stamp(inum, TIME_CTIME);
+    get_inode(inum)->atime = atime;
+    get_inode(inum)->mtime = mtime;
+}
+
+void inode_get_times(int inum, int64_t times[3])
+{
+    inode_t *node = get_inode(inum);
+    times[0] = dirty[inum] & TIME_ATIME ? pending[inum][0] : node->atime;
+    times[1] = dirty[inum] & TIME_MTIME ? pending[inum][1] : node->mtime;
+    times[2] = dirty[inum] & TIME_CTIME ? pending[inum][2] : node->ctime;
+}
+
+void lazytime_flush(int inum)
+{
+    if (dirty[inum] != 0)
+    {
+        write_back(inum);
+        stats.flushed++;
+    }
+}
+
+void lazytime_expire()
+{
+    int64_t now = lazytime_now();
+    if (dirty_count == 0 || now - oldest < LAZYTIME_EXPIRE * 1000000000L)
+    { //nothing waiting has been waiting long enough
+        return;
+    }
+    oldest = INT64_MAX;
+    for (int inum = 0; inum < INODE_COUNT; inum++)
+    {
+        if (dirty[inum] != 0 && now - since[inum] >= LAZYTIME_EXPIRE * 1000000000L)
+        {
+            lazytime_flush(inum);
+        }
+        else if (dirty[inum] != 0 && since[inum] < oldest)
+        {
+            oldest = since[inum];
+        }
+    }
+}
+
+void lazytime_flush_all()
+{
+    int count = dirty_count;
+    for (int inum = 0; inum < INODE_COUNT && dirty_count > 0; inum++)
+    {
+        lazytime_flush(inum);
+    }
+    printf("lazytime_flush_all() -> %d inodes\n", count);
+}
+
+void lazytime_forget()
+{
+    memset(dirty, 0, sizeof(dirty));
+    dirty_count = 0;
+    oldest = INT64_MAX;
+}
+
+lazytime_stats_t *lazytime_get_stats()
+{
+    return &stats;
+}
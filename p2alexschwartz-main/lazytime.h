@@ -0,0 +1,61 @@
+// Inode timestamps, kept in memory until something else writes the inode.
+//
+// Every read would otherwise change atime, and every write that doesn't
+// grow the file mtime, dirtying an inode table block each time for a few
+// bytes nobody may look at. Like Linux's lazytime, inode_touch only records
+// the new times in memory. They go into the inode with the next change
+// that writes it anyway (inode_stamp, for a new size, a new entry or
+// utimens), on fsync of the file, and at unmount. Once LAZYTIME_EXPIRE
+// seconds have passed since the first change waiting they are also written
+// at the end of the next request of any kind (lazytime_expire), so a mount
+// that sees no requests at all keeps them until it is unmounted. stat sees
+// them either way. A crash loses at most the times waiting in memory.
+#ifndef LAZYTIME_H
+#define LAZYTIME_H
+
+#include <stdint.h>
+
+#define LAZYTIME_EXPIRE 60 // seconds a change may wait in memory
+
+#define TIME_ATIME 1
+#define TIME_MTIME 2
+#define TIME_CTIME 4
+#define TIME_ALL (TIME_ATIME | TIME_MTIME | TIME_CTIME)
+
+typedef struct lazytime_stats
+{
+    long touched;  // changes kept in memory
+    long stamped;  // changes written to the inode with the rest of it
+    long flushed;  // inodes whose waiting changes were written on their own
+} lazytime_stats_t;
+
+// Nanoseconds since the epoch
+int64_t lazytime_now();
+
+// Set which of inum's times to now, in memory
+void inode_touch(int inum, int which);
+
+// Set which of inum's times to now in the inode, with any that were waiting
+void inode_stamp(int inum, int which);
+
+// Set inum's atime and mtime in the inode (utimens), changing ctime to now
+void inode_set_times(int inum, int64_t atime, int64_t mtime);
+
+// inum's atime, mtime and ctime, counting changes still in memory
+void inode_get_times(int inum, int64_t times[3]);
+
+// Write inum's waiting changes to the inode
+void lazytime_flush(int inum);
+
+// Write the changes that have waited LAZYTIME_EXPIRE seconds, called as a request ends
+void lazytime_expire();
+
+// Write every waiting change to the inode table
+void lazytime_flush_all();
+
+// Drop every waiting change, for a new image
+void lazytime_forget();
+
+lazytime_stats_t *lazytime_get_stats();
+
+#endif
@@ -0,0 +1,183 @@
+/**
+ * @file lz.c
+ *
+ * LZ77 codec. Every sequence is a token byte (literal count in the high
+ * nibble, match length - 4 in the low one, 15 meaning more length bytes
+ * follow), the literals, then a 2 byte little endian match offset. The
+ * last sequence has literals only.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define MIN_MATCH 4
+#define HASH_BITS 12
+#define LAST_LITERALS 5 // the tail is always sent as literals
+
+static uint32_t read32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static int hash4(const uint8_t *p)
+{
+  return (read32(p) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Write a length that didn't fit in its nibble, returns the new output position or 0 if out of room
+static uint8_t *put_length(uint8_t *out, uint8_t *end, int len)
+{
+  while (len >= 255)
+  {
+    if (out >= end)
+      return 0;
+    *out++ = 255;
+    len -= 255;
+  }
+  if (out >= end)
+    return 0;
+  *out++ = (uint8_t)len;
+  return out;
+}
+
+static uint8_t *put_sequence(uint8_t *out, uint8_t *end, const uint8_t *lit, int nlit, int offset, int mlen)
+{
+  if (out >= end)
+    return 0;
+  uint8_t *token = out++;
+  *token = (nlit >= 15 ? 15 : nlit) << 4;
+  if (nlit >= 15 && (out = put_length(out, end, nlit - 15)) == 0)
+    return 0;
+  if (end - out < nlit)
+    return 0;
+  memcpy(out, lit, nlit);
+  out += nlit;
+  if (mlen == 0)
+  { // the last sequence
+    return out;
+  }
+  if (end - out < 2)
+    return 0;
+  *out++ = offset & 0xff;
+  *out++ = offset >> 8;
+  mlen -= MIN_MATCH;
+  *token |= mlen >= 15 ? 15 : mlen;
+  if (mlen >= 15 && (out = put_length(out, end, mlen - 15)) == 0)
+    return 0;
+  return out;
+}
+
+int lz_compress(const void *src, int size, void *dst, int cap)
+{
+  const uint8_t *in = (const uint8_t *)src;
+  uint8_t *out = (uint8_t *)dst;
+  uint8_t *end = out + cap;
+  uint32_t table[1 << HASH_BITS]; // positions, a cluster can be past 64K even if an offset can't
+  memset(table, 0, sizeof(table));
+
+  int anchor = 0; // start of the pending literals
+  int pos = 1;
+  while (pos + MIN_MATCH + LAST_LITERALS <= size)
+  {
+    int h = hash4(in + pos);
+    int ref = table[h];
+    table[h] = pos;
+    if (pos - ref > 0xffff || read32(in + ref) != read32(in + pos))
+    {
+      pos++;
+      continue;
+    }
+    int mlen = MIN_MATCH;
+    while (pos + mlen < size - LAST_LITERALS && in[ref + mlen] == in[pos + mlen])
+    {
+      mlen++;
+    }
+    out = put_sequence(out, end, in + anchor, pos - anchor, pos - ref, mlen);
+    if (out == 0)
+      return -1;
+    pos += mlen;
+    anchor = pos;
+  }
+  out = put_sequence(out, end, in + anchor, size - anchor, 0, 0);
+  if (out == 0)
+    return -1;
+  return out - (uint8_t *)dst;
+}
+
+// Read a length that didn't fit in its nibble, -1 if the input ends first
+static int get_length(const uint8_t **in, const uint8_t *end)
+{
+  int len = 0;
+  uint8_t b;
+  do
+  {
+    if (*in >= end)
+      return -1;
+    b = *(*in)++;
+    len += b;
+  } while (b == 255);
+  return len;
+}
+
+int lz_decompress(const void *src, int size, void *dst, int cap)
+{
+  const uint8_t *in = (const uint8_t *)src;
+  const uint8_t *in_end = in + size;
+  uint8_t *out = (uint8_t *)dst;
+  uint8_t *out_end = out + cap;
+
+  while (in < in_end)
+  {
+    uint8_t token = *in++;
+    int nlit = token >> 4;
+    if (nlit == 15)
+    {
+      int more = get_length(&in, in_end);
+      if (more < 0)
+        return -1;
+      nlit += more;
+    }
+    if (in_end - in < nlit || out_end - out < nlit)
+      return -1;
+    memcpy(out, in, nlit);
+    in += nlit;
+    out += nlit;
+    if (in == in_end)
+    { // the last sequence has no match
+      break;
+    }
+
+    if (in_end - in < 2)
+      return -1;
+    int offset = in[0] | (in[1] << 8);
+    in += 2;
+    int mlen = token & 15;
+    if (mlen == 15)
+    {
+      int more = get_length(&in, in_end);
+      if (more < 0)
+        return -1;
+      mlen += more;
+    }
+    mlen += MIN_MATCH;
+    if (offset == 0 || offset > out - (uint8_t *)dst || out_end - out < mlen)
+      return -1;
+    const uint8_t *ref = out - offset;
+    if (offset >= mlen)
+    {
+      memcpy(out, ref, mlen);
+    }
+    else
+    {
+      for (int i = 0; i < mlen; i++)
+      { // byte by byte, the match overlaps what it produces
+        out[i] = ref[i];
+      }
+    }
+    out += mlen;
+  }
+  return out - (uint8_t *)dst;
+}
@@ -0,0 +1,36 @@
+/**
+ * @file lz.h
+ *
+ * A small LZ77 codec in the style of the LZ4 block format: runs of
+ * literals followed by (offset, length) back references, no entropy
+ * coding. Fast enough to sit inside inode_write.
+ */
+#ifndef LZ_H
+#define LZ_H
+
+/**
+ * Compress a buffer.
+ *
+ * @param src Data to compress. Matches are only found within the 64K
+ *            before a position, as offsets are 2 bytes.
+ * @param size Number of bytes in src.
+ * @param dst Where to put the compressed data.
+ * @param cap Room available in dst.
+ *
+ * @return The compressed size, or -1 if it doesn't fit in cap.
+ */
+int lz_compress(const void *src, int size, void *dst, int cap);
+
+/**
+ * Decompress a buffer produced by lz_compress.
+ *
+ * @param src Compressed data.
+ * @param size Number of compressed bytes.
+ * @param dst Where to put the original data.
+ * @param cap Room available in dst.
+ *
+ * @return The decompressed size, or -1 if the input is corrupt.
+ */
+int lz_decompress(const void *src, int size, void *dst, int cap);
+
+#endif
@@ -0,0 +1,240 @@
+#define _GNU_SOURCE
+#include "mkfs.h"
+#include "directory.h"
+#include "group.h"
+#include "storage.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//A host file with more than one name, and the inode its first name was copied to
+typedef struct host_link
+{
+    dev_t dev;
+    ino_t ino;
+    int inum;
+} host_link_t;
+
+typedef struct build
+{
+    mkfs_stats_t *stats;
+    host_link_t *links; //at most one per inode
+    int nlinks;
+    int group;            //where the last run went, the next one is looked for from there
+    char path[PATH_MAX]; //the host directory being copied, for messages
+} build_t;
+
+static int not_dots(const struct dirent *entry)
+{
+    return strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0;
+}
+
+static int64_t nanoseconds(struct timespec ts)
+{
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+//Take the free block best fit finds for one block, a hole left between runs if there is one
+static int alloc_single(build_t *b)
+{
+    int length;
+    int bnum = blocks_find_run(1, b->group, &length);
+    return bnum == -1 ? -1 : alloc_block_at(bnum);
+}
+
+//Read the host file into as few runs of free blocks as there is room for
+static int copy_data(int fd, inode_t *node, off_t size, build_t *b)
+{
+    if (size > INT_MAX)
+    {
+        return -EFBIG;
+    }
+    int nblocks = bytes_to_blocks(size);
+    if (nblocks > DIRECT_BLOCKS)
+    { //the pointer block is placed first so it doesn't split the data
+        node->cont_block = alloc_single(b);
+        if (node->cont_block == -1)
+        {
+            node->cont_block = 0;
+            return -ENOSPC;
+        }
+    }
+    int done = 0;
+    while (done < nblocks)
+    {
+        int length;
+        int start = blocks_find_run(nblocks - done, b->group, &length);
+        if (start == -1)
+        {
+            return -ENOSPC;
+        }
+        for (int i = 0; i < length; i++, done++)
+        {
+            int bnum = alloc_block_at(start + i);
+            if (bnum == -1 || inode_set_bnum(node, done, bnum) == -1)
+            {
+                return -ENOSPC;
+            }
+            char *block = blocks_get_block(bnum);
+            ssize_t got = pread(fd, block, BLOCK_SIZE, (off_t)done * BLOCK_SIZE);
+            if (got < 0)
+            {
+                return -errno;
+            }
+            memset(block + got, 0, BLOCK_SIZE - got);
+        }
+        //what is written so far is the file, should the next run not fit
+        node->size = done * BLOCK_SIZE < size ? done * BLOCK_SIZE : size;
+        b->group = group_of(start + length - 1);
+        b->stats->extents++;
+        b->stats->blocks += length;
+    }
+    node->size = size;
+    return 0;
+}
+
+static int build_dir(int dir_fd, int inum, build_t *b);
+
+//Copy one host entry into the directory parent, filling in its entry.
+//Returns 0, 1 if it was skipped, or a negative errno
+static int build_entry(int dir_fd, int parent, const char *name, dirent_t *entry, build_t *b)
+{
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+    {
+        return -errno;
+    }
+    const char *why = strlen(name) > DIR_NAME_LENGTH                  ? "name too long"
+                      : !S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode) ? "not a file or directory"
+                                                                       : 0;
+    if (why)
+    {
+        fprintf(stderr, "mkfs: skipping %s/%s: %s\n", b->path, name, why);
+        b->stats->skipped++;
+        return 1;
+    }
+    strcpy(entry->name, name);
+    entry->mode = st.st_mode & (S_IFMT | 07777);
+
+    if (S_ISREG(st.st_mode) && st.st_nlink > 1)
+    {
+        for (int i = 0; i < b->nlinks; i++)
+        {
+            if (b->links[i].dev == st.st_dev && b->links[i].ino == st.st_ino)
+            { //another name for a file already copied
+                entry->inum = b->links[i].inum;
+                get_inode(entry->inum)->refs++;
+                b->stats->links++;
+                return 0;
+            }
+        }
+    }
+
+    int inum = alloc_inode_near(parent);
+    if (inum == -1)
+    {
+        return -ENOSPC;
+    }
+    entry->inum = inum;
+    inode_t *node = get_inode(inum);
+    node->mode = st.st_mode & S_IFMT;
+    node->size = 0;
+    node->atime = nanoseconds(st.st_atim);
+    node->mtime = nanoseconds(st.st_mtim);
+    node->ctime = nanoseconds(st.st_ctim);
+
+    int fd = openat(dir_fd, name, O_RDONLY | (S_ISDIR(st.st_mode) ? O_DIRECTORY : 0));
+    if (fd == -1)
+    {
+        return -errno;
+    }
+    int rv;
+    if (S_ISDIR(st.st_mode))
+    {
+        size_t length = strlen(b->path);
+        snprintf(b->path + length, sizeof(b->path) - length, "/%s", name);
+        rv = build_dir(fd, inum, b);
+        b->path[length] = '\0';
+        b->stats->dirs++;
+    }
+    else
+    {
+        rv = copy_data(fd, node, st.st_size, b);
+        b->stats->files++;
+        if (st.st_nlink > 1)
+        {
+            b->links[b->nlinks++] = (host_link_t){st.st_dev, st.st_ino, inum};
+        }
+    }
+    close(fd);
+    return rv;
+}
+
+//Copy everything in the open host directory, depth first, then build directory inum out of it
+static int build_dir(int dir_fd, int inum, build_t *b)
+{
+    struct dirent **names;
+    int count = scandirat(dir_fd, ".", &names, not_dots, alphasort);
+    if (count < 0)
+    {
+        return -errno;
+    }
+    dirent_t *entries = calloc(count + 1, sizeof(dirent_t));
+    int used = 0;
+    int rv = entries == 0 ? -ENOMEM : 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (rv == 0)
+        {
+            rv = build_entry(dir_fd, inum, names[i]->d_name, &entries[used], b);
+            //what was copied of an entry that didn't fit is kept, so the image stays consistent
+            used += rv == 0 || (rv < 0 && entries[used].inum != ROOT_INUM);
+            rv = rv == 1 ? 0 : rv;
+        }
+        free(names[i]);
+    }
+    free(names);
+    if (directory_build(get_inode(inum), entries, used) != 0 && rv == 0)
+    {
+        rv = -ENOSPC;
+    }
+    free(entries);
+    return rv;
+}
+
+static int any_entry(dirent_t *entry, void *arg)
+{
+    return 1;
+}
+
+int mkfs_populate(const char *dir, mkfs_stats_t *stats)
+{
+    memset(stats, 0, sizeof(mkfs_stats_t));
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+    {
+        return -errno;
+    }
+    build_t *b = calloc(1, sizeof(build_t));
+    b->stats = stats;
+    b->links = calloc(BLOCK_COUNT, sizeof(host_link_t));
+    snprintf(b->path, sizeof(b->path), "%s", dir);
+
+    storage_lock();
+    int rv = directory_foreach(get_inode(ROOT_INUM), any_entry, 0) ? -ENOTEMPTY : build_dir(fd, ROOT_INUM, b);
+    storage_unlock();
+
+    close(fd);
+    free(b->links);
+    free(b);
+    printf("mkfs_populate(%s) -> %d, %ld files and %ld directories in %ld blocks, %ld extents\n", dir, rv,
+           stats->files, stats->dirs, stats->blocks, stats->extents);
+    return rv;
+}
@@ -0,0 +1,27 @@
+// Building images offline, without going through a mount.
+//
+// mkfs_populate copies a host directory tree into a freshly formatted
+// image in one pass: each directory's entries are read (sorted by name, so
+// the same tree always makes the same image), the files are written
+// straight into runs of blocks found through the free extent index, and
+// then the directory's blocks are built whole with directory_build. Hard
+// links within the tree stay hard links. Anything but regular files and
+// directories, and names longer than DIR_NAME_LENGTH, are skipped.
+#ifndef MKFS_H
+#define MKFS_H
+
+typedef struct mkfs_stats
+{
+    long files;   // regular files copied
+    long dirs;    // directories made, not counting the root
+    long links;   // entries that are another name for a file already copied
+    long blocks;  // data blocks written
+    long extents; // runs of blocks the files were written to
+    long skipped; // entries that couldn't be copied
+} mkfs_stats_t;
+
+// Copy the tree under dir into the root directory of the open image, which must be empty.
+// Returns 0, or a negative errno (-ENOSPC when it doesn't fit)
+int mkfs_populate(const char *dir, mkfs_stats_t *stats);
+
+#endif
@@ -2,6 +2,21 @@
 #include "storage.h"
 #include "directory.h"
 #include "bitmap.h"
+#include "arena.h"
+#include "snapshot.h"
+#include "nufs_ioctl.h"
+#include "dedup.h"
+#include "compress.h"
+#include "readahead.h"
+#include "backend.h"
+#include "window.h"
+#include "group.h"
+#include "defrag.h"
+#include "golden.h"
+#include "orphan.h"
+#include "writebuf.h"
+#include "batch.h"
+#include "lazytime.h"
 
 #include <assert.h>
 #include <bsd/string.h>
@@ -9,13 +24,27 @@
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
+#include <fuse_opt.h>
+// Holds the storage lock for the whole callback, and gives back
+// scratch memory taken from the arena when the callback returns
+#define REQUEST_SCOPE                                                         \
+  int request_guard __attribute__((cleanup(storage_leave))) = storage_enter(); \
+  arena_mark_t request_mark __attribute__((cleanup(arena_release))) = arena_mark()
+#define CHECK_WRITABLE     \
+  if (storage_readonly()) \
+  {                       \
+    return -EROFS;        \
+  }
 #define CHECK_ENTRY \
   if (entry == 0)   \
   {                 \
@@ -23,14 +52,36 @@
     return -1;      \
   }
 
+// What nufs keeps for every open file, fi->fh points at it
+typedef struct open_file
+{
+  int inum;
+  readahead_t ra;
+  writebuf_t wb;
+} open_file_t;
+
 // mode_t DIRECTORY_MODE = 040755;
 mode_t FILE_MODE = 0100644;
 mode_t FILE_MASK = 0100000;
 
+// Fill in the times of inum, including the ones still waiting in memory
+static void fill_times(int inum, struct stat *st)
+{
+  int64_t times[3];
+  inode_get_times(inum, times);
+  st->st_atim.tv_sec = times[0] / 1000000000L;
+  st->st_atim.tv_nsec = times[0] % 1000000000L;
+  st->st_mtim.tv_sec = times[1] / 1000000000L;
+  st->st_mtim.tv_nsec = times[1] % 1000000000L;
+  st->st_ctim.tv_sec = times[2] / 1000000000L;
+  st->st_ctim.tv_nsec = times[2] % 1000000000L;
+}
+
 // implementation for: man 2 access
 // Checks if a file exists.
 int nufs_access(const char *path, int mask)
 {
+  REQUEST_SCOPE;
   dirent_t *entry = directory_path_lookup(path);
   int rv;
   if (mask == F_OK)
@@ -51,12 +102,14 @@ int nufs_access(const char *path, int mask)
 // This is a crucial function.
 int nufs_getattr(const char *path, struct stat *st)
 {
+  REQUEST_SCOPE;
   printf("getting the attributes of %s\n", path);
   if (strcmp(path, ".") == 0)
   { //a bit of default case
     st->st_mode = FILE_MODE;
     st->st_size = get_inode(((dirent_t *)get_root_entry())->inum)->size;
     st->st_uid = getuid();
+    fill_times(((dirent_t *)get_root_entry())->inum, st);
     return 0;
   }
 
@@ -69,52 +122,56 @@ int nufs_getattr(const char *path, struct stat *st)
   inode_t *node = get_inode(entry->inum);
 
   st->st_mode = entry->mode;
-  st->st_size = node->size;
+  st->st_size = writebuf_size(entry->inum, node->size);
   st->st_uid = getuid();
+  fill_times(entry->inum, st);
 
   printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, 0, st->st_mode,
          st->st_size);
   return 0;
 }
 
+typedef struct readdir_state
+{
+  void *buf;
+  fuse_fill_dir_t filler;
+} readdir_state_t;
+
+static int readdir_fill(dirent_t *entry, void *arg)
+{
+  readdir_state_t *state = (readdir_state_t *)arg;
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  st.st_mode = entry->mode;
+  st.st_size = writebuf_size(entry->inum, get_inode(entry->inum)->size);
+  st.st_uid = getuid();
+  fill_times(entry->inum, &st);
+  state->filler(state->buf, entry->name, &st, 0);
+  return 0;
+}
+
 // implementation for: man 2 readdir
 // lists the contents of a directory
 int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi)
 {
+  REQUEST_SCOPE;
   printf("listing directory contents of %s\n", path);
   struct stat st;
   int rv;
 
-  filler(buf, ".", &st, 0);
-
   rv = nufs_getattr("/", &st);
   assert(rv == 0);
+  filler(buf, ".", &st, 0);
 
-  slist_t *files = directory_list(path);
-  if (files != 0)
-  { //if there are any files
-    slist_t *node = files;
-    char *full_name;
-    while (node != 0)
-    {
-      full_name = (char *)malloc(strlen(path) + strlen(node->data) + 2); // \0 and /
-      strcpy(full_name, path);
-      if (strcmp(path, ROOT_NAME) != 0)
-      {
-        strcat(full_name, "/");
-      }
-      strcat(full_name, node->data);
-      printf("full_name = %s\n", full_name);
-
-      rv = nufs_getattr(full_name, &st);
-      assert(rv == 0);
-      filler(buf, node->data, &st, 0);
-      node = node->next;
-      free(full_name);
-    }
-    slist_free(files);
+  dirent_t *entry = directory_path_lookup(path);
+  if (entry == 0)
+  {
+    return -ENOENT;
   }
+  // entries are filled straight from the directory blocks, no per-entry path walk
+  readdir_state_t state = {buf, filler};
+  directory_foreach(get_inode(entry->inum), readdir_fill, &state);
 
   printf("readdir(%s) -> %d\n", path, rv);
   return rv;
@@ -126,22 +183,25 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 // function.
 int nufs_mknod(const char *path, mode_t mode, dev_t rdev)
 {
+  REQUEST_SCOPE;
+  CHECK_WRITABLE
   printf("Given mode = %d, given rdev = %ld\n", mode, rdev);
-  char *location = (char *)malloc(strlen(path) + 1);
-  copy_folder(path, location, strlen(path));
-
-  dirent_t *folder = directory_path_lookup(location);
-  free(location);
-  char name[DIR_NAME_LENGTH];
-  copy_file(path, name, strlen(path));
+  char *name = (char *)arena_alloc(strlen(path) + 1);
+  int folder = batch_parent(path, name);
+  if (folder == -1)
+  {
+    return -ENOENT;
+  }
 
-  int inum = alloc_inode();
+  int inum = alloc_inode_near(folder);
   if (inum == -1)
   {
     errno = EDQUOT;
     return -1;
   }
   printf("alloced node sucesffuly\n");
+  //new entries take the type from mode and compression from the directory they are made in
+  get_inode(inum)->mode = (mode & S_IFMT) | (get_inode(folder)->mode & INODE_COMPRESSED);
 
   if (rdev == FILE_MASK) //just passed from mkdir
   {
@@ -149,7 +209,9 @@ int nufs_mknod(const char *path, mode_t mode, dev_t rdev)
     directory_const(get_inode(inum));
   }
 
-  directory_put(get_inode(folder->inum), name, inum, mode); //pre directory this is just ROOT_NODE, name, node
+  batch_put(folder, name, inum, mode); //pre directory this is just ROOT_NODE, name, node
+  inode_stamp(inum, TIME_ALL);
+  inode_touch(folder, TIME_MTIME | TIME_CTIME);
   printf("put successful\n");
   int rv = 0;
   printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
@@ -160,6 +222,7 @@ int nufs_mknod(const char *path, mode_t mode, dev_t rdev)
 // another system call; see section 2 of the manual
 int nufs_mkdir(const char *path, mode_t mode)
 {
+  REQUEST_SCOPE;
   int rv = nufs_mknod(path, mode | 040000, FILE_MASK);
   printf("mkdir(%s) -> %d\n", path, rv);
   return rv;
@@ -167,18 +230,23 @@ int nufs_mkdir(const char *path, mode_t mode)
 
 int nufs_unlink(const char *path)
 {
-  dirent_t *entry = directory_path_lookup(path);
-  CHECK_ENTRY
-  free_inode(entry->inum);
-
-  char *source = (char *)malloc(strlen(path) + 1);
-  copy_folder(path, source, strlen(path));
-  entry = directory_path_lookup(source);
-  free(source);
-  CHECK_ENTRY
-  char file[DIR_NAME_LENGTH];
-  copy_file(path, file, strlen(path));
-  directory_delete(get_inode(entry->inum), file);
+  REQUEST_SCOPE;
+  CHECK_WRITABLE
+  char *file = (char *)arena_alloc(strlen(path) + 1);
+  int folder = batch_parent(path, file);
+  int inum = folder == -1 ? -1 : batch_delete(folder, file);
+  if (inum == -1)
+  {
+    errno = ENOENT;
+    return -1;
+  }
+  inode_touch(folder, TIME_MTIME | TIME_CTIME);
+  if (get_inode(inum)->refs > 1)
+  {
+    writebuf_flush_inode(inum, 0);
+    inode_stamp(inum, TIME_CTIME);
+  }
+  orphan_free_inode(inum); //open handles keep using the inode until they are released
 
   int rv = 0;
   printf("unlink(%s) -> %d\n", path, rv);
@@ -187,39 +255,49 @@ int nufs_unlink(const char *path)
 
 int nufs_link(const char *from, const char *to)
 {
-  char *source = (char *)malloc(strlen(from) + 1);
-  copy_folder(from, source, strlen(from));
-  dirent_t *entry = directory_path_lookup(source);
-  free(source);
+  REQUEST_SCOPE;
+  CHECK_WRITABLE
+  dirent_t *entry = directory_path_lookup(from);
   CHECK_ENTRY
-  dirent_t *prev_entry = entry;
+  int inum = entry->inum;
+  mode_t mode = entry->mode;
 
-  char *dest = (char *)malloc(strlen(to) + 1);
+  char *dest = (char *)arena_alloc(strlen(to) + 1);
   copy_folder(to, dest, strlen(to));
   entry = directory_path_lookup(dest);
-  free(dest);
   CHECK_ENTRY
 
-  free_inode(prev_entry->inum);
-  prev_entry->inum = entry->inum;
-  get_inode(entry->inum)->refs++;
-
-  int rv = 0;
+  copy_file(to, dest, strlen(to));
+  int rv = directory_put(get_inode(entry->inum), dest, inum, mode);
+  if (rv == 0)
+  {
+    get_inode(inum)->refs++;
+    inode_stamp(inum, TIME_CTIME);
+    inode_touch(entry->inum, TIME_MTIME | TIME_CTIME);
+  }
+  else
+  {
+    rv = -ENOSPC;
+  }
   printf("link(%s => %s) -> %d\n", from, to, rv);
   return rv;
 }
 
 int nufs_rmdir(const char *path)
 {
+  REQUEST_SCOPE;
+  CHECK_WRITABLE
+  batch_end(); //the directory a path names may change
   dirent_t *entry = directory_path_lookup(path);
   CHECK_ENTRY
-  inode_t *node = get_inode(entry->inum);
-  int size = node->size;
+  int inum = entry->inum;
+  inode_t *node = get_inode(inum);
+  int64_t size = node->size;
 
   for (int i = 0; i < size / BLOCK_SIZE; ++i)
   {
-    header_t *header = (header_t *)blocks_get_block(inode_get_bnum(node, i));
-    for (int j = 1; j < DIR_PER_BLOCK; j++)
+    header_t *header = (header_t *)blocks_read_block(inode_get_bnum(node, i));
+    for (int j = DIR_HEADER_SLOTS; j < DIR_PER_BLOCK; j++)
     {
       if (bitmap_get(header->bm, j) == 1)
       {
@@ -230,12 +308,13 @@ int nufs_rmdir(const char *path)
     }
   }
 
-  char *folder = (char *)malloc(strlen(path) + 1);
+  char *folder = (char *)arena_alloc(strlen(path) + 1);
   copy_folder(path, folder, strlen(path));
   dirent_t *super_folder = directory_path_lookup(folder);
   copy_file(path, folder, strlen(path));
   directory_delete(get_inode(super_folder->inum), folder);
-  free(folder);
+  inode_touch(super_folder->inum, TIME_MTIME | TIME_CTIME);
+  orphan_free_inode(inum); //its blocks and inode, like the last unlink of a file
 
   int rv = 0;
   printf("rmdir(%s) -> %d\n", path, rv);
@@ -246,44 +325,54 @@ int nufs_rmdir(const char *path)
 // called to move a file within the same filesystem
 int nufs_rename(const char *from, const char *to)
 {
+  REQUEST_SCOPE;
+  CHECK_WRITABLE
+  batch_end(); //the directory a path names may change
+  dirent_t *moved = directory_path_lookup(from);
+  if (moved == 0)
+  {
+    errno = ENOENT;
+    return -1;
+  }
+
   printf("getting source location ");
-  char *source = (char *)malloc(strlen(source) + 1);
+  char *source = (char *)arena_alloc(strlen(from) + 1);
   copy_folder(from, source, strlen(from));
   printf("%s\n", source);
   dirent_t *entry = directory_path_lookup(source);
   if (entry == 0)
   {
-    free(source);
     errno = ENOENT;
     return -1;
   }
   dirent_t *prev_entry = entry;
 
   printf("getting destination location");
-  char *dest = (char *)malloc(strlen(to) + 1);
+  char *dest = (char *)arena_alloc(strlen(to) + 1);
   copy_folder(to, dest, strlen(to));
   printf("%s\n", dest);
   entry = directory_path_lookup(dest);
   if (entry == 0)
   {
-    free(source);
-    free(dest);
     errno = ENOENT;
     return -1;
   }
   int rv;
+  int inum = moved->inum; // the entry itself goes away once it is deleted from the source
+  mode_t mode = moved->mode;
   copy_file(to, dest, strlen(to));
   printf("new file name %s\n", dest);
-  rv = directory_put(get_inode(entry->inum), dest, prev_entry->inum, prev_entry->mode);
+  rv = directory_put(get_inode(entry->inum), dest, inum, mode);
   printf("if 0 == %d succesfully put a new dirent_t in the new location\n", rv);
   if (rv == 0)
   {
     copy_file(from, source, strlen(from));
     rv = directory_delete(get_inode(prev_entry->inum), source);
     printf("if 0 == %d succesfully removed if from its old location", rv);
+    inode_touch(prev_entry->inum, TIME_MTIME | TIME_CTIME);
+    inode_touch(entry->inum, TIME_MTIME | TIME_CTIME);
+    inode_touch(inum, TIME_CTIME);
   } //else could delete the duplicate
-  free(source);
-  free(dest);
 
   rv = 0;
   printf("rename(%s => %s) -> %d\n", from, to, rv);
@@ -292,25 +381,48 @@ int nufs_rename(const char *from, const char *to)
 
 int nufs_chmod(const char *path, mode_t mode)
 {
-  dirent_t *entry = directory_path_lookup(path);
+  REQUEST_SCOPE;
+  CHECK_WRITABLE
+  dirent_t *entry = directory_path_lookup_rw(path);
+  int rv = -ENOENT;
   if (entry)
+  {
     entry->mode = mode;
-  int rv = -1;
+    inode_touch(entry->inum, TIME_CTIME);
+    rv = 0;
+  }
   printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
   return rv;
 }
 
 int nufs_truncate(const char *path, off_t size)
 {
+  REQUEST_SCOPE;
+  CHECK_WRITABLE
   dirent_t *entry = directory_path_lookup(path);
   CHECK_ENTRY
   int inum = entry->inum;
   inode_t *node = get_inode(inum);
-  int initial = node->size;
-  shrink_inode(node, size);
-  grow_inode(node, size);
-
+  writebuf_flush_inode(inum, 0);
   int rv = 0;
+  int64_t grown;
+  if (orphan_truncate(inum, size) > size)
+  { //a compressed cluster cut short had no room to be inflated
+    rv = -ENOSPC;
+  }
+  else if ((grown = grow_inode(node, size)) < size)
+  { //the size is left alone, give back the blocks it did get past the last one it had
+    int64_t had = node->size;
+    node->size = grown;
+    shrink_inode(node, (int64_t)bytes_to_blocks(had) * BLOCK_SIZE);
+    node->size = had;
+    rv = -ENOSPC;
+  }
+  else
+  {
+    inode_stamp(inum, TIME_MTIME | TIME_CTIME);
+  }
+
   printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
   return rv;
 }
@@ -321,22 +433,96 @@ int nufs_truncate(const char *path, off_t size)
 // You can just check whether the file is accessible.
 int nufs_open(const char *path, struct fuse_file_info *fi)
 {
+  REQUEST_SCOPE;
+  if ((fi->flags & O_ACCMODE) != O_RDONLY)
+  {
+    CHECK_WRITABLE
+  }
   dirent_t *entry = directory_path_lookup(path);
   CHECK_ENTRY
   int inum = entry->inum;
   int rv = inum == -1 ? 1 : 0;
+  open_file_t *file = (open_file_t *)malloc(sizeof(open_file_t));
+  if (file == 0)
+  {
+    return -ENOMEM;
+  }
+  file->inum = inum;
+  readahead_init(&file->ra);
+  if (storage_golden())
+  { //nothing is written, and the list of buffers would need the lock golden skips
+    file->wb.inum = -1;
+  }
+  else
+  {
+    writebuf_open(&file->wb, inum);
+  }
+  fi->fh = (uint64_t)file;
   printf("open(%s) -> %d\n", path, rv);
   return rv;
 }
 
+int nufs_release(const char *path, struct fuse_file_info *fi)
+{
+  REQUEST_SCOPE;
+  open_file_t *file = (open_file_t *)fi->fh;
+  int rv = 0;
+  if (file != 0 && !storage_golden())
+  {
+    rv = writebuf_close(&file->wb);
+  }
+  if (file != 0 && !storage_readonly() && file->wb.inum != -1)
+  { //the file is done growing through this handle, and goes with it if it was unlinked
+    window_release(get_inode(file->inum));
+    orphan_release(file->inum);
+  }
+  free(file);
+  fi->fh = 0;
+  printf("release(%s) -> %d\n", path, rv);
+  return rv;
+}
+
+// Called on every close of a handle, the last chance to report a write that failed
+int nufs_flush(const char *path, struct fuse_file_info *fi)
+{
+  REQUEST_SCOPE;
+  int rv = fi->fh != 0 ? writebuf_flush(&((open_file_t *)fi->fh)->wb) : 0;
+  printf("flush(%s) -> %d\n", path, rv);
+  return rv;
+}
+
 // Actually read data
 int nufs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi)
 {
-  dirent_t *entry = directory_path_lookup(path);
-  CHECK_ENTRY
-  int inum = entry->inum;
+  REQUEST_SCOPE;
+  int inum;
+  if (fi != 0 && fi->fh != 0)
+  { //the handle knows its inode, which outlives an unlink
+    inum = ((open_file_t *)fi->fh)->inum;
+  }
+  else
+  {
+    dirent_t *entry = directory_path_lookup(path);
+    CHECK_ENTRY
+    inum = entry->inum;
+  }
+  if (storage_golden())
+  { // no lock, so the kernel's readahead of the mapped image stands in for the handle's
+    int rv = golden_read(get_inode(inum), buf, size, offset);
+    printf("reading(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+    return rv;
+  }
+  writebuf_flush_inode(inum, 0);
+  if (fi != 0 && fi->fh != 0)
+  {
+    readahead_access(&((open_file_t *)fi->fh)->ra, get_inode(inum), offset, size);
+  }
   int rv = inode_read(get_inode(inum), buf, size, offset);
+  if (!storage_readonly())
+  { //a snapshot's inodes aren't written
+    inode_touch(inum, TIME_ATIME);
+  }
   printf("reading(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
   return rv;
 }
@@ -345,33 +531,297 @@ int nufs_read(const char *path, char *buf, size_t size, off_t offset,
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi)
 {
+  REQUEST_SCOPE;
+  CHECK_WRITABLE
+  if (fi != 0 && fi->fh != 0 && ((open_file_t *)fi->fh)->wb.inum != -1)
+  { //the handle knows its inode, no lookup needed
+    int rv = writebuf_write(&((open_file_t *)fi->fh)->wb, buf, size, offset);
+    inode_touch(((open_file_t *)fi->fh)->inum, TIME_MTIME | TIME_CTIME);
+    printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+    return rv;
+  }
   dirent_t *entry = directory_path_lookup(path);
   CHECK_ENTRY
   int inum = entry->inum;
+  writebuf_flush_inode(inum, 0);
+  int64_t initial = get_inode(inum)->size;
   int rv = inode_write(get_inode(inum), buf, size, offset);
+  if (get_inode(inum)->size != initial)
+  { //the inode is written anyway
+    inode_stamp(inum, TIME_MTIME | TIME_CTIME);
+  }
+  else
+  {
+    inode_touch(inum, TIME_MTIME | TIME_CTIME);
+  }
 
   printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
   return rv;
 }
 
+// The time utimens asks for in nanoseconds, or the one the file has for UTIME_OMIT
+static int64_t utimens_time(const struct timespec *ts, int64_t current)
+{
+  if (ts == 0 || ts->tv_nsec == UTIME_NOW)
+  {
+    return lazytime_now();
+  }
+  return ts->tv_nsec == UTIME_OMIT ? current : ts->tv_sec * 1000000000L + ts->tv_nsec;
+}
+
 // Update the timestamps on a file or directory.
 int nufs_utimens(const char *path, const struct timespec ts[2])
 {
-  int rv = -1;
+  REQUEST_SCOPE;
+  CHECK_WRITABLE
+  dirent_t *entry = directory_path_lookup(path);
+  if (entry == 0)
+  {
+    return -ENOENT;
+  }
+  int64_t times[3];
+  inode_get_times(entry->inum, times);
+  inode_set_times(entry->inum, utimens_time(ts ? &ts[0] : 0, times[0]), utimens_time(ts ? &ts[1] : 0, times[1]));
+  int rv = 0;
+  if (ts == 0)
+  {
+    printf("utimens(%s, now) -> %d\n", path, rv);
+    return rv;
+  }
   printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n", path, ts[0].tv_sec,
          ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
   return rv;
 }
 
+// Report the free space for df. The counters are kept up to date by the
+// allocators, so this adds up a few numbers and doesn't take the storage lock.
+int nufs_statfs(const char *path, struct statvfs *st)
+{
+  int free_blocks, free_inodes;
+  groups_total(&free_blocks, &free_inodes);
+  memset(st, 0, sizeof(struct statvfs));
+  st->f_bsize = BLOCK_SIZE;
+  st->f_frsize = BLOCK_SIZE;
+  st->f_blocks = BLOCK_COUNT;
+  st->f_bfree = free_blocks;
+  st->f_bavail = free_blocks;
+  st->f_files = groups_usable_inodes();
+  st->f_ffree = free_inodes;
+  st->f_favail = free_inodes;
+  st->f_namemax = DIR_NAME_LENGTH;
+  st->f_flag = storage_readonly() ? ST_RDONLY : 0;
+  printf("statfs(%s) -> %d free blocks, %d free inodes\n", path, free_blocks, free_inodes);
+  return 0;
+}
+
 // Extended operations
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                unsigned int flags, void *data)
 {
-  int rv = -1;
+  REQUEST_SCOPE;
+  writebuf_flush_all(); //everything below looks at blocks, not at what handles are holding
+  int rv;
+  switch ((unsigned int)cmd)
+  {
+  case NUFS_IOC_SNAP_CREATE:
+  case NUFS_IOC_SNAP_DELETE:
+  {
+    CHECK_WRITABLE
+    nufs_snapshot_arg_t *snap = (nufs_snapshot_arg_t *)data;
+    snap->name[NUFS_SNAPSHOT_NAME - 1] = '\0';
+    if (cmd == NUFS_IOC_SNAP_CREATE)
+    { //the snapshot gets the times as they are now
+      lazytime_flush_all();
+    }
+    rv = cmd == NUFS_IOC_SNAP_CREATE ? snapshot_create(snap->name) : snapshot_delete(snap->name);
+    break;
+  }
+  case NUFS_IOC_SNAP_LIST:
+  {
+    nufs_snapshot_list_t *list = (nufs_snapshot_list_t *)data;
+    superblock_t *sb = get_superblock();
+    memset(list, 0, sizeof(nufs_snapshot_list_t));
+    for (int i = 0; i < MAX_SNAPSHOTS; i++)
+    {
+      if (sb->snapshots[i].name[0] != '\0')
+      {
+        strcpy(list->names[list->count++], sb->snapshots[i].name);
+      }
+    }
+    rv = 0;
+    break;
+  }
+  case NUFS_IOC_CLONE_RANGE:
+  {
+    CHECK_WRITABLE
+    nufs_clone_arg_t *clone = (nufs_clone_arg_t *)data;
+    clone->src[NUFS_PATH_MAX - 1] = '\0';
+    dirent_t *src = directory_path_lookup(clone->src);
+    dirent_t *dst = directory_path_lookup(path);
+    if (src == 0 || dst == 0)
+    {
+      rv = -ENOENT;
+    }
+    else if (S_ISDIR(src->mode) || S_ISDIR(dst->mode))
+    {
+      rv = -EISDIR;
+    }
+    else
+    {
+      inode_t *from = get_inode(src->inum);
+      // what a whole clone covers, taken before the range lands in case src is dst
+      uint64_t wanted = clone->src_offset < from->size ? from->size - clone->src_offset : 0;
+      if (clone->length != 0 && clone->length < wanted)
+      {
+        wanted = clone->length;
+      }
+      int done = inode_clone_range(get_inode(dst->inum), from, clone->src_offset,
+                                   clone->dst_offset, clone->length);
+      rv = done < 0 ? -EINVAL : (uint64_t)done < wanted ? -ENOSPC : 0;
+    }
+    break;
+  }
+  case NUFS_IOC_GETFLAGS:
+  {
+    dirent_t *entry = directory_path_lookup(path);
+    if (entry == 0)
+    {
+      rv = -ENOENT;
+      break;
+    }
+    *(uint32_t *)data = get_inode(entry->inum)->mode & INODE_COMPRESSED ? NUFS_FL_COMPRESS : 0;
+    rv = 0;
+    break;
+  }
+  case NUFS_IOC_SETFLAGS:
+  {
+    CHECK_WRITABLE
+    uint32_t wanted = *(uint32_t *)data;
+    dirent_t *entry = directory_path_lookup(path);
+    if (entry == 0)
+    {
+      rv = -ENOENT;
+      break;
+    }
+    if (wanted & ~NUFS_FL_COMPRESS)
+    {
+      rv = -EOPNOTSUPP;
+      break;
+    }
+    inode_t *node = get_inode(entry->inum);
+    //inodes from before the type was kept in them learn it here
+    node->mode = (node->mode & ~S_IFMT) | (entry->mode & S_IFMT);
+    rv = compress_set(node, (wanted & NUFS_FL_COMPRESS) != 0);
+    break;
+  }
+  case NUFS_IOC_DEFRAG:
+  case NUFS_IOC_DEFRAG_STATUS:
+  {
+    if ((unsigned int)cmd == NUFS_IOC_DEFRAG)
+    {
+      CHECK_WRITABLE
+      defrag_request();
+    }
+    defrag_stats_t *stats = defrag_get_stats();
+    nufs_defrag_arg_t *report = (nufs_defrag_arg_t *)data;
+    report->running = stats->running;
+    report->passes = stats->passes;
+    report->moved = stats->moved;
+    report->files = stats->files;
+    report->extents_before = stats->extents_before;
+    report->extents_after = stats->extents_after;
+    report->fragmented_before = stats->fragmented_before;
+    report->fragmented_after = stats->fragmented_after;
+    rv = 0;
+    break;
+  }
+  case NUFS_IOC_FIEMAP:
+  {
+    nufs_fiemap_t *map = (nufs_fiemap_t *)data;
+    dirent_t *entry = directory_path_lookup(path);
+    if (entry == 0)
+    {
+      rv = -ENOENT;
+      break;
+    }
+    inode_t *node = get_inode(entry->inum);
+    map->mapped = 0;
+    if (map->start >= (uint64_t)node->size)
+    { //nothing there to map
+      rv = 0;
+      break;
+    }
+    // the range is cut at the end of the file, so it can't wrap around
+    uint64_t end = map->length == 0 || map->length > node->size - map->start ? node->size
+                                                                              : map->start + map->length;
+    uint32_t flags = node->mode & INODE_COMPRESSED ? NUFS_FIEMAP_ENCODED : 0;
+    int file_bnum = map->start / BLOCK_SIZE;
+    int bnum, length, shared;
+    // extents that overlap the range are returned whole
+    while (map->mapped < NUFS_FIEMAP_EXTENTS &&
+           (file_bnum = inode_next_extent(node, file_bnum, &bnum, &length, &shared)) != -1 &&
+           (uint64_t)file_bnum * BLOCK_SIZE < end)
+    {
+      nufs_fiemap_extent_t *extent = &map->extents[map->mapped++];
+      extent->logical = (uint64_t)file_bnum * BLOCK_SIZE;
+      extent->physical = (uint64_t)bnum * BLOCK_SIZE;
+      extent->length = (uint64_t)length * BLOCK_SIZE;
+      extent->flags = flags | (shared ? NUFS_FIEMAP_SHARED : 0);
+      extent->_reserved = 0;
+      file_bnum += length;
+    }
+    if (map->mapped > 0 &&
+        (file_bnum == -1 || inode_next_extent(node, file_bnum, &bnum, &length, &shared) == -1))
+    {
+      map->extents[map->mapped - 1].flags |= NUFS_FIEMAP_LAST;
+    }
+    rv = 0;
+    break;
+  }
+  default:
+    rv = -ENOTTY;
+  }
   printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
   return rv;
 }
 
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+  int rv = 0;
+  if (fi != 0 && fi->fh != 0)
+  {
+    storage_lock();
+    rv = writebuf_flush(&((open_file_t *)fi->fh)->wb);
+    lazytime_flush(((open_file_t *)fi->fh)->inum);
+    storage_unlock();
+  }
+  rv = storage_flush() == 0 ? rv : -EIO;
+  printf("fsync(%s) -> %d\n", path, rv);
+  return rv;
+}
+
+// Background work can only start once FUSE is done daemonizing
+void *nufs_init(struct fuse_conn_info *conn)
+{
+  snapshot_start_reclaimer();
+  defrag_start();
+  orphan_start();
+  return NULL;
+}
+
+void nufs_destroy(void *private_data)
+{
+  orphan_stop();
+  defrag_stop();
+  snapshot_stop_reclaimer();
+  storage_lock();
+  writebuf_flush_all();
+  lazytime_flush_all();
+  batch_end();
+  storage_unlock();
+  storage_flush();
+}
+
 void nufs_init_ops(struct fuse_operations *ops)
 {
   memset(ops, 0, sizeof(struct fuse_operations));
@@ -388,20 +838,109 @@ void nufs_init_ops(struct fuse_operations *ops)
   ops->chmod = nufs_chmod;
   ops->truncate = nufs_truncate;
   ops->open = nufs_open;
+  ops->release = nufs_release;
+  ops->flush = nufs_flush;
+  ops->fsync = nufs_fsync;
   ops->read = nufs_read;
   ops->write = nufs_write;
   ops->utimens = nufs_utimens;
+  ops->statfs = nufs_statfs;
   ops->ioctl = nufs_ioctl;
+  ops->init = nufs_init;
+  ops->destroy = nufs_destroy;
 };
 
 struct fuse_operations nufs_ops;
 
+typedef struct nufs_config
+{
+  char *snapshot; // -o snapshot=NAME serves that snapshot read only
+  int dedup;      // -o dedup shares identical blocks as they are written
+  int populate;   // -o populate faults the whole image in at mount
+  int mlock;      // -o mlock keeps block 0 and the inode table resident
+  int hugepages;  // -o hugepages asks for transparent huge pages
+  char *madvise;  // -o madvise=PROFILE, see map_profile
+  char *backend;  // -o backend=NAME, see backend.h
+  int cache;      // -o cache=BLOCKS for the pread, direct and uring backends
+  int queue;      // -o queue=DEPTH for the uring backends
+  int window;     // -o window=BLOCKS reserved for each growing file, 0 turns it off
+  int defrag;     // -o defrag_budget=USEC the defragmenter may hold the filesystem at once
+  int golden;     // -o golden serves an immutable image read only, without locking
+} nufs_config_t;
+
+static struct fuse_opt nufs_opts[] = {
+    {"snapshot=%s", offsetof(nufs_config_t, snapshot), 0},
+    {"dedup", offsetof(nufs_config_t, dedup), 1},
+    {"populate", offsetof(nufs_config_t, populate), 1},
+    {"mlock", offsetof(nufs_config_t, mlock), 1},
+    {"hugepages", offsetof(nufs_config_t, hugepages), 1},
+    {"madvise=%s", offsetof(nufs_config_t, madvise), 0},
+    {"backend=%s", offsetof(nufs_config_t, backend), 0},
+    {"cache=%d", offsetof(nufs_config_t, cache), 0},
+    {"queue=%d", offsetof(nufs_config_t, queue), 0},
+    {"window=%d", offsetof(nufs_config_t, window), 0},
+    {"defrag_budget=%d", offsetof(nufs_config_t, defrag), 0},
+    {"golden", offsetof(nufs_config_t, golden), 1},
+    FUSE_OPT_END};
+
 int main(int argc, char *argv[])
 {
-  assert(argc > 2 && argc < 6);
-  storage_init(argv[--argc]);
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  nufs_config_t config = {.window = DEFAULT_WINDOW_BLOCKS};
+  int rv = fuse_opt_parse(&args, &config, nufs_opts, NULL);
+  assert(rv == 0);
+
+  assert(args.argc > 2 && args.argc < 6);
+  map_policy_t policy = {config.populate, config.mlock, config.hugepages, MADV_NORMAL, MADV_NORMAL};
+  if (config.madvise && map_profile(config.madvise, &policy) != 0)
+  {
+    fprintf(stderr, "unknown madvise profile %s\n", config.madvise);
+    return 1;
+  }
+  blocks_set_policy(&policy);
+  if (config.backend &&
+      blocks_set_backend(config.backend, config.cache ? config.cache : DEFAULT_CACHE_BLOCKS) != 0)
+  {
+    fprintf(stderr, "unknown backend %s\n", config.backend);
+    return 1;
+  }
+  backend_set_queue_depth(config.queue ? config.queue : DEFAULT_QUEUE_DEPTH);
+  window_set_size(config.window);
+  defrag_set_budget(config.defrag);
+  if (config.golden && (config.dedup || (config.backend && strcmp(config.backend, "mmap") != 0)))
+  {
+    fprintf(stderr, "-o golden maps the image, it can't dedup or use another backend\n");
+    return 1;
+  }
+  if (config.snapshot && config.dedup)
+  {
+    fprintf(stderr, "-o snapshot serves the snapshot read only, it can't dedup\n");
+    return 1;
+  }
+  if (!config.golden)
+  {
+    storage_init(args.argv[--args.argc]);
+  }
+  else if ((rv = storage_init_golden(args.argv[--args.argc])) != 0)
+  {
+    fprintf(stderr, "%s: %s\n", args.argv[args.argc], strerror(-rv));
+    return 1;
+  }
+  if (config.snapshot && storage_use_snapshot(config.snapshot) != 0)
+  {
+    return 1;
+  }
+  if (config.golden)
+  { // of the snapshot, if one is served; the kernel turns writes away before they get here
+    golden_build();
+    fuse_opt_add_arg(&args, "-oro");
+  }
+  if (config.dedup)
+  { // blocks already in the image are found as candidates too
+    dedup_set_inline(1);
+    dedup_scan();
+  }
   nufs_init_ops(&nufs_ops);
 
-  assert(sizeof(dirent_t) == sizeof(header_t));
-  return fuse_main(argc, argv, &nufs_ops, NULL);
+  return fuse_main(args.argc, args.argv, &nufs_ops, NULL);
 }
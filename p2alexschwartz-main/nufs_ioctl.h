@@ -0,0 +1,104 @@
+// ioctl interface of a mounted nufs filesystem.
+//
+// Shared between the filesystem and the command line tools. Every command
+// is issued on an open file descriptor of any file or directory in the
+// mount.
+#ifndef NUFS_IOCTL_H
+#define NUFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#include "geometry.h"
+
+#define NUFS_IOC_MAGIC 'N'
+#define NUFS_SNAPSHOT_NAME 24 // SNAPSHOT_NAME_LENGTH + 1
+#define NUFS_MAX_SNAPSHOTS 8  // MAX_SNAPSHOTS
+#define NUFS_PATH_MAX 1024
+#define NUFS_BLOCK_SIZE GEOMETRY_BLOCK_SIZE // BLOCK_SIZE, the tools are built with the same PROFILE
+
+typedef struct nufs_snapshot_arg
+{
+  char name[NUFS_SNAPSHOT_NAME];
+} nufs_snapshot_arg_t;
+
+typedef struct nufs_snapshot_list
+{
+  int count;
+  char names[NUFS_MAX_SNAPSHOTS][NUFS_SNAPSHOT_NAME];
+} nufs_snapshot_list_t;
+
+typedef struct nufs_clone_arg
+{
+  char src[NUFS_PATH_MAX]; // source file, as a path from the root of the mount
+  uint64_t src_offset;
+  uint64_t dst_offset;
+  uint64_t length; // 0 clones to the end of the source
+} nufs_clone_arg_t;
+
+typedef struct nufs_defrag_arg
+{
+  uint32_t running;           // a pass is under way
+  uint32_t passes;            // passes finished since mount
+  uint64_t moved;             // blocks relocated by the last finished pass
+  uint64_t files;             // files it relocated blocks of
+  uint64_t extents_before;    // data extents of all files before and after it
+  uint64_t extents_after;
+  uint64_t fragmented_before; // files in more than one extent before and after it
+  uint64_t fragmented_after;
+} nufs_defrag_arg_t;
+
+#define NUFS_FIEMAP_EXTENTS 128 // extents returned per call
+
+// flags of a mapped extent, as in FIEMAP
+#define NUFS_FIEMAP_LAST 0x1      // the last extent of the file (FIEMAP_EXTENT_LAST)
+#define NUFS_FIEMAP_ENCODED 0x8   // compressed clusters (FIEMAP_EXTENT_ENCODED)
+#define NUFS_FIEMAP_SHARED 0x2000 // shared with a clone, a duplicate or a snapshot (FIEMAP_EXTENT_SHARED)
+
+typedef struct nufs_fiemap_extent
+{
+  uint64_t logical;  // byte offset in the file
+  uint64_t physical; // byte offset in the image
+  uint64_t length;   // bytes
+  uint32_t flags;    // NUFS_FIEMAP_ flags
+  uint32_t _reserved;
+} nufs_fiemap_extent_t;
+
+typedef struct nufs_fiemap
+{
+  uint64_t start;  // in: first byte of the file to map
+  uint64_t length; // in: bytes to map from there, 0 for the rest of the file
+  uint32_t mapped; // out: extents filled in, call again from past the last one for more
+  uint32_t _reserved;
+  nufs_fiemap_extent_t extents[NUFS_FIEMAP_EXTENTS];
+} nufs_fiemap_t;
+
+// take a snapshot of the whole filesystem under the given name
+#define NUFS_IOC_SNAP_CREATE _IOW(NUFS_IOC_MAGIC, 1, nufs_snapshot_arg_t)
+// delete the named snapshot, its blocks are given back in the background
+#define NUFS_IOC_SNAP_DELETE _IOW(NUFS_IOC_MAGIC, 2, nufs_snapshot_arg_t)
+// list the names of all snapshots
+#define NUFS_IOC_SNAP_LIST _IOR(NUFS_IOC_MAGIC, 3, nufs_snapshot_list_t)
+// make a range of the file the same as a range of another file in the mount,
+// sharing whole blocks copy-on-write instead of copying them
+#define NUFS_IOC_CLONE_RANGE _IOW(NUFS_IOC_MAGIC, 4, nufs_clone_arg_t)
+
+// the data of the file is compressed, on a directory new entries inherit it
+#define NUFS_FL_COMPRESS 0x1
+// get the NUFS_FL_ flags of a file or directory
+#define NUFS_IOC_GETFLAGS _IOR(NUFS_IOC_MAGIC, 5, uint32_t)
+// set the NUFS_FL_ flags of a file or directory, converting existing data
+#define NUFS_IOC_SETFLAGS _IOW(NUFS_IOC_MAGIC, 6, uint32_t)
+
+// start a defragmentation pass in the background (after the one under way,
+// if any) and report on the last finished pass
+#define NUFS_IOC_DEFRAG _IOR(NUFS_IOC_MAGIC, 7, nufs_defrag_arg_t)
+// report on the last finished pass without starting one
+#define NUFS_IOC_DEFRAG_STATUS _IOR(NUFS_IOC_MAGIC, 8, nufs_defrag_arg_t)
+
+// map a range of the file to where its blocks are in the image, as extents of
+// consecutive blocks (FIEMAP semantics, the blocks of a compressed cluster
+// hold less than their logical length)
+#define NUFS_IOC_FIEMAP _IOWR(NUFS_IOC_MAGIC, 9, nufs_fiemap_t)
+
+#endif
@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+#include "orphan.h"
+#include "storage.h"
+#include "bitmap.h"
+#include "compress.h"
+#include "window.h"
+#include "writebuf.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+static pthread_t reclaimer;
+static pthread_cond_t reclaim_wanted = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t reclaim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int reclaim_requested = 0;
+static int reclaimer_running = 0;
+static int reclaimer_stop = 0;
+
+static orphan_stats_t stats;
+
+//A free slot on the list, -1 if it is full
+static int free_slot()
+{
+    int32_t *orphans = get_superblock()->orphans;
+    for (int i = 0; i < MAX_ORPHANS; i++)
+    {
+        if (orphans[i] == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//Put inum in the slot and wake the reclaimer, with the storage lock held
+static void add(int slot, int inum)
+{
+    get_superblock()->orphans[slot] = inum;
+    stats.queued++;
+    pthread_mutex_lock(&reclaim_mutex);
+    reclaim_requested = 1;
+    pthread_cond_signal(&reclaim_wanted);
+    pthread_mutex_unlock(&reclaim_mutex);
+}
+
+void orphan_free_inode(int inum)
+{
+    inode_t *node = get_inode(inum);
+    int slot = free_slot();
+    if (node->refs == 1 && writebuf_is_open(inum))
+    { //on the list in case of a crash, but left alone until orphan_release
+        node->refs = 0;
+        if (slot != -1)
+        {
+            get_superblock()->orphans[slot] = inum; //counted as queued once it is released
+        }
+        printf("orphan_free_inode(%d) -> kept for its open handles\n", inum);
+        return;
+    }
+    if (node->refs > 1 || !reclaimer_running || bytes_to_blocks(node->size) < ORPHAN_MIN_BLOCKS || slot == -1)
+    {
+        free_inode(inum);
+        return;
+    }
+    node->refs = 0;
+    window_release(node);
+    add(slot, inum);
+    printf("orphan_free_inode(%d) -> %d blocks left to the reclaimer\n", inum, bytes_to_blocks(node->size));
+}
+
+//Give back a carrier that didn't get every pointer, the blocks it was handed are still the node's
+static void drop_carrier(int carrier)
+{
+    inode_t *tail = get_inode(carrier);
+    if (tail->cont_block != 0)
+    {
+        free_block(tail->cont_block);
+        tail->cont_block = 0;
+    }
+    memset(tail->blocks, 0, sizeof(tail->blocks));
+    tail->size = 0;
+    free_inode(carrier);
+}
+
+int64_t orphan_truncate(int inum, int64_t size)
+{
+    inode_t *node = get_inode(inum);
+    int keep = bytes_to_blocks(size);
+    int count = bytes_to_blocks(node->size) - keep;
+    int slot = free_slot();
+    if (!reclaimer_running || count < ORPHAN_MIN_BLOCKS || compress_enabled(node) || slot == -1)
+    { //cutting a compressed cluster short rewrites it, that can't wait
+        return shrink_inode(node, size);
+    }
+    int carrier = alloc_inode_near(inum);
+    if (carrier == -1)
+    {
+        return shrink_inode(node, size);
+    }
+    inode_t *tail = get_inode(carrier);
+    tail->mode = node->mode & S_IFMT;
+    tail->size = 0;
+    if (count > DIRECT_BLOCKS)
+    { //taken up front, so moving the pointers can't fail half way
+        tail->cont_block = alloc_block();
+        if (tail->cont_block == -1)
+        {
+            tail->cont_block = 0;
+            drop_carrier(carrier);
+            return shrink_inode(node, size);
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    { //the carrier holds the cut off blocks from its start, like a file of its own
+        if (inode_set_bnum(tail, i, inode_get_bnum(node, keep + i)) == -1)
+        { //nothing of the node has changed yet, so it is cut short in the request instead
+            drop_carrier(carrier);
+            return shrink_inode(node, size);
+        }
+    }
+    //only now that the carrier has its own copy of every pointer does the node let go of its cont_block
+    window_release(node);
+    tail->size = count * BLOCK_SIZE;
+    tail->refs = 0;
+    if (keep <= DIRECT_BLOCKS && node->cont_block != 0)
+    {
+        free_block(node->cont_block);
+        node->cont_block = 0;
+    }
+    node->size = size;
+    add(slot, carrier);
+    printf("orphan_truncate(%d, %ld) -> %d blocks left to the reclaimer in inode %d\n", inum, size, count, carrier);
+    return size;
+}
+
+void orphan_release(int inum)
+{
+    inode_t *node = get_inode(inum);
+    if (node->refs != 0 || writebuf_is_open(inum))
+    { //still linked, or still open through another handle
+        return;
+    }
+    int32_t *orphans = get_superblock()->orphans;
+    int slot = 0;
+    while (slot < MAX_ORPHANS && orphans[slot] != inum)
+    {
+        slot++;
+    }
+    if (slot < MAX_ORPHANS && reclaimer_running)
+    {
+        window_release(node);
+        add(slot, inum);
+        return;
+    }
+    if (slot < MAX_ORPHANS)
+    {
+        orphans[slot] = 0;
+    }
+    node->refs = 1;
+    free_inode(inum);
+}
+
+static int stop_wanted()
+{
+    pthread_mutex_lock(&reclaim_mutex);
+    int stop = reclaimer_stop;
+    pthread_mutex_unlock(&reclaim_mutex);
+    return stop;
+}
+
+//Shrink the first orphan on the list by a batch, freeing it once it is empty.
+//Returns the number of blocks freed, or -1 if the list is empty
+static int reclaim_batch()
+{
+    storage_lock();
+    int32_t *orphans = get_superblock()->orphans;
+    int slot = 0;
+    while (slot < MAX_ORPHANS && (orphans[slot] == 0 || writebuf_is_open(orphans[slot])))
+    { //a file unlinked while open waits for its last handle
+        slot++;
+    }
+    if (slot == MAX_ORPHANS)
+    {
+        storage_unlock();
+        return -1;
+    }
+    int inum = orphans[slot];
+    int freed = 0;
+    //the slot comes off disk, so it is checked before it is used to find an inode
+    //(only the first BLOCK_COUNT inodes have a bitmap bit)
+    if (inum < 0 || inum >= INODE_COUNT || inum >= BLOCK_COUNT || !inode_fits(inum) ||
+        !bitmap_get(get_inode_bitmap(), inum))
+    { //freed before a crash could clear its slot, or garbage
+        orphans[slot] = 0;
+    }
+    else if (get_inode(inum)->size > 0)
+    { //cut at a multiple of the batch, which never splits a compressed cluster
+        inode_t *node = get_inode(inum);
+        int batch = ORPHAN_BATCH * BLOCK_SIZE;
+        int64_t size = (node->size - 1) / batch * batch;
+        freed = bytes_to_blocks(node->size) - bytes_to_blocks(size);
+        shrink_inode(node, size);
+    }
+    else
+    { //the inode goes before its slot, a crash in between leaves a slot naming a free inode
+        get_inode(inum)->refs = 1;
+        free_inode(inum);
+        orphans[slot] = 0;
+        stats.reclaimed++;
+    }
+    stats.blocks += freed;
+    storage_unlock();
+    return freed;
+}
+
+long orphan_reclaim()
+{
+    long freed = 0;
+    int rv;
+    while ((rv = reclaim_batch()) != -1)
+    {
+        freed += rv;
+    }
+    printf("orphan_reclaim() -> %ld blocks\n", freed);
+    return freed;
+}
+
+int orphan_pending()
+{
+    int count = 0;
+    for (int i = 0; i < MAX_ORPHANS; i++)
+    {
+        count += get_superblock()->orphans[i] != 0;
+    }
+    return count;
+}
+
+static void *reclaimer_main(void *arg)
+{
+    pthread_mutex_lock(&reclaim_mutex);
+    while (!reclaimer_stop)
+    {
+        if (!reclaim_requested)
+        {
+            pthread_cond_wait(&reclaim_wanted, &reclaim_mutex);
+            continue;
+        }
+        reclaim_requested = 0;
+        pthread_mutex_unlock(&reclaim_mutex);
+
+        long freed = 0;
+        int rv;
+        while (!stop_wanted() && (rv = reclaim_batch()) != -1)
+        {
+            freed += rv;
+        }
+        printf("orphan reclaimer gave back %ld blocks\n", freed);
+
+        pthread_mutex_lock(&reclaim_mutex);
+    }
+    pthread_mutex_unlock(&reclaim_mutex);
+    return 0;
+}
+
+void orphan_start()
+{
+    if (storage_readonly())
+    {
+        return;
+    }
+    reclaimer_stop = 0;
+    reclaim_requested = orphan_pending() > 0;
+    int rv = pthread_create(&reclaimer, 0, reclaimer_main, 0);
+    assert(rv == 0);
+    reclaimer_running = 1;
+}
+
+void orphan_stop()
+{
+    if (!reclaimer_running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&reclaim_mutex);
+    reclaimer_stop = 1;
+    pthread_cond_signal(&reclaim_wanted);
+    pthread_mutex_unlock(&reclaim_mutex);
+    pthread_join(reclaimer, 0);
+    reclaimer_running = 0;
+}
+
+orphan_stats_t *orphan_get_stats()
+{
+    return &stats;
+}
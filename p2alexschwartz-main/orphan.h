@@ -0,0 +1,57 @@
+// Giving back the blocks of deleted and truncated files in the background.
+//
+// Freeing a block costs a bitmap update, the group counters and the free
+// extent index, so deleting or truncating a large file used to hold the
+// request for as long as all of that took. Instead, unlink leaves the inode
+// allocated with no references and puts it on the orphan list in the
+// superblock. A truncate that cuts off many blocks moves their pointers to
+// a new orphan inode, which costs a pointer copy per block. Either way the
+// request returns right away, and a background thread shrinks the orphans
+// ORPHAN_BATCH blocks at a time, letting the storage lock go in between.
+// The list is on disk, so whatever a crash or unmount cut short is picked
+// up again at the next mount.
+//
+// Small files, compressed files (for truncates), a full list and mounts
+// without the background thread are still freed in the request. A file
+// unlinked while open is kept whole until its last handle is released,
+// and is on the list meanwhile if there is room, for a crash to clean up.
+#ifndef ORPHAN_H
+#define ORPHAN_H
+
+#include "inode.h"
+
+#define ORPHAN_BATCH 16      // blocks given back per hold of the storage lock
+#define ORPHAN_MIN_BLOCKS 16 // fewer blocks than this are freed in the request
+
+typedef struct orphan_stats
+{
+    long queued;    // inodes put on the list
+    long reclaimed; // inodes freed from it
+    long blocks;    // blocks given back by the reclaimer
+} orphan_stats_t;
+
+// Drop a reference to inum like free_inode, leaving the blocks to the reclaimer if it was the last.
+// A file still open keeps everything until orphan_release
+void orphan_free_inode(int inum);
+
+// The last handle to inum is gone, free it (or leave it to the reclaimer) if it was unlinked meanwhile
+void orphan_release(int inum);
+
+// Cut inum down to size like shrink_inode, leaving the blocks past it to the reclaimer. Returns the size
+int64_t orphan_truncate(int inum, int64_t size);
+
+// Give back everything on the list, in batches. Returns the number of blocks freed
+long orphan_reclaim();
+
+// Number of inodes on the list
+int orphan_pending();
+
+// Start the background reclaimer, which first finishes what is on the list from before
+void orphan_start();
+
+// Stop the background reclaimer, what is left stays on the list for the next mount
+void orphan_stop();
+
+orphan_stats_t *orphan_get_stats();
+
+#endif
@@ -0,0 +1,34 @@
+/**
+ * @file path.c
+ *
+ * Non-allocating path walking.
+ */
+#include <string.h>
+
+#include "path.h"
+
+int path_next(const char **cursor, char *buf, int size)
+{
+  const char *text = *cursor;
+  while (*text == '/')
+  {
+    text++;
+  }
+  if (*text == 0)
+  {
+    *cursor = text;
+    return 0;
+  }
+
+  int plen = 0;
+  while (text[plen] != 0 && text[plen] != '/')
+  {
+    plen += 1;
+  }
+
+  int copy = plen < size - 1 ? plen : size - 1;
+  memcpy(buf, text, copy);
+  buf[copy] = 0;
+  *cursor = text + plen;
+  return 1;
+}
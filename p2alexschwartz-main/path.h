@@ -0,0 +1,23 @@
+/**
+ * @file path.h
+ *
+ * Non-allocating helpers for walking slash separated paths.
+ */
+#ifndef PATH_H
+#define PATH_H
+
+/**
+ * Copy the next component of a path into the given buffer.
+ *
+ * Leading and repeated slashes are skipped. Components longer than the
+ * buffer are truncated, the same way directory entries store them.
+ *
+ * @param cursor Position in the path, advanced past the component.
+ * @param buf Where to put the component.
+ * @param size Size of buf, including room for the null character.
+ *
+ * @return 1 if a component was copied, 0 once the path is exhausted.
+ */
+int path_next(const char **cursor, char *buf, int size);
+
+#endif
@@ -0,0 +1,95 @@
+#include "readahead.h"
+
+#include <stdio.h>
+#include <sys/mman.h>
+
+#define RANDOM_AFTER 2 //one seek followed by a stream is still a stream
+#define FETCH_GAP 2    //reading a couple of blocks too many is cheaper than another call
+
+static readahead_stats_t stats;
+
+void readahead_init(readahead_t *ra)
+{
+    ra->next = 0;
+    ra->window = 0;
+    ra->ahead = 0;
+    ra->misses = 0;
+}
+
+//Advise file blocks [from, to) of node, one call per run of blocks that are (nearly) next to each other on disk
+static void advise_range(inode_t *node, int from, int to, int advice, int gap)
+{
+    int start = 0, run = 0;
+    for (int i = from; i <= to; i++)
+    {
+        int bnum = i < to ? inode_get_bnum(node, i) : 0;
+        if (run > 0 && bnum >= start + run && bnum <= start + run + gap)
+        {
+            run = bnum - start + 1;
+            continue;
+        }
+        if (run > 0)
+        {
+            blocks_advise(start, run, advice);
+            stats.calls++;
+            stats.blocks += run;
+        }
+        start = bnum;
+        run = bnum > 0 ? 1 : 0; //0 is the unused tail of a compressed cluster
+    }
+}
+
+void readahead_access(readahead_t *ra, inode_t *node, off_t offset, size_t size)
+{
+    if (offset >= node->size || size == 0)
+    {
+        return;
+    }
+    off_t end = offset + size < node->size ? offset + size : node->size;
+    int first = offset / BLOCK_SIZE;
+    int last = bytes_to_blocks(end); //one past the last block read
+    int blocks = bytes_to_blocks(node->size);
+
+    if (offset != ra->next)
+    {
+        stats.random++;
+        ra->window = 0;
+        if (++ra->misses >= RANDOM_AFTER)
+        {
+            advise_range(node, first, last, MADV_RANDOM, 0);
+        }
+        ra->next = end;
+        return;
+    }
+
+    stats.sequential++;
+    ra->misses = 0;
+    if (ra->window == 0)
+    { //a new stream
+        ra->window = RA_MIN_WINDOW;
+        ra->ahead = first;
+    }
+    else if (ra->ahead - last >= ra->window / 2)
+    { //still well inside what was asked for
+        ra->next = end;
+        return;
+    }
+    else if (ra->window < RA_MAX_WINDOW)
+    {
+        ra->window *= 2;
+    }
+    int from = ra->ahead > first ? ra->ahead : first;
+    int to = last + ra->window < blocks ? last + ra->window : blocks;
+    if (to > from)
+    {
+        printf("readahead of blocks %d to %d (window %d)\n", from, to, ra->window);
+        advise_range(node, from, to, MADV_WILLNEED, FETCH_GAP);
+        ra->ahead = to;
+    }
+    ra->next = end;
+}
+
+readahead_stats_t *readahead_get_stats()
+{
+    return &stats;
+}
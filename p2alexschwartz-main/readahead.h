@@ -0,0 +1,44 @@
+// Readahead for files read through the mmapped image.
+//
+// A cold read of the map faults its pages in about one at a time. Every
+// open file keeps a readahead_t that watches where its reads land. Reads
+// that each start where the last one ended ask the kernel to fetch the
+// next window of the file's blocks with MADV_WILLNEED. The blocks are
+// found through the inode's block map, so the hint follows the file
+// wherever its blocks are. The window doubles each time the reader gets
+// halfway through it. Reads that keep jumping around get MADV_RANDOM on
+// their blocks instead, so their faults don't pull in neighbouring blocks
+// that belong to other files.
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include "inode.h"
+
+#define RA_MIN_WINDOW 4  // blocks
+#define RA_MAX_WINDOW 64 // blocks
+
+typedef struct readahead
+{
+    off_t next; // where a sequential read would start
+    int window; // blocks fetched ahead of the reader, 0 while reads are random
+    int ahead;  // file blocks before this one have been asked for
+    int misses; // reads in a row that weren't sequential
+} readahead_t;
+
+typedef struct readahead_stats
+{
+    long sequential; // reads that continued a stream
+    long random;     // reads that didn't
+    long calls;      // madvise calls made
+    long blocks;     // blocks advised
+} readahead_stats_t;
+
+void readahead_init(readahead_t *ra);
+
+// Note a read of size bytes at offset of node, hinting the kernel about what comes next
+void readahead_access(readahead_t *ra, inode_t *node, off_t offset, size_t size);
+
+// Counters since mount
+readahead_stats_t *readahead_get_stats();
+
+#endif
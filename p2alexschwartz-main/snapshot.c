@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+#include "snapshot.h"
+#include "storage.h"
+#include "inode.h"
+#include "bitmap.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RECLAIM_BATCH 64 //blocks looked at per hold of the storage lock
+
+static pthread_t reclaimer;
+static pthread_cond_t reclaim_wanted = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t reclaim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int reclaim_requested = 0;
+static int reclaimer_running = 0;
+static int reclaimer_stop = 0;
+
+static const int live_table[INODE_TABLE_BLOCKS] = INODE_TABLE_LIVE;
+
+snapshot_t *snapshot_find(const char *name)
+{
+    superblock_t *sb = get_superblock();
+    for (int i = 0; i < MAX_SNAPSHOTS; i++)
+    {
+        if (sb->snapshots[i].name[0] != '\0' && strcmp(sb->snapshots[i].name, name) == 0)
+        {
+            return &sb->snapshots[i];
+        }
+    }
+    return 0;
+}
+
+int snapshot_create(const char *name)
+{
+    superblock_t *sb = get_superblock();
+    if (strlen(name) == 0 || strlen(name) > SNAPSHOT_NAME_LENGTH)
+    {
+        return -EINVAL;
+    }
+    if (snapshot_find(name) != 0)
+    {
+        return -EEXIST;
+    }
+    snapshot_t *snap = 0;
+    for (int i = 0; i < MAX_SNAPSHOTS && snap == 0; i++)
+    {
+        if (sb->snapshots[i].name[0] == '\0')
+        {
+            snap = &sb->snapshots[i];
+        }
+    }
+    if (snap == 0)
+    {
+        return -ENOSPC;
+    }
+
+    //the inode table is the only thing copied, the blocks it points at are shared from here on
+    int copies[INODE_TABLE_BLOCKS];
+    for (int i = 0; i < INODE_TABLE_BLOCKS; i++)
+    {
+        copies[i] = alloc_block();
+        if (copies[i] == -1)
+        {
+            while (--i >= 0)
+            {
+                free_block(copies[i]);
+            }
+            return -ENOSPC;
+        }
+        memcpy(blocks_get_block(copies[i]), blocks_read_block(live_table[i]), BLOCK_SIZE);
+    }
+    assert(sizeof(snap->ibm) * 8 >= BLOCK_COUNT);
+    memcpy(snap->ibm, get_inode_bitmap(), sizeof(snap->ibm));
+    memcpy(snap->itable, copies, sizeof(copies));
+    snap->gen = sb->gen++;
+    strcpy(snap->name, name);
+    blocks_snapshots_changed();
+
+    printf("snapshot_create(%s) -> gen %d\n", name, snap->gen);
+    return 0;
+}
+
+int snapshot_delete(const char *name)
+{
+    snapshot_t *snap = snapshot_find(name);
+    if (snap == 0)
+    {
+        return -ENOENT;
+    }
+    memset(snap, 0, sizeof(snapshot_t));
+    get_superblock()->sweep_pending = 1; //survives a crash, the reclaimer picks it up on mount
+    blocks_snapshots_changed();
+
+    pthread_mutex_lock(&reclaim_mutex);
+    reclaim_requested = 1;
+    pthread_cond_signal(&reclaim_wanted);
+    pthread_mutex_unlock(&reclaim_mutex);
+
+    printf("snapshot_delete(%s) -> 0\n", name);
+    return 0;
+}
+
+//Mark every block reachable from one copy of the inode table
+static void mark_tree(uint8_t *marks, const int *table, const uint8_t *ibm)
+{
+    for (int i = 0; i < INODE_TABLE_BLOCKS; i++)
+    {
+        bitmap_put(marks, table[i], 1);
+    }
+    for (int inum = 0; inum < BLOCK_COUNT; inum++)
+    {
+        if (!bitmap_get((void *)ibm, inum))
+        {
+            continue;
+        }
+        inode_t *node = get_inode_in(table, inum);
+        for (int i = 0; i < bytes_to_blocks(node->size); i++)
+        {
+            int bnum = inode_get_bnum(node, i);
+            if (bnum > 0 && bnum < BLOCK_COUNT)
+            {
+                bitmap_put(marks, bnum, 1);
+            }
+        }
+        if (node->cont_block > 0 && node->cont_block < BLOCK_COUNT)
+        {
+            bitmap_put(marks, node->cont_block, 1);
+        }
+    }
+}
+
+int snapshot_reclaim()
+{
+    uint8_t *marks = calloc(BLOCK_BITMAP_SIZE, 1);
+    int freed = 0;
+
+    storage_lock();
+    superblock_t *sb = get_superblock();
+    for (int i = 0; i < INODE_TABLE_START + INODE_TABLE_BLOCKS; i++)
+    { //block 0 and the live inode table
+        bitmap_put(marks, i, 1);
+    }
+    mark_tree(marks, live_table, get_inode_bitmap());
+    for (int i = 0; i < MAX_SNAPSHOTS; i++)
+    {
+        if (sb->snapshots[i].name[0] != '\0')
+        {
+            mark_tree(marks, sb->snapshots[i].itable, sb->snapshots[i].ibm);
+        }
+    }
+    //anything allocated from here on is born in a newer generation and left alone
+    uint16_t sweep_gen = ++sb->gen;
+    storage_unlock();
+
+    for (int start = 0; start < BLOCK_COUNT; start += RECLAIM_BATCH)
+    {
+        storage_lock();
+        void *bbm = get_blocks_bitmap();
+        for (int bnum = start; bnum < start + RECLAIM_BATCH && bnum < BLOCK_COUNT; bnum++)
+        {
+            block_info_t *info = get_block_info(bnum);
+            if (bitmap_get(bbm, bnum) && !bitmap_get(marks, bnum) && info->birth < sweep_gen)
+            {
+                reclaim_block(bnum);
+                freed++;
+            }
+        }
+        storage_unlock();
+    }
+    free(marks);
+
+    printf("snapshot_reclaim() -> %d blocks\n", freed);
+    return freed;
+}
+
+static void *reclaimer_main(void *arg)
+{
+    pthread_mutex_lock(&reclaim_mutex);
+    while (!reclaimer_stop)
+    {
+        if (!reclaim_requested)
+        {
+            pthread_cond_wait(&reclaim_wanted, &reclaim_mutex);
+            continue;
+        }
+        reclaim_requested = 0;
+        pthread_mutex_unlock(&reclaim_mutex);
+
+        snapshot_reclaim();
+
+        storage_lock(); //always taken before reclaim_mutex, like snapshot_delete does
+        pthread_mutex_lock(&reclaim_mutex);
+        if (!reclaim_requested)
+        { //nothing was deleted while we were sweeping
+            get_superblock()->sweep_pending = 0;
+        }
+        storage_unlock();
+    }
+    pthread_mutex_unlock(&reclaim_mutex);
+    return 0;
+}
+
+void snapshot_start_reclaimer()
+{
+    if (storage_readonly())
+    {
+        return;
+    }
+    reclaimer_stop = 0;
+    reclaim_requested = get_superblock()->sweep_pending;
+    int rv = pthread_create(&reclaimer, 0, reclaimer_main, 0);
+    assert(rv == 0);
+    reclaimer_running = 1;
+}
+
+void snapshot_stop_reclaimer()
+{
+    if (!reclaimer_running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&reclaim_mutex);
+    reclaimer_stop = 1;
+    pthread_cond_signal(&reclaim_wanted);
+    pthread_mutex_unlock(&reclaim_mutex);
+    pthread_join(reclaimer, 0);
+    reclaimer_running = 0;
+}
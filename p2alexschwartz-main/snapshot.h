@@ -0,0 +1,32 @@
+// Copy-on-write snapshots of the whole filesystem.
+//
+// A snapshot copies the inode table and shares every other block with the
+// live tree, so taking one costs the same no matter how big the image is.
+// The live tree copies a block the first time it writes to it afterwards
+// (see inode_cow_bnum). Deleting a snapshot only drops its table entry, a
+// background reclaimer then gives back the blocks nothing references.
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "blocks.h"
+
+// Take a snapshot of the live tree, returns 0 or a negative errno
+int snapshot_create(const char *name);
+
+// Delete the named snapshot and wake the reclaimer, returns 0 or a negative errno
+int snapshot_delete(const char *name);
+
+// Find the named snapshot, 0 if there is none
+snapshot_t *snapshot_find(const char *name);
+
+// Give back every allocated block that neither the live tree nor a snapshot references.
+// Works in batches, dropping the storage lock in between. Returns the number of blocks freed.
+int snapshot_reclaim();
+
+// Start the background reclaimer, finishing any reclaim a crash interrupted
+void snapshot_start_reclaimer();
+
+// Stop the background reclaimer
+void snapshot_stop_reclaimer();
+
+#endif
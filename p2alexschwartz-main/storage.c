@@ -1,13 +1,141 @@
+#define _GNU_SOURCE
 #include "directory.h"
 #include "storage.h"
 #include "bitmap.h"
+#include "snapshot.h"
+#include "golden.h"
+#include "batch.h"
+#include "lazytime.h"
+#include "backend.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+static pthread_mutex_t storage_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static int readonly = 0;
+static int golden = 0;
+static int lock_depth = 0; // only changed with the lock held
 
 void storage_init(const char *path)
 {
+    golden_forget();
+    batch_forget();
+    lazytime_forget();
+    golden = 0;
+    readonly = 0;
     printf("init blocks\n");
     blocks_init(path);
     printf("init root directory\n");
     directory_init();
 
     printf("done initilizing\n");
-}
\ No newline at end of file
+}
+
+int storage_init_golden(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) == -1)
+    {
+        return -errno;
+    }
+    if (st.st_size != NUFS_SIZE)
+    { //mapping it would fault past the end
+        printf("%s is %ld bytes, not an image\n", path, st.st_size);
+        return -EINVAL;
+    }
+    golden_forget();
+    batch_forget();
+    lazytime_forget();
+    map_policy_t policy = *blocks_policy();
+    policy.readonly = 1;
+    blocks_set_policy(&policy);
+    blocks_set_backend("mmap", DEFAULT_CACHE_BLOCKS); //the only one that can hand out blocks without the lock
+    printf("init blocks read only\n");
+    blocks_init(path);
+    policy.readonly = 0; //for the next image
+    blocks_set_policy(&policy);
+    if (get_superblock()->magic != NUFS_MAGIC || !S_ISDIR(get_inode(ROOT_INUM)->mode))
+    { //nothing may format it
+        printf("%s isn't a formatted image\n", path);
+        blocks_free();
+        return -EINVAL;
+    }
+    if (get_superblock()->version != NUFS_VERSION)
+    { //upgrading writes to it
+        printf("%s is version %d, mount it writable once to upgrade it\n", path, get_superblock()->version);
+        blocks_free();
+        return -EINVAL;
+    }
+    readonly = 1;
+    golden = 1;
+    printf("serving %s read only\n", path);
+    return 0;
+}
+
+int storage_use_snapshot(const char *name)
+{
+    snapshot_t *snap = snapshot_find(name);
+    if (snap == 0)
+    {
+        printf("no snapshot named %s\n", name);
+        return -ENOENT;
+    }
+    inode_set_table(snap->itable);
+    readonly = 1;
+    printf("serving snapshot %s read only\n", name);
+    return 0;
+}
+
+int storage_readonly()
+{
+    return readonly;
+}
+
+int storage_golden()
+{
+    return golden;
+}
+
+void storage_lock()
+{
+    if (golden)
+    {
+        return;
+    }
+    pthread_mutex_lock(&storage_mutex);
+    lock_depth++;
+}
+
+void storage_unlock()
+{
+    if (golden)
+    {
+        return;
+    }
+    if (--lock_depth == 0)
+    { //the outermost unlock ends the request
+        lazytime_expire();
+        blocks_request_done();
+    }
+    pthread_mutex_unlock(&storage_mutex);
+}
+
+int storage_flush()
+{
+    storage_lock();
+    int rv = blocks_flush();
+    storage_unlock();
+    return rv;
+}
+
+int storage_enter()
+{
+    storage_lock();
+    return 0;
+}
+
+void storage_leave(int *guard)
+{
+    storage_unlock();
+}
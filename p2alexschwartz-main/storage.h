@@ -14,17 +14,27 @@
 
 #include "slist.h"
 
+// Open the image with the backend chosen by blocks_set_backend (mmap unless told otherwise)
 void storage_init(const char *path);
-/*
-int storage_stat(const char *path, struct stat *st);
-int storage_read(const char *path, char *buf, size_t size, off_t offset);
-int storage_write(const char *path, const char *buf, size_t size, off_t offset);
-int storage_truncate(const char *path, off_t size);
-int storage_mknod(const char *path, int mode);
-int storage_unlink(const char *path);
-int storage_link(const char *from, const char *to);
-int storage_rename(const char *from, const char *to);
-int storage_set_time(const char *path, const struct timespec ts[2]);
-slist_t *storage_list(const char *path);
-*/
+// Open a formatted image to serve read only without locking, see golden.h. Returns 0 or a negative errno
+int storage_init_golden(const char *path);
+// Serve the named snapshot instead of the live tree, read only. Returns 0 or a negative errno
+int storage_use_snapshot(const char *name);
+// Non zero if nothing may be changed
+int storage_readonly();
+// Non zero if the image was opened with storage_init_golden
+int storage_golden();
+
+// The storage lock serializes requests and background work on the image.
+// It is recursive, so a callback may call another callback. Blocks handed
+// out while it is held stay valid until it is let go for the last time.
+// Golden images are never changed, so there it isn't taken at all.
+void storage_lock();
+void storage_unlock();
+// Take the storage lock for a request, storage_leave gives it back (usable as a cleanup handler)
+int storage_enter();
+void storage_leave(int *guard);
+// Put everything written so far on disk, 0 or -1
+int storage_flush();
+
 #endif
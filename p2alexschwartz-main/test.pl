@@ -2,14 +2,21 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::Simple tests => 100;
 use IO::Handle;
+use File::Temp qw(tempdir);
 
 sub mount {
     system("(make mount 2>&1) >> test.log &");
     sleep 1;
 }
 
+sub mount_with {
+    my ($options) = @_;
+    system("mkdir -p mnt; (./nufs -s -f -o $options mnt data.nufs 2>&1) >> test.log &");
+    sleep 1;
+}
+
 sub unmount {
     system("(make unmount 2>&1) >> test.log");
 }
@@ -41,6 +48,96 @@ sub read_text_slice {
     return $data;
 }
 
+sub write_text_slice {
+    my ($name, $data, $offset) = @_;
+    open my $fh, "+<", "mnt/$name" or return;
+    seek $fh, $offset, 0;
+    print $fh $data;
+    close $fh;
+}
+
+sub free_blocks {
+    my $free = `stat -f -c %f mnt`;
+    chomp $free;
+    return $free || 0;
+}
+
+sub extents {
+    my ($name) = @_;
+    my $report = `./nufs-frag mnt/$name 2>&1`;
+    return $report =~ /(\d+) extents$/m ? $1 : -1;
+}
+
+# An image as the first version of nufs wrote it: no superblock, 32 byte
+# inodes with no type in blocks 1-2, and stack garbage where directory
+# blocks keep their bloom filter now. Holds old.txt and olddir/inner.txt
+sub write_v1_image {
+    my ($outer, $inner) = @_;
+    my $image = "\0" x (256 * 4096);
+    my $put = sub {
+        my ($bnum, $offset, $bytes) = @_;
+        substr($image, $bnum * 4096 + $offset, length($bytes)) = $bytes;
+    };
+    my $inode = sub {
+        my ($inum, $size, $bnum) = @_;
+        $put->(1, $inum * 32, pack("l8", 1, 0, $size, $bnum, 0, 0, 0, 0));
+    };
+    my $dir = sub {
+        my ($bnum, @entries) = @_;
+        my $used = @entries / 3;
+        my $header = pack("C8 l", (1 << ($used + 1)) - 1, (0) x 7, 63 - $used);
+        $put->($bnum, 0, $header . ("\0" x 48) . "\x5a");
+        for my $ii (0 .. $used - 1) {
+            my ($name, $inum, $mode) = @entries[3 * $ii .. 3 * $ii + 2];
+            $put->($bnum, 64 * ($ii + 1), pack("Z49 x3 l l", $name, $inum, $mode));
+        }
+    };
+    $put->(0, 0, pack("C", 0x7f));                      # blocks 0-6
+    $put->(0, 32, pack("C", 0x0f));                     # inodes 0-3
+    $put->(0, 288, pack("Z49 x3 l l", "/", 0, 040755)); # the root entry
+    $inode->(0, 4096, 3);
+    $dir->(3, "old.txt", 1, 0100644, "olddir", 2, 040755);
+    $inode->(1, length($outer), 4);
+    $put->(4, 0, $outer);
+    $inode->(2, 4096, 5);
+    $dir->(5, "inner.txt", 3, 0100644);
+    $inode->(3, length($inner), 6);
+    $put->(6, 0, $inner);
+    open my $fh, ">", "data.nufs" or die "can't write data.nufs";
+    binmode $fh;
+    print $fh $image;
+    close $fh;
+}
+
+# Damage an unmounted image the ways nufs-fsck repairs: cut.txt's second
+# block pointer leads outside the image, gone.txt's entry names a free
+# inode, a block nothing uses is marked in use and keep.txt's block says
+# it is shared. All of them are in the root directory
+sub corrupt_image {
+    open my $fh, "+<", "data.nufs" or die "can't open data.nufs";
+    binmode $fh;
+    local $/ = undef;
+    my $image = <$fh>;
+    my $inode = sub { return 4096 + 64 * $_[0] };
+    my $root = unpack("l", substr($image, $inode->(0) + 16, 4));
+    my %inums;
+    for my $ii (1 .. 63) {
+        my $at = $root * 4096 + 64 * $ii;
+        my ($name, $inum) = unpack("Z49 x3 l", substr($image, $at, 56));
+        $inums{$name} = $inum;
+        if ($name eq "gone.txt") {
+            substr($image, $at + 52, 4) = pack("l", 200);
+        }
+    }
+    substr($image, $inode->($inums{"cut.txt"}) + 20, 4) = pack("l", 100000);
+    vec($image, 250, 1) = 1;                              # the block bitmap
+    my $kept = unpack("l", substr($image, $inode->($inums{"keep.txt"}) + 16, 4));
+    substr($image, 2048 + 4 * $kept, 1) = pack("C", 3);  # its extra_refs
+    seek $fh, 0, 0;
+    print $fh $image;
+    close $fh;
+}
+
 system("rm -f data.nufs test.log");
 
 say "#           == Basic Tests ==";
@@ -171,5 +268,362 @@ ok(($listed and $exists and $has_size), "Larger file exists and has the correct
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
 
-unmount()
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "#           == Feature Tests ==";
+
+say "# Lookups through the directory blocks' bloom filters";
+
+ok(mkdir("mnt/many"), "Create a directory for many files");
+for my $ii (0 .. 99) {
+    write_text("many/f$ii.txt", "file $ii");
+}
+
+unmount();
+mount();
+
+my $found = grep { -e "mnt/many/f$_.txt" } 0 .. 99;
+ok($found == 100, "Every name is found after a remount");
+my $strays = grep { -e "mnt/many/g$_.txt" } 0 .. 99;
+ok($strays == 0, "Names never made are not found");
+system("rm -f mnt/many/f1*.txt");
+$found = grep { -e "mnt/many/f$_.txt" } 0 .. 99;
+ok($found == 89, "Removed names are gone, the rest are still found");
+write_text("many/f10.txt", "back again");
+ok(read_text("many/f10.txt") eq "back again", "A name made again is found");
+
+unmount();
+
+say "# Snapshots";
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+write_text("snap.txt", "before the snapshot");
+write_text("gone.txt", "deleted after the snapshot");
+ok(system("./nufs-snap create mnt first") == 0, "Create a snapshot");
+write_text("snap.txt", "after the snapshot");
+system("rm -f mnt/gone.txt");
+write_text("new.txt", "made after the snapshot");
+ok(`./nufs-snap list mnt` =~ /^first$/m, "The snapshot is listed");
+
+unmount();
+mount_with("snapshot=first");
+
+ok(read_text("snap.txt") eq "before the snapshot", "The snapshot keeps what a file held");
+ok(read_text("gone.txt") eq "deleted after the snapshot", "The snapshot keeps a deleted file");
+ok(!-e "mnt/new.txt", "The snapshot doesn't see a later file");
+
+unmount();
+mount();
+
+ok(read_text("snap.txt") eq "after the snapshot", "The live tree keeps the new contents");
+ok((!-e "mnt/gone.txt" and -e "mnt/new.txt"), "The live tree keeps the delete and the new file");
+
+unmount();
+
+say "# Clones";
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+my $orig = "0123456789abcdef" x 1023 . "0123456789abcde"; # 4 blocks with the newline
+write_text("orig.txt", $orig);
+
+unmount();
+mount();
+
+my $free = free_blocks(); # once nothing holds an allocation window
+ok(system("./nufs-clone mnt orig.txt copy.txt") == 0, "Clone a file");
+ok(read_text("copy.txt") eq $orig, "The clone reads the same");
+
+unmount();
+mount();
+
+ok(free_blocks() == $free, "The clone shares every block");
+write_text_slice("copy.txt", "XXXX", 5000);
+
+unmount();
+mount();
+
+my $changed = $orig;
+substr($changed, 5000, 4) = "XXXX";
+ok(read_text("copy.txt") eq $changed, "A write to the clone lands in the clone");
+ok(read_text("orig.txt") eq $orig, "The original is left alone");
+
+unmount();
+
+say "# Deduplication";
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+my $same = ("a" x 4096) . ("b" x 4096) . ("c" x 4096) . ("d" x 4095); # 4 different blocks
+write_text("first.txt", $same);
+write_text("second.txt", $same);
+
+unmount();
+mount();
+
+$free = free_blocks();
+
+unmount();
+
+ok(system("(./nufs-dedup data.nufs 2>&1) >> test.log") == 0, "Deduplicate the image");
+
+mount();
+
+ok(free_blocks() == $free + 4, "The blocks of the second copy are given back");
+ok(read_text("second.txt") eq $same, "The second copy still reads the same");
+write_text_slice("second.txt", "YYYY", 100);
+
+unmount();
+mount();
+
+my $edited = $same;
+substr($edited, 100, 4) = "YYYY";
+ok(read_text("second.txt") eq $edited, "A write to a shared block goes to a copy");
+ok(read_text("first.txt") eq $same, "The other file keeps its data");
+
+unmount();
+
+say "# Compression";
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+my $text = join("", map { "line $_ of a file that compresses well\n" } 1 .. 2000);
+$text =~ s/\s*$//;
+ok((mkdir("mnt/packed") and system("./nufs-compress mnt/packed on") == 0),
+   "Turn compression on for a directory");
+$free = free_blocks();
+write_text("plain.txt", $text);
+
+unmount();
+mount();
+
+my $plain = $free - free_blocks();
+$free = free_blocks();
+write_text("packed/text.txt", $text);
 
+unmount();
+mount();
+
+my $packed = $free - free_blocks();
+say "# $plain blocks plain, $packed compressed";
+ok($packed < $plain, "The compressed copy takes fewer blocks");
+ok(`./nufs-compress mnt/packed/text.txt` =~ /compression on/, "A new file inherits compression");
+ok(read_text("packed/text.txt") eq $text, "Read back a compressed file after a remount");
+ok(system("./nufs-compress mnt/packed/text.txt off") == 0, "Turn compression off for the file");
+
+unmount();
+mount();
+
+ok(read_text("packed/text.txt") eq $text, "Read back the file after it is stored plain again");
+
+unmount();
+
+say "# Background reclamation";
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+$free = free_blocks();
+write_text("big.txt", "z" x (100 * 4096));
+write_text("cut.txt", "y" x (60 * 4096));
+
+unmount();
+mount();
+
+ok(unlink("mnt/big.txt"), "Unlink a large file");
+ok(truncate("mnt/cut.txt", 10), "Truncate a large file");
+
+unmount(); # right away, the reclaimer may not have finished
+sleep 1;
+
+ok(system("(./nufs-fsck -n data.nufs 2>&1) >> test.log") == 0, "The image is clean with blocks still on the orphan list");
+
+mount();
+sleep 1;
+
+ok(free_blocks() == $free - 1, "Every block comes back after the next mount");
+ok(-s "mnt/cut.txt" == 10, "The truncated file keeps its new size");
+
+unmount();
+
+say "# Buffered appends";
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+$free = free_blocks();
+open my $log, ">>", "mnt/log.txt" or die "can't append to mnt/log.txt";
+$log->autoflush(1);
+my $lines = "";
+for my $ii (1 .. 100) {
+    print $log "line $ii\n";
+    $lines .= "line $ii\n";
+}
+ok(read_text("log.txt") eq ($lines =~ s/\s*$//r), "Another handle reads every small append");
+ok(-s "mnt/log.txt" == length($lines), "The size counts every small append");
+ok(unlink("mnt/log.txt"), "Unlink the file while it is open");
+ok(print($log "after the unlink\n"), "Append through the handle after the unlink");
+ok(close($log), "Close the handle without an error");
+
+unmount();
+mount();
+
+ok(free_blocks() == $free, "The unlinked file's blocks are given back");
+
+unmount();
+
+say "# Upgrading a version 1 image";
+
+system("rm -f data.nufs");
+write_v1_image("written by version 1", "inside a version 1 directory");
+
+mount();
+
+ok(read_text("old.txt") eq "written by version 1", "Read a file from a version 1 image");
+ok(read_text("olddir/inner.txt") eq "inside a version 1 directory",
+   "Read a file in a directory of a version 1 image");
+write_text("olddir/new.txt", "written after the upgrade");
+
+unmount();
+sleep 1;
+
+ok(system("(./nufs-fsck -n data.nufs 2>&1) >> test.log") == 0, "The upgraded image is clean");
+
+mount();
+
+ok(read_text("old.txt") eq "written by version 1", "The old file reads back after a remount");
+ok(read_text("olddir/new.txt") eq "written after the upgrade", "A file written after the upgrade reads back");
+
+unmount();
+
+say "# Repairing a damaged image";
+
+system("rm -f data.nufs");
+mount();
+
+my $cut = "abcdefghij" x 1228;
+write_text("keep.txt", "kept as it is");
+write_text("cut.txt", $cut);
+write_text("gone.txt", "its entry goes bad");
+
+unmount();
+sleep 1;
+corrupt_image();
+
+ok(system("(./nufs-fsck -n data.nufs 2>&1) >> test.log") >> 8 == 4, "fsck -n finds the damage and leaves it");
+ok(system("(./nufs-fsck data.nufs 2>&1) >> test.log") >> 8 == 1, "fsck repairs the damage");
+ok(system("(./nufs-fsck -n data.nufs 2>&1) >> test.log") == 0, "The repaired image is clean");
+
+mount();
+
+ok(read_text("keep.txt") eq "kept as it is", "A file fsck had nothing to fix in reads back");
+ok(read_text("cut.txt") eq substr($cut, 0, 4096), "A file is cut short at its bad block pointer");
+ok(!-e "mnt/gone.txt", "An entry naming a free inode is dropped");
+
+unmount();
+
+say "# Defragmenting";
+
+system("rm -f data.nufs");
+mount_with("window=0");
+
+my $pieces = "";
+for my $ii (0 .. 11) {
+    for my $name ("frag.txt", "gap.txt") {
+        open my $fh, ">>", "mnt/$name" or die "can't append to $name";
+        print $fh chr(ord("a") + $ii) x 4096;
+        close $fh;
+    }
+    $pieces .= chr(ord("a") + $ii) x 4096;
+}
+unlink("mnt/gap.txt");
+
+my $scattered = extents("frag.txt");
+ok($scattered > 1, "Appends to two files at once leave both in pieces");
+ok(system("(./nufs-defrag mnt 2>&1) >> test.log") == 0, "nufs-defrag finishes a pass");
+ok(extents("frag.txt") < $scattered, "The file is in fewer pieces after it");
+ok(read_text("frag.txt") eq $pieces, "The file reads the same after it");
+
+unmount();
+
+say "# Building an image from a directory";
+
+my $tree = tempdir(CLEANUP => 1);
+my %tree = ("hello.txt" => "made by mkfs.nufs", "sub/inner.txt" => "one level down",
+            "big.txt" => "0123456789" x 2000);
+mkdir "$tree/sub";
+for my $name (keys %tree) {
+    open my $fh, ">", "$tree/$name" or die "can't write $tree/$name";
+    $fh->say($tree{$name});
+    close $fh;
+}
+
+system("rm -f data.nufs");
+ok(system("(./mkfs.nufs -d $tree data.nufs 2>&1) >> test.log") == 0, "mkfs.nufs builds an image from a directory");
+
+mount();
+
+ok(join(" ", sort split /\s+/, `ls mnt`) eq "big.txt hello.txt sub", "The image holds the directory's names");
+for my $name (sort keys %tree) {
+    ok(read_text($name) eq $tree{$name}, "$name reads back from the built image");
+}
+
+unmount();
+
+say "# Serving a golden image";
+
+my $sum = `cksum data.nufs`;
+mount_with("golden");
+
+ok(read_text("sub/inner.txt") eq $tree{"sub/inner.txt"}, "A golden mount finds a file in a directory");
+ok(read_text("big.txt") eq $tree{"big.txt"}, "A golden mount reads a multi-block file");
+ok(!open(my $created, ">", "mnt/new.txt") && $!{EROFS}, "Creating a file fails with EROFS");
+ok(!open(my $appended, ">>", "mnt/hello.txt") && $!{EROFS}, "Writing to a file fails with EROFS");
+ok(!mkdir("mnt/newdir") && $!{EROFS}, "Making a directory fails with EROFS");
+
+unmount();
+
+ok(`cksum data.nufs` eq $sum, "The golden image is left as it was");
+
+say "# Removing a populated tree";
+
+system("rm -f data.nufs");
+mount();
+
+my $empty = free_blocks();
+my @names;
+mkdir "mnt/tree";
+for my $dd (0 .. 3) {
+    mkdir "mnt/tree/d$dd";
+    for my $ff (0 .. 14) {
+        write_text("tree/d$dd/f$ff.txt", "file $ff of directory $dd");
+        push @names, "tree/d$dd/f$ff.txt";
+    }
+}
+
+ok(scalar(grep { read_text($_) =~ /^file \d+ of directory \d+$/ } @names) == 60,
+   "A burst of creates makes every file");
+ok(system("rm -rf mnt/tree") == 0, "rm -rf removes a populated tree");
+ok(!grep({ -e "mnt/$_" } @names) && `ls -A mnt` eq "", "Every name in it is gone");
+
+unmount();
+mount();
+
+ok(`ls -A mnt` eq "" && free_blocks() == $empty, "It stays gone after a remount and its blocks are free");
+
+unmount();
@@ -0,0 +1,50 @@
+// nufs-clone: copy a file inside a mounted nufs by sharing its blocks.
+//
+// usage: nufs-clone <mountpoint> <src> <dst> [src_offset dst_offset length]
+//
+// src and dst are paths relative to the mountpoint. dst is created if it
+// does not exist. Without offsets the whole file is cloned.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "nufs_ioctl.h"
+
+int main(int argc, char **argv)
+{
+  if (argc != 4 && argc != 7)
+  {
+    fprintf(stderr, "usage: %s <mountpoint> <src> <dst> [src_offset dst_offset length]\n", argv[0]);
+    return 2;
+  }
+
+  nufs_clone_arg_t arg;
+  memset(&arg, 0, sizeof(arg));
+  snprintf(arg.src, sizeof(arg.src), "/%s", argv[2]);
+  if (argc == 7)
+  {
+    arg.src_offset = strtoull(argv[4], 0, 0);
+    arg.dst_offset = strtoull(argv[5], 0, 0);
+    arg.length = strtoull(argv[6], 0, 0);
+  }
+
+  char dst[NUFS_PATH_MAX];
+  snprintf(dst, sizeof(dst), "%s/%s", argv[1], argv[3]);
+  int fd = open(dst, O_WRONLY | O_CREAT, 0644);
+  if (fd == -1)
+  {
+    perror(dst);
+    return 1;
+  }
+  int rv = ioctl(fd, NUFS_IOC_CLONE_RANGE, &arg);
+  if (rv == -1)
+  {
+    perror("clone");
+  }
+  close(fd);
+  return rv == -1;
+}
@@ -0,0 +1,49 @@
+// nufs-compress: turn compression of a file or directory in a mounted nufs
+// on or off.
+//
+// usage: nufs-compress <path> [on|off]
+//
+// Without on or off it prints whether compression is on. Files and
+// directories made inside a compressed directory are compressed too.
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "nufs_ioctl.h"
+
+int main(int argc, char **argv)
+{
+  if (argc != 2 && !(argc == 3 && (strcmp(argv[2], "on") == 0 || strcmp(argv[2], "off") == 0)))
+  {
+    fprintf(stderr, "usage: %s <path> [on|off]\n", argv[0]);
+    return 2;
+  }
+
+  int fd = open(argv[1], O_RDONLY);
+  if (fd == -1)
+  {
+    perror(argv[1]);
+    return 1;
+  }
+  uint32_t flags;
+  int rv = ioctl(fd, NUFS_IOC_GETFLAGS, &flags);
+  if (rv != -1 && argc == 3)
+  {
+    flags = strcmp(argv[2], "on") == 0 ? flags | NUFS_FL_COMPRESS : flags & ~NUFS_FL_COMPRESS;
+    rv = ioctl(fd, NUFS_IOC_SETFLAGS, &flags);
+  }
+  if (rv == -1)
+  {
+    perror("compress");
+  }
+  else if (argc == 2)
+  {
+    printf("%s: compression %s\n", argv[1], flags & NUFS_FL_COMPRESS ? "on" : "off");
+  }
+  close(fd);
+  return rv == -1;
+}
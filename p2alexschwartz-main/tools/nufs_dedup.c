@@ -0,0 +1,43 @@
+// nufs-dedup: offline deduplication of an unmounted nufs image.
+//
+// usage: nufs-dedup <image>
+//
+// Every block of every file is hashed, and blocks identical to one seen
+// before are replaced by a shared reference to it.
+
+#include <stdio.h>
+
+#include "bitmap.h"
+#include "dedup.h"
+#include "storage.h"
+
+static int used_blocks()
+{
+  int used = 0;
+  for (int i = 0; i < BLOCK_COUNT; i++)
+  {
+    used += bitmap_get(get_blocks_bitmap(), i);
+  }
+  return used;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 2)
+  {
+    fprintf(stderr, "usage: %s <image>\n", argv[0]);
+    return 2;
+  }
+  freopen("/dev/null", "w", stdout); // the library traces every call
+
+  storage_init(argv[1]);
+  int before = used_blocks();
+  long shared = dedup_scan();
+  int after = used_blocks();
+  blocks_free();
+
+  fprintf(stderr, "%s: %ld blocks scanned, %ld shared, %d -> %d blocks in use (%d KB saved)\n",
+          argv[1], dedup_get_stats()->scanned, shared, before, after,
+          (before - after) * BLOCK_SIZE / 1024);
+  return 0;
+}
@@ -0,0 +1,71 @@
+// nufs-defrag: defragment a mounted nufs and report how it went.
+//
+// usage: nufs-defrag <mountpoint>
+//        nufs-defrag status <mountpoint>
+//
+// The pass runs in the background in slices of -o defrag_budget=USEC, this
+// waits for it to finish. status reports on the last pass without starting one.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "nufs_ioctl.h"
+
+static void report(const nufs_defrag_arg_t *arg)
+{
+  if (arg->passes == 0)
+  {
+    printf("no pass yet%s\n", arg->running ? ", one is running" : "");
+    return;
+  }
+  printf("moved %lu blocks of %lu files\n", (unsigned long)arg->moved, (unsigned long)arg->files);
+  printf("extents:          %lu -> %lu\n", (unsigned long)arg->extents_before,
+         (unsigned long)arg->extents_after);
+  printf("fragmented files: %lu -> %lu\n", (unsigned long)arg->fragmented_before,
+         (unsigned long)arg->fragmented_after);
+}
+
+int main(int argc, char **argv)
+{
+  int status = argc == 3 && strcmp(argv[1], "status") == 0;
+  if (argc != 2 && !status)
+  {
+    fprintf(stderr, "usage: %s <mountpoint>\n", argv[0]);
+    fprintf(stderr, "       %s status <mountpoint>\n", argv[0]);
+    return 2;
+  }
+
+  const char *mount = argv[argc - 1];
+  int fd = open(mount, O_RDONLY);
+  if (fd == -1)
+  {
+    perror(mount);
+    return 1;
+  }
+
+  nufs_defrag_arg_t arg;
+  int rv = ioctl(fd, status ? NUFS_IOC_DEFRAG_STATUS : NUFS_IOC_DEFRAG, &arg);
+  if (rv == 0 && !status)
+  { // a pass that was already running finishes first, then ours
+    uint32_t until = arg.passes + 1 + arg.running;
+    while (rv == 0 && (arg.passes < until || arg.running))
+    {
+      usleep(100000);
+      rv = ioctl(fd, NUFS_IOC_DEFRAG_STATUS, &arg);
+    }
+  }
+
+  if (rv == -1)
+  {
+    perror(argv[1]);
+  }
+  else
+  {
+    report(&arg);
+  }
+  close(fd);
+  return rv == -1;
+}
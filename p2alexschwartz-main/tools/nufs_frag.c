@@ -0,0 +1,179 @@
+// nufs-frag: show how files in a mounted nufs are laid out in the image.
+//
+// usage: nufs-frag <file>
+//        nufs-frag <directory>
+//
+// On a file it lists its extents (file offset, image offset, length and
+// flags). On a directory, usually the mountpoint, it prints the number of
+// extents of every file under it, then histograms of extents per file and
+// of extent lengths for all of them.
+
+#define _XOPEN_SOURCE 500
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nufs_ioctl.h"
+
+#define BUCKETS 8 // 1, 2, 3-4, 5-8, ... 65 and up
+
+static long files_by_extents[BUCKETS];
+static long extents_by_blocks[BUCKETS];
+static long total_files, total_extents, total_blocks;
+static int failed = 0;
+
+static int bucket(uint64_t n)
+{
+  int b = 0;
+  while (b < BUCKETS - 1 && n > (1ull << b))
+  {
+    b++;
+  }
+  return b;
+}
+
+static void bucket_label(int b, char *label)
+{
+  if (b < 2)
+    sprintf(label, "%d", b + 1);
+  else if (b == BUCKETS - 1)
+    sprintf(label, "%d+", (1 << (b - 1)) + 1);
+  else
+    sprintf(label, "%d-%d", (1 << (b - 1)) + 1, 1 << b);
+}
+
+// Call fn for every extent of the open file, returns the number of extents or -1
+static long each_extent(int fd, void (*fn)(const nufs_fiemap_extent_t *))
+{
+  static nufs_fiemap_t map;
+  long count = 0;
+  memset(&map, 0, sizeof(map));
+  do
+  {
+    if (ioctl(fd, NUFS_IOC_FIEMAP, &map) == -1)
+    {
+      return -1;
+    }
+    for (uint32_t i = 0; i < map.mapped; i++)
+    {
+      fn(&map.extents[i]);
+    }
+    count += map.mapped;
+    if (map.mapped > 0)
+    { // more after a full batch
+      nufs_fiemap_extent_t *last = &map.extents[map.mapped - 1];
+      map.start = last->flags & NUFS_FIEMAP_LAST ? 0 : last->logical + last->length;
+    }
+  } while (map.mapped == NUFS_FIEMAP_EXTENTS && map.start != 0);
+  return count;
+}
+
+static void print_extent(const nufs_fiemap_extent_t *extent)
+{
+  printf("%10lu %10lu %8lu %s%s%s\n", (unsigned long)extent->logical, (unsigned long)extent->physical,
+         (unsigned long)extent->length, extent->flags & NUFS_FIEMAP_SHARED ? "shared " : "",
+         extent->flags & NUFS_FIEMAP_ENCODED ? "encoded " : "",
+         extent->flags & NUFS_FIEMAP_LAST ? "last" : "");
+}
+
+static void count_extent(const nufs_fiemap_extent_t *extent)
+{
+  uint64_t blocks = extent->length / NUFS_BLOCK_SIZE;
+  extents_by_blocks[bucket(blocks)]++;
+  total_blocks += blocks;
+}
+
+static int visit(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+  if (type != FTW_F || !S_ISREG(st->st_mode))
+  {
+    return 0;
+  }
+  int fd = open(path, O_RDONLY);
+  long extents = fd == -1 ? -1 : each_extent(fd, count_extent);
+  if (extents == -1)
+  {
+    perror(path);
+    failed = 1;
+  }
+  else
+  {
+    printf("%6ld %s\n", extents, path);
+    if (extents > 0)
+    { // empty files have nothing to count
+      files_by_extents[bucket(extents)]++;
+      total_files++;
+      total_extents += extents;
+    }
+  }
+  if (fd != -1)
+  {
+    close(fd);
+  }
+  return 0;
+}
+
+static void print_histogram(const char *title, const long *counts, long total)
+{
+  char label[16];
+  printf("\n%s\n", title);
+  for (int b = 0; b < BUCKETS; b++)
+  {
+    bucket_label(b, label);
+    printf("%8s %6ld %5.1f%%\n", label, counts[b], total ? 100.0 * counts[b] / total : 0.0);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  struct stat st;
+  if (argc != 2)
+  {
+    fprintf(stderr, "usage: %s <file>|<directory>\n", argv[0]);
+    return 2;
+  }
+  if (stat(argv[1], &st) == -1)
+  {
+    perror(argv[1]);
+    return 1;
+  }
+
+  if (!S_ISDIR(st.st_mode))
+  {
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1)
+    {
+      perror(argv[1]);
+      return 1;
+    }
+    printf("%10s %10s %8s flags\n", "logical", "physical", "length");
+    long extents = each_extent(fd, print_extent);
+    if (extents == -1)
+    {
+      perror(argv[1]);
+    }
+    else
+    {
+      printf("%s: %ld extents\n", argv[1], extents);
+    }
+    close(fd);
+    return extents == -1;
+  }
+
+  printf("extents file\n");
+  if (nftw(argv[1], visit, 16, FTW_PHYS) == -1)
+  {
+    perror(argv[1]);
+    return 1;
+  }
+  print_histogram("files by extents", files_by_extents, total_files);
+  print_histogram("extents by length in blocks", extents_by_blocks, total_extents);
+  printf("\n%ld files, %ld extents, %ld blocks, %.2f extents per file\n", total_files, total_extents,
+         total_blocks, total_files ? (double)total_extents / total_files : 0.0);
+  return failed;
+}
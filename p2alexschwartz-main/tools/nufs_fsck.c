@@ -0,0 +1,70 @@
+// nufs-fsck: check an unmounted nufs image and repair it.
+//
+// usage: nufs-fsck [-n] [-j THREADS] <image>
+//
+// -n only reports what is wrong. The inode table and directories are
+// scanned with up to THREADS threads, one per CPU by default. Exits with 0 if the
+// image was fine, 1 if problems were repaired and 4 if they were left.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "fsck.h"
+#include "storage.h"
+
+int main(int argc, char **argv)
+{
+  int repair = 1;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+  while ((opt = getopt(argc, argv, "nj:")) != -1)
+  {
+    if (opt == 'n')
+    {
+      repair = 0;
+    }
+    else if (opt == 'j')
+    {
+      threads = atoi(optarg);
+    }
+    else
+    {
+      optind = argc;
+      break;
+    }
+  }
+  if (optind != argc - 1)
+  {
+    fprintf(stderr, "usage: %s [-n] [-j THREADS] <image>\n", argv[0]);
+    return 2;
+  }
+  if (access(argv[optind], R_OK | W_OK) != 0)
+  { // storage_init would make a new image
+    perror(argv[optind]);
+    return 8;
+  }
+  freopen("/dev/null", "w", stdout); // the library traces every call
+
+  storage_init(argv[optind]);
+  fsck_report_t report;
+  long problems = fsck_run(repair, threads, &report);
+  storage_flush();
+  blocks_free();
+
+  const char *what = repair ? "repaired" : "found";
+  fprintf(stderr, "%s: %ld problems %s\n", argv[optind], problems, what);
+  fprintf(stderr, "  bad block pointers    %ld\n", report.bad_pointers);
+  fprintf(stderr, "  bad directory entries %ld\n", report.bad_entries);
+  fprintf(stderr, "  bad directory headers %ld\n", report.bad_headers);
+  fprintf(stderr, "  orphaned inodes       %ld\n", report.orphans);
+  fprintf(stderr, "  stale free inodes     %ld\n", report.stale_inodes);
+  fprintf(stderr, "  wrong link counts     %ld\n", report.bad_links);
+  fprintf(stderr, "  lost blocks           %ld\n", report.lost_blocks);
+  fprintf(stderr, "  leaked blocks         %ld\n", report.leaked_blocks);
+  fprintf(stderr, "  wrong shared counts   %ld\n", report.bad_shares);
+  fprintf(stderr, "  bad orphan list slots %ld\n", report.bad_pending);
+  return problems == 0 ? 0 : repair ? 1 : 4;
+}
@@ -0,0 +1,68 @@
+// nufs-snap: create, delete and list snapshots of a mounted nufs.
+//
+// usage: nufs-snap create|delete <mountpoint> <name>
+//        nufs-snap list <mountpoint>
+//
+// A snapshot is served by mounting the same image with -o snapshot=<name>.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "nufs_ioctl.h"
+
+int main(int argc, char **argv)
+{
+  if (argc < 3 || (strcmp(argv[1], "list") != 0 && argc < 4))
+  {
+    fprintf(stderr, "usage: %s create|delete <mountpoint> <name>\n", argv[0]);
+    fprintf(stderr, "       %s list <mountpoint>\n", argv[0]);
+    return 2;
+  }
+
+  int fd = open(argv[2], O_RDONLY);
+  if (fd == -1)
+  {
+    perror(argv[2]);
+    return 1;
+  }
+
+  int rv;
+  if (strcmp(argv[1], "list") == 0)
+  {
+    nufs_snapshot_list_t list;
+    rv = ioctl(fd, NUFS_IOC_SNAP_LIST, &list);
+    for (int i = 0; rv == 0 && i < list.count; i++)
+    {
+      printf("%s\n", list.names[i]);
+    }
+  }
+  else
+  {
+    nufs_snapshot_arg_t arg;
+    memset(&arg, 0, sizeof(arg));
+    strncpy(arg.name, argv[3], sizeof(arg.name) - 1);
+    if (strcmp(argv[1], "create") == 0)
+    {
+      rv = ioctl(fd, NUFS_IOC_SNAP_CREATE, &arg);
+    }
+    else if (strcmp(argv[1], "delete") == 0)
+    {
+      rv = ioctl(fd, NUFS_IOC_SNAP_DELETE, &arg);
+    }
+    else
+    {
+      fprintf(stderr, "unknown command %s\n", argv[1]);
+      return 2;
+    }
+  }
+
+  if (rv == -1)
+  {
+    perror(argv[1]);
+  }
+  close(fd);
+  return rv == -1;
+}
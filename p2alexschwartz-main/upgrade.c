@@ -0,0 +1,325 @@
+#include "upgrade.h"
+#include "inode.h"
+#include "bitmap.h"
+#include "directory.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define V1_TABLE_BLOCKS 2
+#define V1_INODES_PER_BLOCK 128
+
+typedef struct inode_v1
+{
+    int refs;
+    int mode;
+    int size;
+    int blocks[DIRECT_BLOCKS];
+    int cont_block;
+} inode_v1_t;
+
+typedef struct snapshot_v1
+{
+    char name[SNAPSHOT_NAME_LENGTH + 1];
+    uint16_t gen;
+    uint16_t _reserved;
+    int itable[V1_TABLE_BLOCKS];
+    uint8_t ibm[32];
+} snapshot_v1_t;
+
+typedef struct superblock_v1
+{
+    uint32_t magic;
+    uint32_t version;
+    uint16_t gen;
+    uint16_t sweep_pending;
+    snapshot_v1_t snapshots[MAX_SNAPSHOTS];
+    group_desc_t groups[GROUP_COUNT];
+    int32_t orphans[MAX_ORPHANS];
+} superblock_v1_t;
+
+#define FIRST_DATA (INODE_TABLE_START + INODE_TABLE_BLOCKS) //blocks past the new table
+
+//The inode in a version 1 table, 0 for the ones that didn't fit in their block
+static inode_v1_t *v1_inode(const int *table, int inum)
+{
+    int slot = inum % V1_INODES_PER_BLOCK;
+    if ((slot + 1) * sizeof(inode_v1_t) > BLOCK_SIZE)
+    {
+        return 0;
+    }
+    return (inode_v1_t *)blocks_get_block(table[inum / V1_INODES_PER_BLOCK]) + slot;
+}
+
+static int free_data_blocks()
+{
+    int count = 0;
+    for (int bnum = FIRST_DATA; bnum < BLOCK_COUNT; bnum++)
+    {
+        count += !bitmap_get(get_blocks_bitmap(), bnum);
+    }
+    return count;
+}
+
+//Mark the first free block past the new table in use, like claim_block but without the groups
+static int take_block(uint16_t birth)
+{
+    void *bbm = get_blocks_bitmap();
+    for (int bnum = FIRST_DATA; bnum < BLOCK_COUNT; bnum++)
+    {
+        if (!bitmap_get(bbm, bnum))
+        {
+            bitmap_put(bbm, bnum, 1);
+            get_block_info(bnum)->extra_refs = 0;
+            get_block_info(bnum)->birth = birth;
+            return bnum;
+        }
+    }
+    return -1;
+}
+
+//Point every reference to block from in one version 1 table at block to
+static void remap_table(const int *table, const uint8_t *ibm, int from, int to)
+{
+    for (int inum = 0; inum < BLOCK_COUNT; inum++)
+    {
+        inode_v1_t *node = v1_inode(table, inum);
+        if (node == 0 || !bitmap_get((void *)ibm, inum))
+        {
+            continue;
+        }
+        int nblocks = bytes_to_blocks(node->size);
+        for (int i = 0; i < nblocks && i < DIRECT_BLOCKS; i++)
+        {
+            node->blocks[i] = node->blocks[i] == from ? to : node->blocks[i];
+        }
+        node->cont_block = node->cont_block == from ? to : node->cont_block;
+        if (nblocks > DIRECT_BLOCKS && node->cont_block > 0 && node->cont_block < BLOCK_COUNT)
+        { //a cont_block shared with a snapshot is gone through twice, which changes nothing
+            int *pointers = (int *)blocks_get_block(node->cont_block);
+            for (int i = 0; i < nblocks - DIRECT_BLOCKS && i < BLOCK_SIZE / (int)sizeof(int); i++)
+            {
+                pointers[i] = pointers[i] == from ? to : pointers[i];
+            }
+        }
+    }
+}
+
+//Move the block in the way of the new table somewhere free, returns 1 if it had to move
+static int relocate(superblock_v1_t *sb, int from)
+{
+    void *bbm = get_blocks_bitmap();
+    if (!bitmap_get(bbm, from))
+    {
+        bitmap_put(bbm, from, 1);
+        return 0;
+    }
+    int to = take_block(0);
+    memcpy(blocks_get_block(to), blocks_read_block(from), BLOCK_SIZE);
+    *get_block_info(to) = *get_block_info(from); //still shared the same way, born when it was
+    memset(get_block_info(from), 0, sizeof(block_info_t));
+
+    static const int live_v1[V1_TABLE_BLOCKS] = {INODE_TABLE_START, INODE_TABLE_START + 1};
+    remap_table(live_v1, get_inode_bitmap(), from, to);
+    for (int s = 0; s < MAX_SNAPSHOTS; s++)
+    {
+        snapshot_v1_t *snap = &sb->snapshots[s];
+        if (snap->name[0] == '\0')
+        {
+            continue;
+        }
+        for (int i = 0; i < V1_TABLE_BLOCKS; i++)
+        { //the table itself may be what moved
+            snap->itable[i] = snap->itable[i] == from ? to : snap->itable[i];
+        }
+        remap_table(snap->itable, snap->ibm, from, to);
+    }
+    printf("upgrade: block %d moved to %d\n", from, to);
+    return 1;
+}
+
+static void convert(const inode_v1_t *old, inode_t *node, int64_t now)
+{
+    memset(node, 0, sizeof(inode_t));
+    node->mode = old->mode;
+    node->refs = old->refs;
+    node->size = old->size;
+    memcpy(node->blocks, old->blocks, sizeof(node->blocks));
+    node->cont_block = old->cont_block;
+    node->atime = now;
+    node->mtime = now;
+    node->ctime = now;
+}
+
+//Fill the blocks of a version 2 table from a copy of a version 1 table, 2 blocks in memory
+static void convert_table(const void *v1_table, const int *table, const uint8_t *ibm, int64_t now)
+{
+    for (int i = 0; i < INODE_TABLE_BLOCKS; i++)
+    {
+        memset(blocks_get_block(table[i]), 0, BLOCK_SIZE);
+    }
+    for (int inum = 0; inum < BLOCK_COUNT; inum++)
+    {
+        int slot = inum % V1_INODES_PER_BLOCK;
+        if ((slot + 1) * sizeof(inode_v1_t) <= BLOCK_SIZE && bitmap_get((void *)ibm, inum))
+        { //free inodes start out empty
+            const inode_v1_t *old =
+                (const inode_v1_t *)((const char *)v1_table + inum / V1_INODES_PER_BLOCK * BLOCK_SIZE) + slot;
+            convert(old, get_inode_in(table, inum), now);
+        }
+    }
+}
+
+typedef struct dir_walk
+{
+    const uint8_t *ibm;
+    uint8_t seen[GEOMETRY_BLOCK_COUNT];
+    int queue[GEOMETRY_BLOCK_COUNT];
+    int queued;
+} dir_walk_t;
+
+static void queue_dir(dir_walk_t *walk, int inum)
+{
+    if (inum >= 0 && inum < BLOCK_COUNT && bitmap_get((void *)walk->ibm, inum) && !walk->seen[inum])
+    {
+        walk->seen[inum] = 1;
+        walk->queue[walk->queued++] = inum;
+    }
+}
+
+//Directories are known by their entries, version 1 never set the type in the inode
+static int queue_subdir(dirent_t *entry, void *arg)
+{
+    if (S_ISDIR(entry->mode))
+    {
+        queue_dir((dir_walk_t *)arg, entry->inum);
+    }
+    return 0;
+}
+
+//Build the bloom filter of every directory block in the table's tree. The header bytes
+//the filter took over were left as whatever was on the stack when the block was first written
+static int refilter_table(const int *table, const uint8_t *ibm)
+{
+    static dir_walk_t walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.ibm = ibm;
+    queue_dir(&walk, ROOT_INUM);
+    for (int inum = 0; inum < BLOCK_COUNT; inum++)
+    { //and any that say so themselves, named or not
+        if (S_ISDIR(get_inode_in(table, inum)->mode))
+        {
+            queue_dir(&walk, inum);
+        }
+    }
+    int count = 0;
+    for (int i = 0; i < walk.queued; i++)
+    {
+        inode_t *dir = get_inode_in(table, walk.queue[i]);
+        count += directory_refilter_all(dir);
+        directory_foreach(dir, queue_subdir, &walk);
+    }
+    return count;
+}
+
+int upgrade_image()
+{
+    superblock_v1_t old;
+    memcpy(&old, get_superblock(), sizeof(old));
+    if (old.version != 1 || BLOCK_SIZE != 4096)
+    { //version 1 only had 4K blocks
+        return -EINVAL;
+    }
+    int snapshots = 0;
+    for (int s = 0; s < MAX_SNAPSHOTS; s++)
+    {
+        snapshots += old.snapshots[s].name[0] != '\0';
+    }
+    int needed = snapshots * INODE_TABLE_BLOCKS;
+    for (int bnum = INODE_TABLE_START + V1_TABLE_BLOCKS; bnum < FIRST_DATA; bnum++)
+    {
+        needed += bitmap_get(get_blocks_bitmap(), bnum);
+    }
+    if (free_data_blocks() < needed)
+    {
+        printf("upgrade: %d free blocks needed, %d free\n", needed, free_data_blocks());
+        return -ENOSPC;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t now = ts.tv_sec * 1000000000L + ts.tv_nsec;
+
+    //out of the way of the table first, the image is still a good version 1 image after
+    int moved = 0;
+    for (int bnum = INODE_TABLE_START + V1_TABLE_BLOCKS; bnum < FIRST_DATA; bnum++)
+    {
+        moved += relocate(&old, bnum);
+    }
+
+    superblock_t sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = old.magic;
+    sb.version = NUFS_VERSION;
+    sb.gen = old.gen;
+    sb.sweep_pending = old.sweep_pending;
+    memcpy(sb.groups, old.groups, sizeof(sb.groups));
+    memcpy(sb.orphans, old.orphans, sizeof(sb.orphans));
+    char *v1_table = malloc(V1_TABLE_BLOCKS * BLOCK_SIZE);
+    assert(v1_table != 0);
+    for (int s = 0; s < MAX_SNAPSHOTS; s++)
+    {
+        snapshot_v1_t *from = &old.snapshots[s];
+        snapshot_t *to = &sb.snapshots[s];
+        if (from->name[0] == '\0')
+        {
+            continue;
+        }
+        memcpy(to->name, from->name, sizeof(to->name));
+        to->gen = from->gen;
+        memcpy(to->ibm, from->ibm, sizeof(to->ibm));
+        for (int i = 0; i < INODE_TABLE_BLOCKS; i++)
+        {
+            to->itable[i] = take_block(old.gen);
+        }
+        for (int i = 0; i < V1_TABLE_BLOCKS; i++)
+        {
+            memcpy(v1_table + i * BLOCK_SIZE, blocks_read_block(from->itable[i]), BLOCK_SIZE);
+        }
+        convert_table(v1_table, to->itable, to->ibm, now);
+    }
+
+    static const int live[INODE_TABLE_BLOCKS] = INODE_TABLE_LIVE;
+    for (int i = 0; i < V1_TABLE_BLOCKS; i++)
+    {
+        memcpy(v1_table + i * BLOCK_SIZE, blocks_read_block(live[i]), BLOCK_SIZE);
+    }
+    convert_table(v1_table, live, get_inode_bitmap(), now);
+    free(v1_table);
+    memcpy(get_superblock(), &sb, sizeof(sb));
+
+    //the old copies of the snapshot tables go last
+    for (int s = 0; s < MAX_SNAPSHOTS; s++)
+    {
+        for (int i = 0; old.snapshots[s].name[0] != '\0' && i < V1_TABLE_BLOCKS; i++)
+        {
+            bitmap_put(get_blocks_bitmap(), old.snapshots[s].itable[i], 0);
+            memset(get_block_info(old.snapshots[s].itable[i]), 0, sizeof(block_info_t));
+        }
+    }
+    int refiltered = refilter_table(live, get_inode_bitmap());
+    for (int s = 0; s < MAX_SNAPSHOTS; s++)
+    { //snapshots are looked up through the same filters
+        if (sb.snapshots[s].name[0] != '\0')
+        {
+            refiltered += refilter_table(sb.snapshots[s].itable, sb.snapshots[s].ibm);
+        }
+    }
+    printf("upgrade_image() -> version %d, %d blocks moved, %d snapshot tables, %d directory blocks refiltered\n",
+           NUFS_VERSION, moved, snapshots, refiltered);
+    return 0;
+}
@@ -0,0 +1,27 @@
+// Bringing images made by older versions up to NUFS_VERSION at mount.
+//
+// Version 1 packed 128 inodes of 32 bytes into each of blocks 1-2, with an
+// int size and no timestamps. Version 2 inodes are 64 bytes, so the live table takes blocks
+// 1-4 and each snapshot's copy takes 4 blocks. The upgrade moves whatever
+// is in blocks 3-4 somewhere free and points every reference to them
+// (live, snapshot and cont_block pointers) at the copies, converts every
+// snapshot's table into 4 new blocks, rewrites the live table in place and
+// lays the superblock out again for the larger snapshot records. Converted
+// inodes get the time of the upgrade as all three timestamps. Every
+// directory block, live or in a snapshot, gets its bloom filter built from
+// its entries: blocks written before the filters existed hold stack garbage
+// in those header bytes, which would hide names from lookups. Directories
+// are found from the root through their entries, the first images never
+// set the type in the inode.
+//
+// It works on the bitmaps and block_info directly, before the allocation
+// groups and the extent index are set up from them, and changes nothing if
+// the image doesn't have the free blocks it needs. It isn't crash safe: an
+// upgrade cut short leaves an image nothing can read, so keep a copy.
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+// Upgrade the open image, whose superblock says it is older. Returns 0 or -errno
+int upgrade_image();
+
+#endif
@@ -0,0 +1,142 @@
+/**
+ * @file uring.c
+ *
+ * The ring setup and the head/tail dance from io_uring(7).
+ */
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+int uring_init(uring_t *ring, unsigned entries)
+{
+  struct io_uring_params params;
+  memset(ring, 0, sizeof(uring_t));
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0)
+  {
+    return -errno;
+  }
+  ring->entries = params.sq_entries;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  { // both rings live in one mapping
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+  ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = params.features & IORING_FEAT_SINGLE_MMAP
+                      ? ring->sq_ring
+                      : mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(0, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+  {
+    int error = -errno;
+    close(ring->fd);
+    return error;
+  }
+
+  ring->sq_head = ring->sq_ring + params.sq_off.head;
+  ring->sq_tail = ring->sq_ring + params.sq_off.tail;
+  ring->sq_mask = ring->sq_ring + params.sq_off.ring_mask;
+  ring->sq_array = ring->sq_ring + params.sq_off.array;
+  ring->cq_head = ring->cq_ring + params.cq_off.head;
+  ring->cq_tail = ring->cq_ring + params.cq_off.tail;
+  ring->cq_mask = ring->cq_ring + params.cq_off.ring_mask;
+  ring->cqes = ring->cq_ring + params.cq_off.cqes;
+  return 0;
+}
+
+int uring_register_file(uring_t *ring, int fd)
+{
+  int rv = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, &fd, 1);
+  return rv < 0 ? -errno : 0;
+}
+
+int uring_register_buffer(uring_t *ring, void *base, size_t size)
+{
+  struct iovec iov = {base, size};
+  int rv = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1);
+  return rv < 0 ? -errno : 0;
+}
+
+struct io_uring_sqe *uring_sqe(uring_t *ring)
+{
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *ring->sq_tail + ring->queued;
+  if (tail - head >= ring->entries || ring->inflight + ring->queued >= ring->entries)
+  { // the completion queue is twice as big, so this keeps it from overflowing too
+    return 0;
+  }
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  ring->queued++;
+  return sqe;
+}
+
+int uring_submit(uring_t *ring, unsigned wait)
+{
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->queued, __ATOMIC_RELEASE);
+  ring->inflight += ring->queued;
+  ring->queued = 0;
+  // everything the kernel hasn't taken yet, including what a failed call left behind
+  unsigned submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (wait > ring->inflight)
+  {
+    wait = ring->inflight;
+  }
+  if (submit == 0 && wait == 0)
+  {
+    return 0;
+  }
+  int rv = syscall(__NR_io_uring_enter, ring->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+  return rv < 0 ? -errno : 0;
+}
+
+int uring_reap(uring_t *ring, void (*done)(uint64_t user_data, int result))
+{
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  int reaped = 0;
+  for (; head != tail; head++, reaped++)
+  {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    done(cqe->user_data, cqe->res);
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  ring->inflight -= reaped;
+  return reaped;
+}
+
+void uring_exit(uring_t *ring, void (*done)(uint64_t user_data, int result))
+{
+  while (ring->queued + ring->inflight > 0)
+  {
+    int rv = uring_submit(ring, 1);
+    uring_reap(ring, done);
+    if (rv != 0 && rv != -EINTR && rv != -EAGAIN)
+    {
+      break;
+    }
+  }
+  munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+  if (ring->cq_ring != ring->sq_ring)
+  {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+}
@@ -0,0 +1,83 @@
+/**
+ * @file uring.h
+ *
+ * Just enough io_uring, straight on the system calls (no liburing): one
+ * ring, one registered file and one registered buffer.
+ */
+#ifndef URING_H
+#define URING_H
+
+#include "geometry.h"
+
+// <linux/fs.h>, pulled in by io_uring.h, defines its own 1K BLOCK_SIZE
+#undef BLOCK_SIZE
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+#undef BLOCK_SIZE
+#ifndef NUFS_RUNTIME_GEOMETRY
+#define BLOCK_SIZE GEOMETRY_BLOCK_SIZE // blocks.h's
+#endif
+
+typedef struct uring
+{
+  int fd;
+  unsigned entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size;
+  unsigned queued;   // sqes filled in but not submitted yet
+  unsigned inflight; // submitted and not reaped yet
+} uring_t;
+
+/**
+ * Set up a ring.
+ *
+ * @param ring The ring to set up.
+ * @param entries Submission queue size, a power of two.
+ *
+ * @return 0, or a negative errno (e.g. -ENOSYS on kernels without io_uring).
+ */
+int uring_init(uring_t *ring, unsigned entries);
+
+/**
+ * Register the file operations go to (IOSQE_FIXED_FILE with index 0).
+ */
+int uring_register_file(uring_t *ring, int fd);
+
+/**
+ * Register the buffer READ_FIXED and WRITE_FIXED use (buf_index 0).
+ */
+int uring_register_buffer(uring_t *ring, void *base, size_t size);
+
+/**
+ * The next free submission queue entry, cleared, or 0 if the queue is full
+ * and has to be submitted first.
+ */
+struct io_uring_sqe *uring_sqe(uring_t *ring);
+
+/**
+ * Submit everything queued and wait until at least wait operations have
+ * completed (fewer if fewer are in flight). What a failed call didn't get
+ * to is submitted by the next one.
+ *
+ * @return 0, or a negative errno (-EINTR if a signal cut the wait short).
+ */
+int uring_submit(uring_t *ring, unsigned wait);
+
+/**
+ * Hand every completed operation to done, without waiting.
+ *
+ * @return The number of completions handed out.
+ */
+int uring_reap(uring_t *ring, void (*done)(uint64_t user_data, int result));
+
+/**
+ * Tear the ring down. Operations still in flight are waited for first.
+ */
+void uring_exit(uring_t *ring, void (*done)(uint64_t user_data, int result));
+
+#endif
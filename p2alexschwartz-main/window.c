@@ -0,0 +1,135 @@
+#include "window.h"
+#include "bitmap.h"
+#include "group.h"
+
+#include <stdio.h>
+
+typedef struct window
+{
+    inode_t *node;      //0 for an empty slot
+    int next;           //the next reserved block
+    int end;            //one past the last reserved block
+    unsigned long used; //for picking the least recently used slot
+} window_t;
+
+//everything here runs under the storage lock
+static window_t windows[MAX_WINDOWS];
+static unsigned long clock_now = 0;
+static int window_blocks = DEFAULT_WINDOW_BLOCKS;
+static window_stats_t stats;
+
+void window_set_size(int blocks)
+{
+    window_blocks = blocks < 0 ? 0 : blocks;
+}
+
+static int unclaimed(int bnum)
+{
+    return !bitmap_get(get_blocks_bitmap(), bnum) && !block_reserved(bnum);
+}
+
+//How many blocks from bnum on are free and not reserved, up to max
+static int run_at(int bnum, int max)
+{
+    int length = 0;
+    while (length < max && bnum + length < BLOCK_COUNT && unclaimed(bnum + length))
+    {
+        length++;
+    }
+    return length;
+}
+
+//Right after the file's last block if that is free, else the smallest run that holds a whole
+//window from the last block's group on (the home group for a new file), else the longest run
+static int find_run(int last, int *length)
+{
+    if (last > 0 && last + 1 < BLOCK_COUNT && (*length = run_at(last + 1, window_blocks)) > 0)
+    {
+        return last + 1;
+    }
+    return blocks_find_run(window_blocks, last > 0 ? group_of(last) : home_group(), length);
+}
+
+static void release(window_t *window)
+{
+    for (int bnum = window->next; bnum < window->end; bnum++)
+    {
+        if (block_reserved(bnum))
+        { //alloc_block may have taken it back already
+            block_reserve(bnum, 0);
+            stats.released++;
+        }
+    }
+    window->node = 0;
+}
+
+int window_alloc(inode_t *node, int file_bnum)
+{
+    if (window_blocks == 0)
+    {
+        return alloc_block();
+    }
+    window_t *window = 0;
+    window_t *slot = &windows[0];
+    for (int i = 0; i < MAX_WINDOWS; i++)
+    {
+        if (windows[i].node == node)
+        {
+            window = &windows[i];
+        }
+        if (slot->node != 0 && (windows[i].node == 0 || windows[i].used < slot->used))
+        {
+            slot = &windows[i];
+        }
+    }
+    if (window != 0 && window->next < window->end && block_reserved(window->next))
+    {
+        window->used = ++clock_now;
+        stats.hits++;
+        return alloc_block_at(window->next++);
+    }
+
+    //used up, or none yet: reserve a new one
+    if (window == 0)
+    {
+        window = slot;
+    }
+    if (window->node != 0)
+    {
+        release(window);
+    }
+    int last = file_bnum > 0 ? inode_get_bnum(node, file_bnum - 1) : 0;
+    int length;
+    int start = find_run(last, &length);
+    if (start == -1)
+    { //nothing free outside of other windows
+        return alloc_block();
+    }
+    for (int bnum = start + 1; bnum < start + length; bnum++)
+    {
+        block_reserve(bnum, 1);
+    }
+    window->node = node;
+    window->next = start + 1;
+    window->end = start + length;
+    window->used = ++clock_now;
+    stats.opened++;
+    printf("window of %d blocks at %d for file block %d\n", length, start, file_bnum);
+    return alloc_block_at(start);
+}
+
+void window_release(inode_t *node)
+{
+    for (int i = 0; i < MAX_WINDOWS; i++)
+    {
+        if (windows[i].node == node)
+        {
+            release(&windows[i]);
+        }
+    }
+}
+
+window_stats_t *window_get_stats()
+{
+    return &stats;
+}
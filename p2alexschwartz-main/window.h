@@ -0,0 +1,38 @@
+// Allocation windows for growing files.
+//
+// alloc_block hands out the first free block, so files appended at the
+// same time end up interleaved block by block and reading one of them
+// back jumps all over the image. A file that grows instead reserves a run
+// of free blocks right after its last block (or the first run long enough
+// when that spot is taken) and takes its next blocks from that run. The
+// rest of the run is given back when the file is closed or truncated, or
+// when another file needs its window slot. Reservations are only kept in
+// memory and give way when the image is otherwise full.
+#ifndef WINDOW_H
+#define WINDOW_H
+
+#include "inode.h"
+
+#define DEFAULT_WINDOW_BLOCKS 8
+#define MAX_WINDOWS 32 // files growing at the same time
+
+typedef struct window_stats
+{
+    long hits;     // blocks taken from a window
+    long opened;   // windows reserved
+    long released; // reserved blocks given back unused
+} window_stats_t;
+
+// Blocks reserved per window, 0 turns windows off
+void window_set_size(int blocks);
+
+// Allocate the block for file block file_bnum of node, which is growing, from its window
+int window_alloc(inode_t *node, int file_bnum);
+
+// Give back what is left of node's window
+void window_release(inode_t *node);
+
+// Counters since mount
+window_stats_t *window_get_stats();
+
+#endif
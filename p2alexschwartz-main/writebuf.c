@@ -0,0 +1,154 @@
+#include "writebuf.h"
+
+#include <errno.h>
+#include <string.h>
+
+//every open file's buffer, guarded by the storage lock
+static writebuf_t *open_files = 0;
+static writebuf_stats_t stats;
+
+void writebuf_open(writebuf_t *wb, int inum)
+{
+    wb->inum = inum;
+    wb->start = 0;
+    wb->length = 0;
+    wb->error = 0;
+    wb->prev = 0;
+    wb->next = open_files;
+    if (open_files != 0)
+    {
+        open_files->prev = wb;
+    }
+    open_files = wb;
+}
+
+int writebuf_close(writebuf_t *wb)
+{
+    int rv = writebuf_flush(wb);
+    if (wb->prev != 0)
+    {
+        wb->prev->next = wb->next;
+    }
+    else
+    {
+        open_files = wb->next;
+    }
+    if (wb->next != 0)
+    {
+        wb->next->prev = wb->prev;
+    }
+    return rv;
+}
+
+int writebuf_flush(writebuf_t *wb)
+{
+    if (wb->length > 0)
+    {
+        int length = wb->length;
+        wb->length = 0;
+        int rv = inode_write(get_inode(wb->inum), wb->data, length, wb->start);
+        stats.flushes++;
+        stats.bytes += rv > 0 ? rv : 0;
+        if (rv != length)
+        { //grow_inode ran out of blocks part way, or a block couldn't be read
+            wb->error = rv < 0 ? rv : -ENOSPC;
+        }
+    }
+    int rv = wb->error;
+    wb->error = 0;
+    return rv;
+}
+
+void writebuf_flush_inode(int inum, writebuf_t *skip)
+{
+    for (writebuf_t *wb = open_files; wb != 0; wb = wb->next)
+    {
+        if (wb != skip && wb->inum == inum && wb->length > 0)
+        { //the error stays for its own handle
+            int error = writebuf_flush(wb);
+            wb->error = wb->error != 0 ? wb->error : error;
+        }
+    }
+}
+
+void writebuf_flush_all()
+{
+    for (writebuf_t *wb = open_files; wb != 0; wb = wb->next)
+    {
+        if (wb->length > 0)
+        {
+            int error = writebuf_flush(wb);
+            wb->error = wb->error != 0 ? wb->error : error;
+        }
+    }
+}
+
+int writebuf_is_open(int inum)
+{
+    for (writebuf_t *wb = open_files; wb != 0; wb = wb->next)
+    {
+        if (wb->inum == inum)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+off_t writebuf_size(int inum, off_t size)
+{
+    for (writebuf_t *wb = open_files; wb != 0; wb = wb->next)
+    {
+        if (wb->inum == inum && wb->length > 0 && wb->start + wb->length > size)
+        {
+            size = wb->start + wb->length;
+        }
+    }
+    return size;
+}
+
+int writebuf_write(writebuf_t *wb, const char *buf, size_t size, off_t offset)
+{
+    if (wb->error != 0)
+    {
+        return writebuf_flush(wb);
+    }
+    //anything another handle buffered for this file goes first
+    writebuf_flush_inode(wb->inum, wb);
+    if (wb->length > 0 && (offset != wb->start + wb->length || wb->length + size > WRITEBUF_SIZE))
+    {
+        int rv = writebuf_flush(wb);
+        if (rv != 0)
+        {
+            return rv;
+        }
+    }
+    if (size >= WRITEBUF_SMALL)
+    {
+        stats.direct++;
+        int rv = writebuf_flush(wb);
+        return rv != 0 ? rv : inode_write(get_inode(wb->inum), buf, size, offset);
+    }
+
+    if (wb->length == 0)
+    {
+        wb->start = offset;
+    }
+    memcpy(wb->data + wb->length, buf, size);
+    wb->length += size;
+    stats.buffered++;
+    if (wb->length == WRITEBUF_SIZE)
+    {
+        int rv = writebuf_flush(wb);
+        if (rv != 0)
+        {
+            return rv;
+        }
+    }
+    return size;
+}
+
+writebuf_stats_t *writebuf_get_stats()
+{
+    return &stats;
+}
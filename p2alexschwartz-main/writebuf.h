@@ -0,0 +1,73 @@
+// Write combining for small writes through an open file.
+//
+// Line-oriented writers append a few dozen bytes at a time, and each write
+// used to look its path up, grow the inode and copy into the block on its
+// own. Every open file keeps a writebuf_t instead. A write smaller than
+// WRITEBUF_SMALL that starts where the handle's buffered bytes end is only
+// copied into the buffer. The buffer goes to the image in one inode_write
+// when it is full, when a write doesn't follow on from it, and on flush,
+// fsync and release. Reads, truncates and ioctls on the file, and writes
+// through other handles, put its buffered bytes in the image first, so
+// nothing sees the file without them. A handle stays bound to its inode
+// when the file is unlinked, the inode is only freed once the last handle
+// is released (see orphan_release). getattr and readdir count them in
+// the size. A buffer that can't be written back (the image is full) keeps
+// the error for the handle's next write, flush or fsync.
+#ifndef WRITEBUF_H
+#define WRITEBUF_H
+
+#include "inode.h"
+
+#include <sys/types.h>
+
+#define WRITEBUF_SIZE 4096  // bytes buffered per open file
+#define WRITEBUF_SMALL 1024 // larger writes go straight to the image
+
+typedef struct writebuf
+{
+    int inum;              // the open file, -1 for a handle that never writes (golden mounts)
+    off_t start;           // where the buffered bytes go in the file
+    int length;            // 0 when nothing is buffered
+    int error;             // -errno from a write back the handle hasn't been told about yet
+    struct writebuf *next; // every open file's buffer, in one list
+    struct writebuf *prev;
+    char data[WRITEBUF_SIZE];
+} writebuf_t;
+
+typedef struct writebuf_stats
+{
+    long buffered; // writes that were only copied into a buffer
+    long direct;   // writes that went straight to the image
+    long flushes;  // buffers written back
+    long bytes;    // bytes written back from buffers
+} writebuf_stats_t;
+
+// Start buffering for an open file, with the storage lock held
+void writebuf_open(writebuf_t *wb, int inum);
+
+// Write back what is buffered and stop buffering, with the storage lock held.
+// Returns 0 or the pending -errno
+int writebuf_close(writebuf_t *wb);
+
+// Write size bytes at offset through the open file, buffering small ones.
+// Returns the number of bytes taken or -errno
+int writebuf_write(writebuf_t *wb, const char *buf, size_t size, off_t offset);
+
+// Put the buffered bytes in the image. Returns 0 or the pending -errno
+int writebuf_flush(writebuf_t *wb);
+
+// Put every open file's buffered bytes for inum in the image, except those of skip
+void writebuf_flush_inode(int inum, writebuf_t *skip);
+
+// Put every buffer in the image
+void writebuf_flush_all();
+
+// Whether some handle has inum open
+int writebuf_is_open(int inum);
+
+// The size of inum counting buffered bytes, given its size in the inode
+off_t writebuf_size(int inum, off_t size);
+
+writebuf_stats_t *writebuf_get_stats();
+
+#endif